@@ -4,9 +4,11 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <time.h>
+#include <sys/types.h>
 
 #define FIT_DIR ".fit"
 #define FIT_OBJECTS_DIR ".fit/objects"
+#define FIT_PACK_DIR ".fit/objects/pack"
 #define FIT_REFS_DIR ".fit/refs"
 #define FIT_HEADS_DIR ".fit/refs/heads"
 #define FIT_INDEX_FILE ".fit/index"
@@ -18,6 +20,11 @@
 #define HASH_SIZE 32
 #define HASH_HEX_SIZE 64
 
+#define PACK_SIGNATURE "PACK"
+#define PACK_VERSION 2
+#define PACK_HEADER_SIZE 12
+#define PACK_ENTRY_HEADER_SIZE (4 + 4 + HASH_SIZE + 4)
+
 typedef enum {
     OBJ_BLOB = 1,
     OBJ_TREE = 2,
@@ -50,6 +57,94 @@ typedef struct {
     time_t timestamp;
 } commit_t;
 
+/* Set of object hashes (hash.c) */
+typedef struct {
+    hash_t *slots;
+    uint8_t *used;
+    size_t capacity;
+    size_t count;
+} hash_set_t;
+
+/* Called for each ref by ref_for_each(); return non-zero to stop */
+typedef int (*ref_each_fn)(const char *name, const hash_t *hash, void *data);
+
+/* One ref update in a reftable; a null new_hash deletes (reftable.c) */
+typedef struct {
+    const char *name;
+    hash_t old_hash;
+    hash_t new_hash;
+} ref_change_t;
+
+/* Called for each logged ref update, newest first per ref */
+typedef int (*ref_log_fn)(const char *name, uint64_t update_index, const hash_t *old_hash,
+                          const hash_t *new_hash, time_t time, void *data);
+
+/* Loose object writer that fsyncs in batches (object.c) */
+typedef struct object_batch object_batch_t;
+
+/* Session transport, optionally framed and compressed (wire.c) */
+typedef struct wire wire_t;
+
+/* Generated pack on its way into the daemon's pack cache (packcache.c) */
+typedef struct pack_cache_writer pack_cache_writer_t;
+
+/* Set of ref updates applied together under lock files (refs.c) */
+typedef struct ref_transaction ref_transaction_t;
+
+/* Frame channels; progress and error frames need CAP_SIDEBAND */
+#define WIRE_CHANNEL_DATA 0
+#define WIRE_CHANNEL_PROGRESS 1
+#define WIRE_CHANNEL_ERROR 2
+
+/* Objects a partial clone leaves out (promisor.c) */
+typedef enum {
+    FILTER_NONE = 0,
+    FILTER_BLOB_NONE = 1,   /* No blobs at all */
+    FILTER_BLOB_LIMIT = 2   /* Blobs larger than limit bytes */
+} filter_type_t;
+
+typedef struct {
+    filter_type_t type;
+    uint64_t limit;
+} object_filter_t;
+
+/* A shallow fetch: the client's shallow commits, and how deep to go */
+typedef struct {
+    const hash_t *commits;
+    size_t count;
+    int depth;      /* Commits per start; 0 for no limit */
+    int deepen;     /* Also walk on from behind the shallow commits */
+} shallow_spec_t;
+
+/* Directories selected by sparse checkout (sparse.c); disabled when !enabled */
+typedef struct {
+    char **dirs;
+    size_t count;
+    int enabled;
+} sparse_t;
+
+/* Incremental hashing state (wraps an OpenSSL digest context) */
+typedef struct {
+    void *impl;
+} hash_ctx_t;
+
+/* Byte sink for generated packs: returns 0 on success, -1 on error */
+typedef int (*pack_write_fn)(void *ctx, const void *buf, size_t len);
+
+/* Called after each object written by pack_write() */
+typedef void (*pack_progress_fn)(void *ctx, size_t done, size_t total);
+
+/* Byte source for streamed packs: returns bytes read, 0 on EOF, -1 on error */
+typedef ssize_t (*pack_read_fn)(void *ctx, void *buf, size_t len);
+
+typedef struct {
+    hash_t pack_hash;       /* Checksum of the whole pack stream */
+    uint32_t num_objects;
+    size_t bytes;
+    hash_t first_commit;    /* Valid when has_first_commit is set */
+    int has_first_commit;
+} pack_index_result_t;
+
 typedef struct index_entry {
     char *path;
     hash_t hash;
@@ -62,12 +157,28 @@ void hash_data(const void *data, size_t len, hash_t *out);
 void hash_to_hex(const hash_t *hash, char *hex);
 int hex_to_hash(const char *hex, hash_t *hash);
 int hash_equal(const hash_t *a, const hash_t *b);
+int hash_init(hash_ctx_t *ctx);
+void hash_update(hash_ctx_t *ctx, const void *data, size_t len);
+void hash_final(hash_ctx_t *ctx, hash_t *out);
+void hash_abort(hash_ctx_t *ctx);
+void hash_set_init(hash_set_t *set);
+int hash_set_add(hash_set_t *set, const hash_t *hash);
+int hash_set_contains(const hash_set_t *set, const hash_t *hash);
+void hash_set_free(hash_set_t *set);
 
 /* object.c */
 int object_write(const object_t *obj, hash_t *out);
 int object_read(const hash_t *hash, object_t *obj);
+int object_exists(const hash_t *hash);
+int object_info(const hash_t *hash, obj_type *type, size_t *size);
 void object_free(object_t *obj);
 char* object_path(const hash_t *hash);
+int object_header(obj_type type, size_t size, char *buf, size_t buf_size);
+object_batch_t* object_batch_new(size_t limit);
+int object_batch_add(object_batch_t *batch, const hash_t *hash, obj_type type,
+                     const void *data, size_t size);
+int object_batch_flush(object_batch_t *batch);
+void object_batch_free(object_batch_t *batch);
 
 /* tree.c */
 int tree_write(tree_entry_t *entries, hash_t *out);
@@ -78,6 +189,7 @@ tree_entry_t* tree_entry_new(uint32_t mode, const char *name, const hash_t *hash
 /* commit.c */
 int commit_write(const commit_t *commit, hash_t *out);
 int commit_read(const hash_t *hash, commit_t *commit);
+int commit_is_ancestor(const hash_t *ancestor, const hash_t *descendant);
 void commit_free(commit_t *commit);
 
 /* index.c */
@@ -94,19 +206,129 @@ int ref_resolve_head(hash_t *hash);
 int ref_update_head(const hash_t *hash);
 char* ref_current_branch(void);
 int ref_delete(const char *name);
+int ref_for_each(const char *prefix, ref_each_fn fn, void *data);
+int ref_pack(void);
+int ref_convert_reftable(void);
+ref_transaction_t *ref_transaction_begin(void);
+int ref_transaction_update(ref_transaction_t *tx, const char *name, const hash_t *old_hash,
+                           const hash_t *new_hash);
+int ref_transaction_commit(ref_transaction_t *tx);
+void ref_transaction_free(ref_transaction_t *tx);
+
+/* reftable.c */
+int reftable_enabled(void);
+int reftable_lock(void);
+void reftable_unlock(void);
+int reftable_read(const char *name, hash_t *hash);
+int reftable_write(const ref_change_t *changes, size_t count);
+int reftable_for_each(const char *prefix, ref_each_fn fn, void *data);
+int reftable_log_for_each(const char *name, ref_log_fn fn, void *data);
+int reftable_compact(int full);
+
+/* revwalk.c */
+int rev_list_objects(const hash_t *wants, size_t want_count,
+                     const hash_t *haves, size_t have_count,
+                     hash_t **objects_out, size_t *count_out);
+int rev_list_shallow(const hash_t *wants, size_t want_count,
+                     const hash_t *haves, size_t have_count, const shallow_spec_t *spec,
+                     hash_t **objects_out, size_t *count_out,
+                     hash_t **shallow_out, size_t *shallow_count_out);
 
 /* pack.c */
 int pack_objects(const hash_t *hashes, size_t count, const char *pack_file);
+int pack_write(const hash_t *hashes, size_t count, pack_write_fn write_fn,
+               pack_progress_fn progress_fn, void *ctx);
+int pack_id(const hash_t *hashes, size_t count, hash_t *out);
+void pack_set_threads(int threads);
+void pack_set_compression(int level);
 int unpack_objects(const char *pack_file);
+int unpack_stream(pack_read_fn read_fn, void *ctx, pack_index_result_t *result);
+int pack_receive(pack_read_fn read_fn, void *ctx, pack_index_result_t *result);
+int pack_receive_partial(pack_read_fn read_fn, void *ctx, const char *partial_path,
+                         pack_index_result_t *result);
+void pack_set_unpack_limit(int limit);
+
+/* packfile.c */
+int pack_index_stream(pack_read_fn read_fn, void *ctx, pack_index_result_t *result);
+int pack_index_partial(pack_read_fn read_fn, void *ctx, const char *partial_path,
+                       pack_index_result_t *result);
+int pack_read_object(const hash_t *hash, object_t *obj);
+int pack_has_object(const hash_t *hash);
+int pack_object_info(const hash_t *hash, obj_type *type, size_t *size);
+int pack_open_matching(const hash_t *objects, size_t count, hash_t *pack_hash, uint64_t *size);
+
+/* ewah.c */
+int ewah_encode(const uint64_t *bits, size_t nwords, unsigned char **out, size_t *out_words);
+int ewah_or(uint64_t *bits, size_t nwords, const unsigned char *ewah, size_t ewah_words);
+
+/* bitmap.c */
+int bitmap_write(const hash_t *pack_hash, const hash_t *objects, size_t count,
+                 const hash_t *tips, size_t tip_count);
+int bitmap_objects(const hash_t *wants, size_t want_count, const hash_t *haves,
+                   size_t have_count, hash_t **objects_out, size_t *count_out);
+
+/* packcache.c */
+void pack_cache_set_limit(size_t bytes);
+int pack_cache_enabled(void);
+int pack_cache_key(const hash_t *wants, size_t want_count,
+                   const hash_t *haves, size_t have_count, hash_t *key);
+int pack_cache_open(const hash_t *key, hash_t *id, uint64_t *size);
+pack_cache_writer_t *pack_cache_begin(const hash_t *key, const hash_t *id,
+                                      const hash_t *wants, size_t want_count);
+int pack_cache_write(pack_cache_writer_t *cw, const void *buf, size_t len);
+int pack_cache_commit(pack_cache_writer_t *cw);
+void pack_cache_abort(pack_cache_writer_t *cw);
+void pack_cache_invalidate(const hash_t *tip);
+
+/* wire.c */
+wire_t *wire_new(int fd, int framed, int compress, int sideband);
+void wire_free(wire_t *w);
+void wire_close(wire_t *w);
+int wire_write(wire_t *w, const void *buf, size_t len);
+int wire_flush(wire_t *w);
+int wire_sendfile(wire_t *w, int fd, off_t offset, size_t len);
+void wire_set_compress(wire_t *w, int on);
+void wire_set_cork(wire_t *w, int on);
+ssize_t wire_read(wire_t *w, void *buf, size_t len);
+int wire_read_full(wire_t *w, void *buf, size_t len);
+int wire_expect_flush(wire_t *w);
+int wire_sideband(wire_t *w, int channel, const char *msg);
+int wire_has_sideband(const wire_t *w);
+int wire_peer_closed(wire_t *w);
+int wire_pending(wire_t *w);
+int wire_push(wire_t *w);
 
 /* network.c */
 int net_daemon_start(int port);
-int net_send_objects(const char *host, int port, const hash_t *hashes, size_t count);
-int net_recv_objects(const char *host, int port, const char *branch);
+void net_set_backlog(int backlog);
+void net_set_max_sessions(int sessions);
+void net_set_max_per_client(int sessions);
+void net_set_workers(int workers);
+void net_set_socket_buffer(int bytes);
+int net_push(const char *host, int port, char **branches, int count);
+void net_set_push_force(int force);
+void net_set_fetch_depth(int depth, int deepen);
+int net_fetch(const char *host, int port, char **branches, int count);
+int net_recv_objects(const char *host, int port, const char *branch, hash_t *tip_out);
+int net_remote_session(const char *host, int port);
+int net_fetch_objects(const char *host, int port, const hash_t *hashes, size_t count);
+
+/* promisor.c */
+int filter_parse(const char *spec, object_filter_t *filter);
+void filter_format(const object_filter_t *filter, char *buf, size_t size);
+int filter_omits(const object_filter_t *filter, const hash_t *hash);
+int promisor_write(const char *host, const object_filter_t *filter);
+int promisor_read(char *host, size_t host_size, object_filter_t *filter);
+int promisor_fetch(const hash_t *hashes, size_t count);
+int promisor_enabled(void);
+int promisor_prefetch(const hash_t *hashes, size_t count);
 
 /* gc.c */
 int gc_run(void);
 
+/* repack.c */
+int repack_run(void);
+
 /* util.c */
 int mkdirp(const char *path);
 int file_exists(const char *path);
@@ -114,10 +336,26 @@ char* read_file(const char *path, size_t *size);
 int write_file(const char *path, const void *data, size_t size);
 int is_safe_path(const char *path);
 int is_valid_ref_name(const char *name);
+int read_full(pack_read_fn read_fn, void *ctx, void *buf, size_t len);
+uint64_t get_be(const unsigned char *p, int bytes);
+void put_be(unsigned char *p, uint64_t v, int bytes);
+uint32_t get_be32(const unsigned char *p);
+void put_be32(unsigned char *p, uint32_t v);
+uint64_t get_be64(const unsigned char *p);
+void put_be64(unsigned char *p, uint64_t v);
 
 /* checkout.c */
 int checkout_commit(const hash_t *commit_hash);
 int checkout_tree(const hash_t *tree_hash, const char *prefix);
+int checkout_switch(const hash_t *old_tree, const hash_t *new_tree);
+int checkout_refresh(const hash_t *tree);
+
+/* sparse.c */
+int sparse_load(sparse_t *sparse);
+int sparse_includes(const sparse_t *sparse, const char *path);
+void sparse_free(sparse_t *sparse);
+int sparse_set(char **dirs, int count);
+int sparse_disable(void);
 
 /* diff.c */
 int diff_blobs(const hash_t *hash1, const hash_t *hash2);
@@ -161,7 +399,7 @@ int shallow_mark(const hash_t *shallow_commits, size_t count);
 int shallow_is_repository_shallow(void);
 int shallow_read_commits(hash_t **commits_out, size_t *count_out);
 int shallow_is_boundary(const hash_t *commit_hash);
-int shallow_deepen(int depth);
-int shallow_collect_commits(const hash_t *start, int depth, hash_t **commits_out, size_t *count_out);
+int shallow_update(const hash_t *added, size_t added_count);
+int shallow_deepen(const char *host, int port, int depth);
 
 #endif
@@ -0,0 +1,648 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fit.h"
+
+/*
+ * Reachability bitmaps for a pack, written by `fit repack` next to the pack
+ * as pack-<hash>.bitmap. Bit i stands for the i-th object of the pack, and
+ * a commit's bitmap has a bit set for every object reachable from it, so the
+ * objects to send for a fetch are (wants | ...) & ~(haves | ...), computed a
+ * word at a time instead of by walking history.
+ *
+ * Layout:
+ *   [SIGNATURE:4 "FBMP"][VERSION:4][PACK_HASH:32][OBJECTS:4][ENTRIES:4]
+ *   [HASHES:OBJECTS x 32]  the pack's objects, in pack order
+ *   [LOOKUP:OBJECTS x 4]   pack positions sorted by object hash
+ *   per entry: [COMMIT:32][WORDS:4][EWAH:WORDS x 8]
+ *
+ * Bitmaps are stored for every ref tip, every BITMAP_INTERVAL-th commit
+ * down each line of history and every commit where history forks. Objects
+ * the pack does not contain (e.g. pushed since the repack) get positions
+ * past its end and are found by walking from the new commits down to the
+ * nearest stored bitmap.
+ */
+
+#define BITMAP_SIGNATURE "FBMP"
+#define BITMAP_VERSION 1
+#define BITMAP_HEADER_SIZE (4 + 4 + HASH_SIZE + 4 + 4)
+#define BITMAP_INTERVAL 100
+
+typedef struct {
+    uint64_t *words;
+    size_t nwords;
+} bitset_t;
+
+typedef struct {
+    hash_t commit;
+    const unsigned char *ewah;
+    uint32_t words;
+} bitmap_entry_t;
+
+typedef struct bitmap_index {
+    int refs;
+    unsigned char *map;
+    size_t size;
+    uint32_t count;
+    const unsigned char *hashes;
+    const unsigned char *lookup;
+    bitmap_entry_t *entries;
+    uint32_t entry_count;
+} bitmap_index_t;
+
+/* Positions of objects outside the bitmapped pack */
+typedef struct {
+    hash_t *keys;
+    uint32_t *positions;
+    size_t capacity;
+    size_t count;
+    hash_t *order;              // By position - base
+    uint32_t base;
+} extra_map_t;
+
+/* Resolves objects to bit positions and stored bitmaps during a walk */
+typedef struct walk_ctx {
+    const unsigned char *hashes;
+    const unsigned char *lookup;
+    uint32_t count;
+    extra_map_t *extra;         // NULL: objects outside the pack are an error
+    int (*stored)(struct walk_ctx *ctx, const hash_t *commit, bitset_t *bits);
+    void *data;
+} walk_ctx_t;
+
+static bitmap_index_t *current_index = NULL;
+static struct timespec current_mtime;
+static int current_loaded = 0;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int bitset_init(bitset_t *b, size_t nbits) {
+    b->nwords = (nbits + 63) / 64;
+    b->words = calloc(b->nwords ? b->nwords : 1, sizeof(uint64_t));
+    return b->words ? 0 : -1;
+}
+
+static int bitset_set(bitset_t *b, size_t bit) {
+    if (bit / 64 >= b->nwords) {
+        size_t nwords = b->nwords * 2 > bit / 64 + 1 ? b->nwords * 2 : bit / 64 + 1;
+        uint64_t *words = realloc(b->words, nwords * sizeof(uint64_t));
+        if (!words) return -1;
+        memset(words + b->nwords, 0, (nwords - b->nwords) * sizeof(uint64_t));
+        b->words = words;
+        b->nwords = nwords;
+    }
+    b->words[bit / 64] |= 1ULL << (bit % 64);
+    return 0;
+}
+
+static int bitset_test(const bitset_t *b, size_t bit) {
+    return bit / 64 < b->nwords && (b->words[bit / 64] >> (bit % 64) & 1);
+}
+
+static size_t extra_slot(const hash_t *hash, size_t capacity) {
+    size_t h;
+    memcpy(&h, hash->hash, sizeof(h));
+    return h & (capacity - 1);
+}
+
+static int extra_grow(extra_map_t *m) {
+    size_t capacity = m->capacity ? m->capacity * 2 : 256;
+    hash_t *keys = calloc(capacity, sizeof(hash_t));
+    uint32_t *positions = malloc(capacity * sizeof(uint32_t));
+    hash_t *order = realloc(m->order, capacity * sizeof(hash_t));
+    if (!keys || !positions || !order) {
+        free(keys);
+        free(positions);
+        if (order) m->order = order;
+        return -1;
+    }
+    m->order = order;
+
+    // A zero position marks a free slot; stored positions are offset by one
+    memset(positions, 0, capacity * sizeof(uint32_t));
+    for (size_t i = 0; i < m->capacity; i++) {
+        if (!m->positions[i]) continue;
+        size_t j = extra_slot(&m->keys[i], capacity);
+        while (positions[j]) j = (j + 1) & (capacity - 1);
+        keys[j] = m->keys[i];
+        positions[j] = m->positions[i];
+    }
+    free(m->keys);
+    free(m->positions);
+    m->keys = keys;
+    m->positions = positions;
+    m->capacity = capacity;
+    return 0;
+}
+
+static int64_t extra_position(extra_map_t *m, const hash_t *hash) {
+    if ((m->count + 1) * 2 > m->capacity && extra_grow(m) < 0) return -1;
+
+    size_t i = extra_slot(hash, m->capacity);
+    while (m->positions[i]) {
+        if (hash_equal(&m->keys[i], hash)) return m->positions[i] - 1;
+        i = (i + 1) & (m->capacity - 1);
+    }
+    m->keys[i] = *hash;
+    m->positions[i] = m->base + m->count + 1;
+    m->order[m->count] = *hash;
+    return m->base + m->count++;
+}
+
+static void extra_free(extra_map_t *m) {
+    free(m->keys);
+    free(m->positions);
+    free(m->order);
+}
+
+/* Bit position of an object, or -1 */
+static int64_t position_of(walk_ctx_t *ctx, const hash_t *hash) {
+    uint32_t lo = 0, hi = ctx->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        uint32_t pos = get_be32(ctx->lookup + (size_t)mid * 4);
+        int cmp = memcmp(ctx->hashes + (size_t)pos * HASH_SIZE, hash->hash, HASH_SIZE);
+        if (cmp == 0) return pos;
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return ctx->extra ? extra_position(ctx->extra, hash) : -1;
+}
+
+/* Set the bits of a tree and everything below it */
+static int fill_tree(walk_ctx_t *ctx, bitset_t *bits, const hash_t *tree_hash) {
+    int64_t pos = position_of(ctx, tree_hash);
+    if (pos < 0) return -1;
+    if (bitset_test(bits, pos)) return 0;  // Bitmaps are closed: all below is set
+    if (bitset_set(bits, pos) < 0) return -1;
+
+    tree_entry_t *entries = tree_read(tree_hash);
+    int ret = 0;
+    for (tree_entry_t *e = entries; e && ret == 0; e = e->next) {
+        if (S_ISDIR(e->mode)) {
+            ret = fill_tree(ctx, bits, &e->hash);
+        } else {
+            int64_t blob = position_of(ctx, &e->hash);
+            ret = blob < 0 ? -1 : bitset_set(bits, blob);
+        }
+    }
+    tree_free(entries);
+    return ret;
+}
+
+static int fill_commit(walk_ctx_t *ctx, bitset_t *bits, const hash_t *hash, hash_t *parent) {
+    commit_t commit;
+    if (commit_read(hash, &commit) < 0) return 1;  // Missing: history ends here
+
+    int64_t pos = position_of(ctx, hash);
+    int ret = pos < 0 || bitset_set(bits, pos) < 0 ? -1 : fill_tree(ctx, bits, &commit.tree);
+    *parent = commit.parent;
+    commit_free(&commit);
+    return ret;
+}
+
+/* Add everything reachable from start, stopping at commits already in
+ * bits, in stop, or covered by a stored bitmap */
+static int fill_reachable(walk_ctx_t *ctx, bitset_t *bits, const bitset_t *stop,
+                          const hash_t *start) {
+    hash_t current = *start;
+    while (!hash_is_null(&current)) {
+        int64_t pos = position_of(ctx, &current);
+        if (pos < 0) return -1;
+        if (bitset_test(bits, pos) || (stop && bitset_test(stop, pos))) break;
+
+        int ret = ctx->stored(ctx, &current, bits);
+        if (ret != 0) return ret < 0 ? -1 : 0;
+
+        hash_t parent;
+        ret = fill_commit(ctx, bits, &current, &parent);
+        if (ret != 0) return ret < 0 ? -1 : 0;
+        current = parent;
+    }
+    return 0;
+}
+
+/* Writing */
+
+typedef struct {
+    hash_t *commits;            // Sorted, for lookup
+    bitset_t *bits;             // Parallel to commits; NULL words until computed
+    size_t count;
+} selection_t;
+
+static int compare_hashes(const void *a, const void *b) {
+    return memcmp(a, b, sizeof(hash_t));
+}
+
+static int64_t selection_find(const selection_t *sel, const hash_t *commit) {
+    hash_t *found = bsearch(commit, sel->commits, sel->count, sizeof(hash_t), compare_hashes);
+    return found ? found - sel->commits : -1;
+}
+
+typedef struct {
+    hash_t *items;
+    size_t count;
+    size_t capacity;
+} commit_list_t;
+
+static int commit_list_push(commit_list_t *list, const hash_t *hash) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 256;
+        hash_t *items = realloc(list->items, capacity * sizeof(hash_t));
+        if (!items) return -1;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = *hash;
+    return 0;
+}
+
+/* Split history into segments, one per tip, each running from the tip down
+ * to the first commit seen before; choose the commits to store bitmaps for */
+static int select_commits(const hash_t *tips, size_t tip_count, commit_list_t *segments,
+                          size_t *starts, size_t *start_count, selection_t *sel) {
+    hash_set_t seen;
+    hash_set_init(&seen);
+    commit_list_t chosen = {0};
+    int ret = 0;
+
+    *start_count = 0;
+    for (size_t i = 0; ret == 0 && i < tip_count; i++) {
+        hash_t current = tips[i];
+        size_t first = segments->count;
+        size_t depth = 0;
+
+        while (ret == 0 && !hash_is_null(&current)) {
+            int added = hash_set_add(&seen, &current);
+            if (added < 0) ret = -1;
+            if (added <= 0) {
+                // A tip or fork point inside history already covered
+                if (added == 0) ret = commit_list_push(&chosen, &current);
+                break;
+            }
+
+            commit_t commit;
+            if (commit_read(&current, &commit) < 0) break;
+            ret = commit_list_push(segments, &current);
+            if (ret == 0 && depth % BITMAP_INTERVAL == 0) ret = commit_list_push(&chosen, &current);
+            current = commit.parent;
+            commit_free(&commit);
+            depth++;
+        }
+        if (segments->count > first) starts[(*start_count)++] = first;
+    }
+    hash_set_free(&seen);
+
+    if (ret == 0) {
+        qsort(chosen.items, chosen.count, sizeof(hash_t), compare_hashes);
+        size_t unique = 0;
+        for (size_t i = 0; i < chosen.count; i++) {
+            if (unique == 0 || !hash_equal(&chosen.items[unique - 1], &chosen.items[i])) {
+                chosen.items[unique++] = chosen.items[i];
+            }
+        }
+        sel->commits = chosen.items;
+        sel->count = unique;
+        sel->bits = calloc(unique ? unique : 1, sizeof(bitset_t));
+        if (!sel->bits) ret = -1;
+    } else {
+        free(chosen.items);
+    }
+    return ret;
+}
+
+static int write_stored(walk_ctx_t *ctx, const hash_t *commit, bitset_t *bits) {
+    selection_t *sel = ctx->data;
+    int64_t i = selection_find(sel, commit);
+    if (i < 0 || !sel->bits[i].words) return 0;
+    for (size_t w = 0; w < sel->bits[i].nwords; w++) bits->words[w] |= sel->bits[i].words[w];
+    return 1;
+}
+
+static int write_entries(FILE *f, const selection_t *sel) {
+    for (size_t i = 0; i < sel->count; i++) {
+        unsigned char *ewah;
+        size_t words;
+        if (ewah_encode(sel->bits[i].words, sel->bits[i].nwords, &ewah, &words) < 0) return -1;
+
+        unsigned char header[HASH_SIZE + 4];
+        memcpy(header, sel->commits[i].hash, HASH_SIZE);
+        put_be32(header + HASH_SIZE, words);
+        int ok = fwrite(header, sizeof(header), 1, f) == 1 &&
+                 fwrite(ewah, 8, words, f) == words;
+        free(ewah);
+        if (!ok) return -1;
+    }
+    return 0;
+}
+
+static int compare_positions(const void *a, const void *b, void *objects) {
+    const hash_t *x = (const hash_t *)objects + *(const uint32_t *)a;
+    const hash_t *y = (const hash_t *)objects + *(const uint32_t *)b;
+    return memcmp(x, y, sizeof(hash_t));
+}
+
+int bitmap_write(const hash_t *pack_hash, const hash_t *objects, size_t count,
+                 const hash_t *tips, size_t tip_count) {
+    if (count > UINT32_MAX) return -1;
+
+    unsigned char *lookup = malloc((count ? count : 1) * 4);
+    uint32_t *positions = malloc((count ? count : 1) * sizeof(uint32_t));
+    if (!lookup || !positions) {
+        free(lookup);
+        free(positions);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) positions[i] = i;
+    qsort_r(positions, count, sizeof(uint32_t), compare_positions, (void *)objects);
+    for (size_t i = 0; i < count; i++) put_be32(lookup + i * 4, positions[i]);
+    free(positions);
+
+    commit_list_t segments = {0};
+    selection_t sel = {0};
+    size_t start_count = 0;
+    size_t *starts = malloc((tip_count ? tip_count : 1) * sizeof(size_t));
+    walk_ctx_t ctx = {
+        .hashes = (const unsigned char *)objects, .lookup = lookup, .count = count,
+        .stored = write_stored, .data = &sel,
+    };
+    int ret = starts ? select_commits(tips, tip_count, &segments, starts, &start_count, &sel) : -1;
+
+    // Segments only fork off earlier ones, so walking each one oldest first
+    // finds the bitmap of the commit it forks from already computed
+    for (size_t s = 0; ret == 0 && s < start_count; s++) {
+        size_t first = starts[s];
+        size_t end = s + 1 < start_count ? starts[s + 1] : segments.count;
+
+        bitset_t bits;
+        if (bitset_init(&bits, count) < 0) {
+            ret = -1;
+            break;
+        }
+
+        for (size_t i = end; ret == 0 && i > first; i--) {
+            const hash_t *commit = &segments.items[i - 1];
+            if (i == end) {
+                // Start from the bitmap of the commit this segment forks from
+                commit_t c;
+                if (commit_read(commit, &c) == 0) {
+                    if (!hash_is_null(&c.parent)) write_stored(&ctx, &c.parent, &bits);
+                    commit_free(&c);
+                }
+            }
+
+            hash_t parent;
+            if (fill_commit(&ctx, &bits, commit, &parent) < 0) ret = -1;
+
+            int64_t chosen = selection_find(&sel, commit);
+            if (ret == 0 && chosen >= 0) {
+                sel.bits[chosen].nwords = bits.nwords;
+                sel.bits[chosen].words = malloc(bits.nwords * sizeof(uint64_t));
+                if (!sel.bits[chosen].words) ret = -1;
+                else memcpy(sel.bits[chosen].words, bits.words, bits.nwords * sizeof(uint64_t));
+            }
+        }
+        free(bits.words);
+    }
+
+    // Drop fork points whose history turned out to be missing
+    size_t stored = 0;
+    for (size_t i = 0; ret == 0 && i < sel.count; i++) {
+        if (!sel.bits[i].words) continue;
+        sel.commits[stored] = sel.commits[i];
+        sel.bits[stored++] = sel.bits[i];
+    }
+    sel.count = stored;
+
+    char hex[HASH_HEX_SIZE + 1], path[512], tmp_path[520];
+    hash_to_hex(pack_hash, hex);
+    snprintf(path, sizeof(path), "%s/pack-%s.bitmap", FIT_PACK_DIR, hex);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *f = ret == 0 ? fopen(tmp_path, "wb") : NULL;
+    if (ret == 0 && !f) ret = -1;
+    if (f) {
+        unsigned char header[BITMAP_HEADER_SIZE];
+        memcpy(header, BITMAP_SIGNATURE, 4);
+        put_be32(header + 4, BITMAP_VERSION);
+        memcpy(header + 8, pack_hash->hash, HASH_SIZE);
+        put_be32(header + 8 + HASH_SIZE, count);
+        put_be32(header + 12 + HASH_SIZE, sel.count);
+
+        int ok = fwrite(header, sizeof(header), 1, f) == 1 &&
+                 fwrite(objects, sizeof(hash_t), count, f) == count &&
+                 fwrite(lookup, 4, count, f) == count &&
+                 write_entries(f, &sel) == 0 &&
+                 fflush(f) == 0 && fsync(fileno(f)) == 0;
+        if (fclose(f) != 0) ok = 0;
+        if (!ok || rename(tmp_path, path) < 0) {
+            unlink(tmp_path);
+            ret = -1;
+        }
+    }
+
+    for (size_t i = 0; i < sel.count; i++) free(sel.bits[i].words);
+    free(sel.bits);
+    free(sel.commits);
+    free(segments.items);
+    free(starts);
+    free(lookup);
+    return ret < 0 ? -1 : (int)stored;
+}
+
+/* Reading */
+
+static int compare_entries(const void *a, const void *b) {
+    return memcmp(&((const bitmap_entry_t *)a)->commit, &((const bitmap_entry_t *)b)->commit,
+                  sizeof(hash_t));
+}
+
+static void bitmap_index_free(bitmap_index_t *idx) {
+    if (!idx) return;
+    munmap(idx->map, idx->size);
+    free(idx->entries);
+    free(idx);
+}
+
+static bitmap_index_t *bitmap_index_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < BITMAP_HEADER_SIZE) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = st.st_size;
+    unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    bitmap_index_t *idx = calloc(1, sizeof(bitmap_index_t));
+    if (!idx) {
+        munmap(map, size);
+        return NULL;
+    }
+    idx->map = map;
+    idx->size = size;
+    idx->count = get_be32(map + 8 + HASH_SIZE);
+    idx->entry_count = get_be32(map + 12 + HASH_SIZE);
+
+    size_t pos = BITMAP_HEADER_SIZE + (size_t)idx->count * (HASH_SIZE + 4);
+    idx->entries = calloc(idx->entry_count ? idx->entry_count : 1, sizeof(bitmap_entry_t));
+    int ok = idx->entries && memcmp(map, BITMAP_SIGNATURE, 4) == 0 &&
+             get_be32(map + 4) == BITMAP_VERSION && pos <= size;
+
+    for (uint32_t i = 0; ok && i < idx->entry_count; i++) {
+        if (size - pos < HASH_SIZE + 4) {
+            ok = 0;
+            break;
+        }
+        bitmap_entry_t *e = &idx->entries[i];
+        memcpy(e->commit.hash, map + pos, HASH_SIZE);
+        e->words = get_be32(map + pos + HASH_SIZE);
+        e->ewah = map + pos + HASH_SIZE + 4;
+        pos += HASH_SIZE + 4;
+        if ((size - pos) / 8 < e->words) ok = 0;
+        pos += (size_t)e->words * 8;
+    }
+
+    if (!ok || pos != size) {
+        fprintf(stderr, "Warning: Ignoring malformed bitmap %s\n", path);
+        bitmap_index_free(idx);
+        return NULL;
+    }
+
+    idx->hashes = map + BITMAP_HEADER_SIZE;
+    idx->lookup = idx->hashes + (size_t)idx->count * HASH_SIZE;
+    qsort(idx->entries, idx->entry_count, sizeof(bitmap_entry_t), compare_entries);
+    idx->refs = 1;
+    return idx;
+}
+
+static bitmap_index_t *bitmap_index_find(void) {
+    DIR *d = opendir(FIT_PACK_DIR);
+    if (!d) return NULL;
+
+    bitmap_index_t *idx = NULL;
+    struct dirent *entry;
+    while (!idx && (entry = readdir(d))) {
+        size_t len = strlen(entry->d_name);
+        if (len < 12 || strncmp(entry->d_name, "pack-", 5) != 0 ||
+            strcmp(entry->d_name + len - 7, ".bitmap") != 0) {
+            continue;
+        }
+
+        char path[512], pack_path[512];
+        snprintf(path, sizeof(path), "%s/%s", FIT_PACK_DIR, entry->d_name);
+        snprintf(pack_path, sizeof(pack_path), "%s/%.*s.pack", FIT_PACK_DIR, (int)len - 7,
+                 entry->d_name);
+        if (access(pack_path, F_OK) == 0) idx = bitmap_index_open(path);
+    }
+    closedir(d);
+    return idx;
+}
+
+static void bitmap_index_put(bitmap_index_t *idx) {
+    pthread_mutex_lock(&index_lock);
+    int last = --idx->refs == 0;
+    pthread_mutex_unlock(&index_lock);
+    if (last) bitmap_index_free(idx);
+}
+
+/* The current bitmap index, reloaded when the pack directory changes */
+static bitmap_index_t *bitmap_index_get(void) {
+    struct stat st;
+    if (stat(FIT_PACK_DIR, &st) < 0) return NULL;
+
+    pthread_mutex_lock(&index_lock);
+    if (!current_loaded || st.st_mtim.tv_sec != current_mtime.tv_sec ||
+        st.st_mtim.tv_nsec != current_mtime.tv_nsec) {
+        bitmap_index_t *old = current_index;
+        current_index = bitmap_index_find();
+        current_mtime = st.st_mtim;
+        current_loaded = 1;
+        if (old && --old->refs == 0) bitmap_index_free(old);
+    }
+    bitmap_index_t *idx = current_index;
+    if (idx) idx->refs++;
+    pthread_mutex_unlock(&index_lock);
+    return idx;
+}
+
+static int read_stored(walk_ctx_t *ctx, const hash_t *commit, bitset_t *bits) {
+    bitmap_index_t *idx = ctx->data;
+    bitmap_entry_t key = { .commit = *commit };
+    bitmap_entry_t *e = bsearch(&key, idx->entries, idx->entry_count, sizeof(bitmap_entry_t),
+                                compare_entries);
+    if (!e) return 0;
+    return ewah_or(bits->words, (idx->count + 63) / 64, e->ewah, e->words) < 0 ? -1 : 1;
+}
+
+int bitmap_objects(const hash_t *wants, size_t want_count, const hash_t *haves,
+                   size_t have_count, hash_t **objects_out, size_t *count_out) {
+    bitmap_index_t *idx = bitmap_index_get();
+    if (!idx) return -1;
+
+    extra_map_t extra = { .base = idx->count };
+    walk_ctx_t ctx = {
+        .hashes = idx->hashes, .lookup = idx->lookup, .count = idx->count,
+        .extra = &extra, .stored = read_stored, .data = idx,
+    };
+    bitset_t want_bits = {0}, have_bits = {0};
+    hash_t *out = NULL;
+    int ret = bitset_init(&want_bits, idx->count) < 0 || bitset_init(&have_bits, idx->count) < 0
+              ? -1 : 0;
+
+    for (size_t i = 0; ret == 0 && i < have_count; i++) {
+        ret = fill_reachable(&ctx, &have_bits, NULL, &haves[i]);
+    }
+    for (size_t i = 0; ret == 0 && i < want_count; i++) {
+        ret = fill_reachable(&ctx, &want_bits, &have_bits, &wants[i]);
+    }
+
+    size_t count = 0;
+    if (ret == 0) {
+        for (size_t w = 0; w < want_bits.nwords; w++) {
+            if (w < have_bits.nwords) want_bits.words[w] &= ~have_bits.words[w];
+            count += __builtin_popcountll(want_bits.words[w]);
+        }
+        out = malloc((count ? count : 1) * sizeof(hash_t));
+        if (!out) ret = -1;
+    }
+
+    if (ret == 0) {
+        // Tips first, like a walk would emit them
+        size_t n = 0;
+        for (size_t i = 0; i < want_count; i++) {
+            int64_t pos = position_of(&ctx, &wants[i]);
+            if (pos >= 0 && bitset_test(&want_bits, pos)) {
+                want_bits.words[pos / 64] &= ~(1ULL << (pos % 64));
+                out[n++] = wants[i];
+            }
+        }
+        for (size_t w = 0; w < want_bits.nwords; w++) {
+            for (uint64_t word = want_bits.words[w]; word; word &= word - 1) {
+                size_t pos = w * 64 + __builtin_ctzll(word);
+                if (pos < idx->count) memcpy(&out[n++], idx->hashes + pos * HASH_SIZE, HASH_SIZE);
+                else out[n++] = extra.order[pos - idx->count];
+            }
+        }
+        *objects_out = out;
+        *count_out = n;
+    } else {
+        free(out);
+    }
+
+    free(want_bits.words);
+    free(have_bits.words);
+    extra_free(&extra);
+    bitmap_index_put(idx);
+    return ret;
+}
@@ -1,55 +1,456 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "fit.h"
 
-int checkout_tree(const hash_t *tree_hash, const char *prefix) {
+/*
+ * Checkout writes the blobs of a tree into the working directory. Switching
+ * from one tree to another walks both (as path-sorted lists) in one pass:
+ * paths only in the old tree are removed, paths that are new or differ are
+ * written, and the index is rebuilt from the new tree. With sparse checkout
+ * on, only paths in the cone are written; the rest stay in the index but not
+ * on disk. The writes (object read + inflate + file write) are spread over a
+ * pool of threads once every directory they need has been created.
+ */
+
+#define CHECKOUT_MAX_THREADS 16
+#define CHECKOUT_FILES_PER_THREAD 64  /* Below this a thread costs more than it saves */
+
+typedef struct {
+    char *path;
+    uint32_t mode;
+    hash_t hash;
+} checkout_entry_t;
+
+typedef struct {
+    checkout_entry_t *items;
+    size_t count;
+    size_t capacity;
+} checkout_list_t;
+
+typedef struct {
+    checkout_entry_t **entries;
+    size_t count;
+    size_t next;
+    int failed;
+    pthread_mutex_t lock;
+} checkout_job_t;
+
+static int list_add(checkout_list_t *list, const char *path, uint32_t mode, const hash_t *hash) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 256;
+        checkout_entry_t *items = realloc(list->items, capacity * sizeof(checkout_entry_t));
+        if (!items) return -1;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    checkout_entry_t *e = &list->items[list->count];
+    if (!(e->path = strdup(path))) return -1;
+    e->mode = mode;
+    e->hash = *hash;
+    list->count++;
+    return 0;
+}
+
+static void list_free(checkout_list_t *list) {
+    for (size_t i = 0; i < list->count; i++) free(list->items[i].path);
+    free(list->items);
+}
+
+/* Collect the blobs of a tree, with subtrees expanded, as full paths */
+static int flatten_tree(const hash_t *tree_hash, const char *prefix, checkout_list_t *list) {
     tree_entry_t *entries = tree_read(tree_hash);
     if (!entries) return -1;
-    
-    for (tree_entry_t *e = entries; e; e = e->next) {
+
+    int ret = 0;
+    for (tree_entry_t *e = entries; e && ret == 0; e = e->next) {
         char path[1024];
         if (prefix && prefix[0]) {
             snprintf(path, sizeof(path), "%s/%s", prefix, e->name);
         } else {
             snprintf(path, sizeof(path), "%s", e->name);
         }
-        
+        if (!is_safe_path(path)) {
+            fprintf(stderr, "Skipping unsafe path in tree: %s\n", path);
+            continue;
+        }
+
         if (S_ISDIR(e->mode)) {
-            mkdirp(path);
-            checkout_tree(&e->hash, path);
+            ret = flatten_tree(&e->hash, path, list);
         } else {
-            object_t obj;
-            if (object_read(&e->hash, &obj) < 0) continue;
-            
-            char *dir = strdup(path);
-            char *last_slash = strrchr(dir, '/');
-            if (last_slash) {
-                *last_slash = '\0';
-                mkdirp(dir);
-            }
-            free(dir);
-            
-            write_file(path, obj.data, obj.size);
-            chmod(path, e->mode);
-            object_free(&obj);
+            ret = list_add(list, path, e->mode, &e->hash);
         }
     }
-    
+
     tree_free(entries);
+    return ret;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const checkout_entry_t *)a)->path, ((const checkout_entry_t *)b)->path);
+}
+
+static int load_tree(const hash_t *tree_hash, const char *prefix, checkout_list_t *list) {
+    if (flatten_tree(tree_hash, prefix, list) < 0) {
+        fprintf(stderr, "Failed to read tree\n");
+        return -1;
+    }
+    qsort(list->items, list->count, sizeof(checkout_entry_t), compare_entries);
+    return 0;
+}
+
+static int write_entry(const checkout_entry_t *e) {
+    object_t obj;
+    if (object_read(&e->hash, &obj) < 0) {
+        fprintf(stderr, "Failed to read blob for %s\n", e->path);
+        return -1;
+    }
+    int ret = write_file(e->path, obj.data, obj.size);
+    object_free(&obj);
+    if (ret < 0 || chmod(e->path, e->mode & 07777) < 0) {
+        fprintf(stderr, "Failed to write %s\n", e->path);
+        return -1;
+    }
+    return 0;
+}
+
+static void *checkout_worker(void *arg) {
+    checkout_job_t *job = arg;
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        size_t i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->count) return NULL;
+
+        if (write_entry(job->entries[i]) < 0) {
+            pthread_mutex_lock(&job->lock);
+            job->failed++;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+}
+
+/* Create the parent directories of every path up front, so the workers
+ * never race on mkdir. Paths are sorted, so each directory comes up in one
+ * run and needs creating only once. */
+static int create_directories(checkout_entry_t **entries, size_t count) {
+    char last[1024] = "";
+    for (size_t i = 0; i < count; i++) {
+        const char *slash = strrchr(entries[i]->path, '/');
+        if (!slash) continue;
+        size_t len = slash - entries[i]->path;
+        if (len >= sizeof(last)) return -1;
+        if (strlen(last) == len && strncmp(last, entries[i]->path, len) == 0) continue;
+
+        memcpy(last, entries[i]->path, len);
+        last[len] = '\0';
+        if (mkdirp(last) < 0) {
+            fprintf(stderr, "Failed to create directory %s\n", last);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* A partial clone may lack the blobs; fetch them all in one batch rather
+ * than one request per file from the workers */
+static void prefetch_entries(checkout_entry_t **entries, size_t count) {
+    if (!promisor_enabled()) return;
+    hash_t *hashes = malloc(count * sizeof(hash_t));
+    if (!hashes) return;
+    for (size_t i = 0; i < count; i++) hashes[i] = entries[i]->hash;
+    promisor_prefetch(hashes, count);
+    free(hashes);
+}
+
+static int write_entries(checkout_entry_t **entries, size_t count) {
+    if (count == 0) return 0;
+    prefetch_entries(entries, count);
+    if (create_directories(entries, count) < 0) return -1;
+
+    checkout_job_t job = { .entries = entries, .count = count };
+    pthread_mutex_init(&job.lock, NULL);
+
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > CHECKOUT_MAX_THREADS) threads = CHECKOUT_MAX_THREADS;
+    if ((size_t)threads > count / CHECKOUT_FILES_PER_THREAD) {
+        threads = count / CHECKOUT_FILES_PER_THREAD;
+    }
+
+    pthread_t workers[CHECKOUT_MAX_THREADS];
+    int started = 0;
+    while (started < threads && pthread_create(&workers[started], NULL, checkout_worker, &job) == 0) {
+        started++;
+    }
+    checkout_worker(&job);  /* The calling thread works too */
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+
+    pthread_mutex_destroy(&job.lock);
+    return job.failed ? -1 : 0;
+}
+
+/* Whether a file still holds the given blob, i.e. has no local changes */
+static int file_matches_blob(const char *path, const hash_t *hash) {
+    size_t size;
+    char *data = read_file(path, &size);
+    if (!data) return 0;
+
+    char header[64];
+    int header_len = object_header(OBJ_BLOB, size, header, sizeof(header));
+    hash_ctx_t ctx;
+    hash_t actual;
+    int ok = header_len >= 0 && hash_init(&ctx) == 0;
+    if (ok) {
+        hash_update(&ctx, header, header_len);
+        hash_update(&ctx, data, size);
+        hash_final(&ctx, &actual);
+        ok = hash_equal(&actual, hash);
+    }
+    free(data);
+    return ok;
+}
+
+/* Remove a file that left the tree, unless it holds work not in any commit */
+static int remove_entry(const checkout_entry_t *e, const index_entry_t *staged) {
+    struct stat st;
+    if (lstat(e->path, &st) < 0) return 0;  /* Already gone */
+    if ((staged && !hash_equal(&staged->hash, &e->hash)) || !file_matches_blob(e->path, &e->hash)) {
+        fprintf(stderr, "Keeping %s: it has local changes\n", e->path);
+        return 1;
+    }
+    if (unlink(e->path) < 0) {
+        fprintf(stderr, "Failed to remove %s\n", e->path);
+        return 1;
+    }
+
+    /* Drop directories the removal left empty */
+    char dir[1024];
+    snprintf(dir, sizeof(dir), "%s", e->path);
+    for (char *slash = strrchr(dir, '/'); slash; slash = strrchr(dir, '/')) {
+        *slash = '\0';
+        if (rmdir(dir) < 0) break;
+    }
     return 0;
 }
 
+static int compare_index_paths(const void *a, const void *b) {
+    return strcmp((*(index_entry_t *const *)a)->path, (*(index_entry_t *const *)b)->path);
+}
+
+static index_entry_t *index_lookup(index_entry_t **sorted, size_t count, const char *path) {
+    index_entry_t key = { .path = (char *)path };
+    index_entry_t *keyp = &key;
+    index_entry_t **found = bsearch(&keyp, sorted, count, sizeof(*sorted), compare_index_paths);
+    return found ? *found : NULL;
+}
+
+static int index_append(index_entry_t **head, index_entry_t **tail,
+                        const char *path, uint32_t mode, const hash_t *hash) {
+    index_entry_t *entry = calloc(1, sizeof(index_entry_t));
+    if (!entry || !(entry->path = strdup(path))) {
+        free(entry);
+        return -1;
+    }
+    entry->mode = mode;
+    entry->hash = *hash;
+    if (*tail) (*tail)->next = entry;
+    else *head = entry;
+    *tail = entry;
+    return 0;
+}
+
+/* Whether the file behind a tree entry is in the working directory */
+static int entry_present(const checkout_entry_t *e) {
+    struct stat st;
+    return lstat(e->path, &st) == 0;
+}
+
+/* Whether writing n would destroy work: o is the checked-out entry for the
+ * same path (NULL when the old tree lacks it), staged its index entry. A file
+ * that already holds the new blob loses nothing. */
+static int overwrites_changes(const checkout_entry_t *o, const checkout_entry_t *n,
+                              const index_entry_t *staged) {
+    if (staged && !hash_equal(&staged->hash, &n->hash) && (!o || !hash_equal(&staged->hash, &o->hash))) {
+        return 1;
+    }
+    if (!entry_present(n) || file_matches_blob(n->path, &n->hash)) return 0;
+    return !o || !file_matches_blob(o->path, &o->hash);
+}
+
+/* Refuse the switch up front if any path it rewrites has local changes, so
+ * nothing is touched when it fails */
+static int check_overwrites(const checkout_list_t *old_list, const checkout_list_t *new_list,
+                            index_entry_t **staged, size_t staged_count, const sparse_t *sparse) {
+    int conflicts = 0;
+    size_t i = 0, j = 0;
+    while (i < new_list->count) {
+        const checkout_entry_t *n = &new_list->items[i];
+        const checkout_entry_t *o = j < old_list->count ? &old_list->items[j] : NULL;
+        int cmp = o ? strcmp(o->path, n->path) : 1;
+        if (cmp < 0) {
+            j++;
+            continue;
+        }
+        if (cmp == 0) j++;
+        i++;
+        if (cmp == 0 && hash_equal(&o->hash, &n->hash) && o->mode == n->mode) continue;
+        if (!sparse_includes(sparse, n->path)) continue;
+        if (overwrites_changes(cmp == 0 ? o : NULL, n, index_lookup(staged, staged_count, n->path))) {
+            fprintf(stderr, "error: Your local changes to %s would be overwritten\n", n->path);
+            conflicts++;
+        }
+    }
+    if (conflicts) fprintf(stderr, "Commit or discard them before switching\n");
+    return conflicts;
+}
+
+/* Walk old_tree and new_tree together. With refresh set, paths the switch
+ * leaves unchanged are still brought in line with the sparse cone: written
+ * when in it and missing, removed when outside it. */
+static int switch_trees(const hash_t *old_tree, const hash_t *new_tree, int refresh) {
+    checkout_list_t old_list = {0}, new_list = {0};
+    sparse_t sparse;
+    checkout_entry_t **changed = NULL;
+    index_entry_t *index = NULL, **staged = NULL;
+    index_entry_t *new_index = NULL, *new_tail = NULL;
+    size_t staged_count = 0;
+    int ret = -1;
+
+    if (sparse_load(&sparse) < 0) return -1;
+    if (load_tree(new_tree, NULL, &new_list) < 0) goto out;
+    if (old_tree && load_tree(old_tree, NULL, &old_list) < 0) goto out;
+
+    // Staged entries, to carry over changes the switch does not touch
+    index_read(&index);
+    for (index_entry_t *e = index; e; e = e->next) staged_count++;
+    staged = malloc((staged_count ? staged_count : 1) * sizeof(*staged));
+    changed = malloc((new_list.count ? new_list.count : 1) * sizeof(*changed));
+    if (!staged || !changed) goto out;
+    staged_count = 0;
+    for (index_entry_t *e = index; e; e = e->next) staged[staged_count++] = e;
+    qsort(staged, staged_count, sizeof(*staged), compare_index_paths);
+    if (check_overwrites(&old_list, &new_list, staged, staged_count, &sparse) > 0) goto out;
+
+    /* Both lists are sorted by path: walk them side by side. Removals go
+     * first so a file can make way for a directory and vice versa. */
+    size_t count = 0, i = 0, j = 0;
+    int kept = 0;
+    while (i < new_list.count || j < old_list.count) {
+        checkout_entry_t *n = i < new_list.count ? &new_list.items[i] : NULL;
+        checkout_entry_t *o = j < old_list.count ? &old_list.items[j] : NULL;
+        int cmp = !n ? -1 : !o ? 1 : strcmp(o->path, n->path);
+        index_entry_t *entry = index_lookup(staged, staged_count, cmp <= 0 ? o->path : n->path);
+
+        if (cmp < 0) {
+            /* Only in the old tree */
+            if (remove_entry(o, entry) > 0) {
+                kept = 1;
+                if (entry && index_append(&new_index, &new_tail, o->path, entry->mode, &entry->hash) < 0) {
+                    goto out;
+                }
+            }
+            j++;
+            continue;
+        }
+
+        int in_cone = sparse_includes(&sparse, n->path);
+        if (cmp == 0 && hash_equal(&o->hash, &n->hash) && o->mode == n->mode) {
+            /* Unchanged by the switch: keep whatever is staged for it */
+            if (refresh && in_cone && !entry_present(n)) {
+                changed[count++] = n;
+            } else if (refresh && !in_cone && remove_entry(o, entry) > 0) {
+                kept = 1;
+            }
+            if (!entry) entry = &(index_entry_t){ .path = n->path, .mode = n->mode, .hash = n->hash };
+            if (index_append(&new_index, &new_tail, n->path, entry->mode, &entry->hash) < 0) goto out;
+        } else {
+            if (in_cone) {
+                changed[count++] = n;
+            } else if (cmp == 0 && remove_entry(o, entry) > 0) {
+                kept = 1;  // Left the cone with local edits; the next switch retries
+            }
+            if (index_append(&new_index, &new_tail, n->path, n->mode, &n->hash) < 0) goto out;
+        }
+        if (cmp == 0) j++;
+        i++;
+    }
+
+    /* Files added to the index but in neither tree stay staged */
+    for (size_t k = 0; k < staged_count; k++) {
+        checkout_entry_t key = { .path = staged[k]->path };
+        if (bsearch(&key, new_list.items, new_list.count, sizeof(checkout_entry_t), compare_entries) ||
+            bsearch(&key, old_list.items, old_list.count, sizeof(checkout_entry_t), compare_entries)) {
+            continue;
+        }
+        if (index_append(&new_index, &new_tail, staged[k]->path, staged[k]->mode, &staged[k]->hash) < 0) {
+            goto out;
+        }
+    }
+
+    ret = write_entries(changed, count);
+    if (index_write(new_index) < 0) {
+        fprintf(stderr, "Failed to write index\n");
+        ret = -1;
+    }
+    if (kept && ret == 0) {
+        fprintf(stderr, "Some files that left the tree were kept\n");
+    }
+
+out:
+    free(changed);
+    free(staged);
+    index_free(index);
+    index_free(new_index);
+    list_free(&old_list);
+    list_free(&new_list);
+    sparse_free(&sparse);
+    return ret;
+}
+
+int checkout_switch(const hash_t *old_tree, const hash_t *new_tree) {
+    return switch_trees(old_tree, new_tree, 0);
+}
+
+/* Re-apply the sparse cone to a checkout of tree, e.g. after it changed */
+int checkout_refresh(const hash_t *tree) {
+    return switch_trees(tree, tree, 1);
+}
+
+int checkout_tree(const hash_t *tree_hash, const char *prefix) {
+    checkout_list_t list = {0};
+    checkout_entry_t **entries = NULL;
+    int ret = -1;
+
+    sparse_t sparse;
+    if (sparse_load(&sparse) < 0) return -1;
+    if (load_tree(tree_hash, prefix, &list) < 0) goto out;
+
+    entries = malloc((list.count ? list.count : 1) * sizeof(*entries));
+    if (!entries) goto out;
+    size_t count = 0;
+    for (size_t i = 0; i < list.count; i++) {
+        if (sparse_includes(&sparse, list.items[i].path)) entries[count++] = &list.items[i];
+    }
+    ret = write_entries(entries, count);
+
+out:
+    free(entries);
+    list_free(&list);
+    sparse_free(&sparse);
+    return ret;
+}
+
 int checkout_commit(const hash_t *commit_hash) {
     commit_t commit;
     if (commit_read(commit_hash, &commit) < 0) {
         fprintf(stderr, "Failed to read commit\n");
         return -1;
     }
-    
+
     int ret = checkout_tree(&commit.tree, NULL);
     commit_free(&commit);
     return ret;
@@ -111,6 +111,20 @@ int commit_read(const hash_t *hash, commit_t *commit) {
     return 0;
 }
 
+/* Whether ancestor is descendant or reachable through its parents. A walk
+ * that reaches a shallow boundary or the root without finding it says no. */
+int commit_is_ancestor(const hash_t *ancestor, const hash_t *descendant) {
+    hash_t current = *descendant;
+    while (!hash_equal(&current, ancestor)) {
+        commit_t commit;
+        if (commit_read(&current, &commit) < 0) return 0;
+        current = commit.parent;
+        commit_free(&commit);
+        if (hash_is_null(&current)) return 0;
+    }
+    return 1;
+}
+
 void commit_free(commit_t *commit) {
     if (commit->author) free(commit->author);
     if (commit->message) free(commit->message);
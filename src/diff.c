@@ -109,7 +109,49 @@ int diff_blobs(const hash_t *hash1, const hash_t *hash2) {
     return 0;
 }
 
-int diff_trees(const hash_t *tree1, const hash_t *tree2, const char *prefix) {
+typedef struct {
+    hash_t *items;
+    size_t count;
+    size_t capacity;
+} blob_list_t;
+
+static int blob_list_add(blob_list_t *list, const hash_t *hash) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        hash_t *items = realloc(list->items, capacity * sizeof(hash_t));
+        if (!items) return -1;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = *hash;
+    return 0;
+}
+
+/* Both blobs of every modification diff_tree_entries() will show */
+static int collect_modified(const hash_t *tree1, const hash_t *tree2, blob_list_t *list) {
+    tree_entry_t *entries1 = tree_read(tree1);
+    tree_entry_t *entries2 = tree_read(tree2);
+    int ret = 0;
+
+    for (tree_entry_t *e1 = entries1; e1 && ret == 0; e1 = e1->next) {
+        for (tree_entry_t *e2 = entries2; e2; e2 = e2->next) {
+            if (strcmp(e1->name, e2->name) != 0) continue;
+            if (hash_equal(&e1->hash, &e2->hash)) break;
+            if (e1->mode == 040000) {
+                ret = collect_modified(&e1->hash, &e2->hash, list);
+            } else if (blob_list_add(list, &e1->hash) < 0 || blob_list_add(list, &e2->hash) < 0) {
+                ret = -1;
+            }
+            break;
+        }
+    }
+
+    tree_free(entries1);
+    tree_free(entries2);
+    return ret;
+}
+
+static int diff_tree_entries(const hash_t *tree1, const hash_t *tree2, const char *prefix) {
     tree_entry_t *entries1 = tree_read(tree1);
     tree_entry_t *entries2 = tree_read(tree2);
 
@@ -131,7 +173,7 @@ int diff_trees(const hash_t *tree1, const hash_t *tree2, const char *prefix) {
                         /* Recursively diff directories */
                         char new_prefix[1024];
                         snprintf(new_prefix, sizeof(new_prefix), "%s/", path);
-                        diff_trees(&e1->hash, &e2->hash, new_prefix);
+                        diff_tree_entries(&e1->hash, &e2->hash, new_prefix);
                     } else {
                         printf("Modified: %s\n", path);
                         diff_blobs(&e1->hash, &e2->hash);
@@ -175,6 +217,18 @@ int diff_trees(const hash_t *tree1, const hash_t *tree2, const char *prefix) {
     return 0;
 }
 
+int diff_trees(const hash_t *tree1, const hash_t *tree2, const char *prefix) {
+    /* In a partial clone, fetch the blobs to compare in one batch first */
+    if (promisor_enabled()) {
+        blob_list_t blobs = {0};
+        if (collect_modified(tree1, tree2, &blobs) == 0) {
+            promisor_prefetch(blobs.items, blobs.count);
+        }
+        free(blobs.items);
+    }
+    return diff_tree_entries(tree1, tree2, prefix);
+}
+
 int diff_commits(const hash_t *commit1, const hash_t *commit2) {
     commit_t c1 = {0}, c2 = {0};
 
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fit.h"
+
+/*
+ * EWAH (Enhanced Word-Aligned Hybrid) compressed bitmaps, as used for the
+ * reachability bitmaps next to a pack. A bitmap is a sequence of 64-bit
+ * words, stored big-endian. Each marker word describes
+ *
+ *   bit 0        value of the run of clean (all-0 or all-1) words
+ *   bits 1-32    length of that run
+ *   bits 33-63   number of literal (mixed) words that follow the marker
+ *
+ * so long stretches of objects that are all reachable, or all unreachable,
+ * cost one word.
+ */
+
+#define RUN_MAX 0xffffffffULL
+#define LITERAL_MAX 0x7fffffffULL
+
+int ewah_encode(const uint64_t *bits, size_t nwords, unsigned char **out, size_t *out_words) {
+    /* Worst case: one marker per literal word */
+    unsigned char *buf = malloc((nwords * 2 + 1) * 8);
+    if (!buf) return -1;
+
+    size_t pos = 0, i = 0;
+    while (i < nwords) {
+        uint64_t run_bit = bits[i] == ~0ULL;
+        uint64_t run = 0;
+        while (i < nwords && run < RUN_MAX &&
+               (bits[i] == 0 || bits[i] == ~0ULL) && (bits[i] == ~0ULL) == run_bit) {
+            run++;
+            i++;
+        }
+
+        size_t literal_start = i;
+        uint64_t literals = 0;
+        while (i < nwords && literals < LITERAL_MAX && bits[i] != 0 && bits[i] != ~0ULL) {
+            literals++;
+            i++;
+        }
+
+        put_be64(buf + pos * 8, run_bit | run << 1 | literals << 33);
+        pos++;
+        for (uint64_t j = 0; j < literals; j++) {
+            put_be64(buf + pos * 8, bits[literal_start + j]);
+            pos++;
+        }
+    }
+
+    *out = buf;
+    *out_words = pos;
+    return 0;
+}
+
+/* OR a compressed bitmap into an uncompressed one of nwords words */
+int ewah_or(uint64_t *bits, size_t nwords, const unsigned char *ewah, size_t ewah_words) {
+    size_t pos = 0;
+    for (size_t i = 0; i < ewah_words;) {
+        uint64_t marker = get_be64(ewah + i * 8);
+        uint64_t run = (marker >> 1) & RUN_MAX;
+        uint64_t literals = marker >> 33;
+        i++;
+
+        if (run > nwords - pos || literals > nwords - pos - run || literals > ewah_words - i) {
+            return -1;
+        }
+        if (marker & 1) {
+            memset(bits + pos, 0xff, run * 8);
+        }
+        pos += run;
+        for (uint64_t j = 0; j < literals; j++) {
+            bits[pos++] |= get_be64(ewah + i * 8);
+            i++;
+        }
+    }
+    return 0;
+}
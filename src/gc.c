@@ -9,6 +9,12 @@
 
 static int mark_reachable(const hash_t *hash, int *marked, hash_t *all_objects, int count);
 
+typedef struct {
+    int *marked;
+    hash_t *objects;
+    int count;
+} gc_marks_t;
+
 static int collect_objects(const char *dir, hash_t **objects, int *count, int *capacity) {
     DIR *d = opendir(dir);
     if (!d) return 0;
@@ -24,6 +30,8 @@ static int collect_objects(const char *dir, hash_t **objects, int *count, int *c
         if (stat(path, &st) < 0) continue;
         
         if (S_ISDIR(st.st_mode)) {
+            /* Only the two-character fan-out directories hold loose objects */
+            if (strlen(entry->d_name) != 2) continue;
             collect_objects(path, objects, count, capacity);
         } else {
             if (*count >= *capacity) {
@@ -40,8 +48,9 @@ static int collect_objects(const char *dir, hash_t **objects, int *count, int *c
             char hex[512];
             const char *parent = strrchr(dir, '/');
             snprintf(hex, sizeof(hex), "%s%s", parent ? parent + 1 : "", entry->d_name);
-            hex_to_hash(hex, &(*objects)[*count]);
-            (*count)++;
+            if (hex_to_hash(hex, &(*objects)[*count]) == 0) {
+                (*count)++;
+            }
         }
     }
     
@@ -58,10 +67,13 @@ static int mark_reachable(const hash_t *hash, int *marked, hash_t *all_objects,
         }
     }
     
-    object_t obj;
-    if (object_read(hash, &obj) < 0) return 0;
+    /* Only the header is needed; blobs are never read, nor fetched in a
+     * partial clone */
+    obj_type type;
+    size_t size;
+    if (object_info(hash, &type, &size) < 0) return 0;
     
-    if (obj.type == OBJ_COMMIT) {
+    if (type == OBJ_COMMIT) {
         commit_t commit;
         commit_read(hash, &commit);
         mark_reachable(&commit.tree, marked, all_objects, count);
@@ -77,7 +89,7 @@ static int mark_reachable(const hash_t *hash, int *marked, hash_t *all_objects,
             mark_reachable(&commit.parent, marked, all_objects, count);
         }
         commit_free(&commit);
-    } else if (obj.type == OBJ_TREE) {
+    } else if (type == OBJ_TREE) {
         tree_entry_t *entries = tree_read(hash);
         for (tree_entry_t *e = entries; e; e = e->next) {
             mark_reachable(&e->hash, marked, all_objects, count);
@@ -85,7 +97,13 @@ static int mark_reachable(const hash_t *hash, int *marked, hash_t *all_objects,
         tree_free(entries);
     }
     
-    object_free(&obj);
+    return 0;
+}
+
+static int mark_ref(const char *name, const hash_t *hash, void *data) {
+    (void)name;
+    gc_marks_t *marks = data;
+    mark_reachable(hash, marks->marked, marks->objects, marks->count);
     return 0;
 }
 
@@ -98,21 +116,9 @@ int gc_run(void) {
     
     int *marked = calloc(count, sizeof(int));
     
-    DIR *d = opendir(FIT_HEADS_DIR);
-    if (d) {
-        struct dirent *entry;
-        while ((entry = readdir(d))) {
-            if (entry->d_name[0] == '.') continue;
-
-            hash_t ref_hash;
-            char ref_name[512];
-            snprintf(ref_name, sizeof(ref_name), "heads/%s", entry->d_name);
-            if (ref_read(ref_name, &ref_hash) == 0) {
-                mark_reachable(&ref_hash, marked, objects, count);
-            }
-        }
-        closedir(d);
-    }
+    /* Every ref keeps its history, loose or packed */
+    gc_marks_t marks = { marked, objects, count };
+    ref_for_each("", mark_ref, &marks);
     
     int removed = 0;
     for (int i = 0; i < count; i++) {
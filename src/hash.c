@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 #include "fit.h"
 
 void hash_data(const void *data, size_t len, hash_t *out) {
@@ -34,3 +36,101 @@ int hash_is_null(const hash_t *hash) {
     }
     return 1;
 }
+
+int hash_init(hash_ctx_t *ctx) {
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    if (!md) return -1;
+    if (EVP_DigestInit_ex(md, EVP_sha256(), NULL) != 1) {
+        EVP_MD_CTX_free(md);
+        return -1;
+    }
+    ctx->impl = md;
+    return 0;
+}
+
+void hash_update(hash_ctx_t *ctx, const void *data, size_t len) {
+    EVP_DigestUpdate((EVP_MD_CTX*)ctx->impl, data, len);
+}
+
+void hash_final(hash_ctx_t *ctx, hash_t *out) {
+    EVP_DigestFinal_ex((EVP_MD_CTX*)ctx->impl, out->hash, NULL);
+    EVP_MD_CTX_free((EVP_MD_CTX*)ctx->impl);
+    ctx->impl = NULL;
+}
+
+void hash_abort(hash_ctx_t *ctx) {
+    if (ctx->impl) EVP_MD_CTX_free((EVP_MD_CTX*)ctx->impl);
+    ctx->impl = NULL;
+}
+
+/* Open-addressing set of hashes. Hashes are uniformly distributed already,
+ * so their leading bytes are used directly as the probe start. */
+static size_t hash_set_slot(const hash_t *hash, size_t capacity) {
+    uint64_t key;
+    memcpy(&key, hash->hash, sizeof(key));
+    return (size_t)(key & (capacity - 1));
+}
+
+void hash_set_init(hash_set_t *set) {
+    memset(set, 0, sizeof(*set));
+}
+
+static int hash_set_grow(hash_set_t *set) {
+    size_t capacity = set->capacity ? set->capacity * 2 : 64;
+    hash_t *slots = malloc(capacity * sizeof(hash_t));
+    uint8_t *used = calloc(capacity, 1);
+    if (!slots || !used) {
+        free(slots);
+        free(used);
+        return -1;
+    }
+
+    for (size_t i = 0; i < set->capacity; i++) {
+        if (!set->used[i]) continue;
+        size_t j = hash_set_slot(&set->slots[i], capacity);
+        while (used[j]) j = (j + 1) & (capacity - 1);
+        slots[j] = set->slots[i];
+        used[j] = 1;
+    }
+
+    free(set->slots);
+    free(set->used);
+    set->slots = slots;
+    set->used = used;
+    set->capacity = capacity;
+    return 0;
+}
+
+int hash_set_add(hash_set_t *set, const hash_t *hash) {
+    if ((set->count + 1) * 4 > set->capacity * 3 && hash_set_grow(set) < 0) {
+        return -1;
+    }
+
+    size_t i = hash_set_slot(hash, set->capacity);
+    while (set->used[i]) {
+        if (hash_equal(&set->slots[i], hash)) return 0;
+        i = (i + 1) & (set->capacity - 1);
+    }
+
+    set->slots[i] = *hash;
+    set->used[i] = 1;
+    set->count++;
+    return 1;
+}
+
+int hash_set_contains(const hash_set_t *set, const hash_t *hash) {
+    if (set->count == 0) return 0;
+
+    size_t i = hash_set_slot(hash, set->capacity);
+    while (set->used[i]) {
+        if (hash_equal(&set->slots[i], hash)) return 1;
+        i = (i + 1) & (set->capacity - 1);
+    }
+    return 0;
+}
+
+void hash_set_free(hash_set_t *set) {
+    free(set->slots);
+    free(set->used);
+    memset(set, 0, sizeof(*set));
+}
@@ -16,12 +16,18 @@ static void cmd_log(int argc, char **argv);
 static void cmd_status(void);
 static void cmd_branch(int argc, char **argv);
 static void cmd_checkout(int argc, char **argv);
+static void cmd_sparse_checkout(int argc, char **argv);
 static void cmd_daemon(int argc, char **argv);
 static void cmd_push(int argc, char **argv);
+static void cmd_fetch(int argc, char **argv);
+static void cmd_remote_session(int argc, char **argv);
 static void cmd_pull(int argc, char **argv);
 static void cmd_clone(int argc, char **argv);
 static void cmd_restore(int argc, char **argv);
 static void cmd_gc(void);
+static void cmd_repack(void);
+static void cmd_pack_refs(int argc, char **argv);
+static void cmd_reflog(int argc, char **argv);
 static void cmd_snapshot(int argc, char **argv);
 static void cmd_diff(int argc, char **argv);
 static void cmd_tag(int argc, char **argv);
@@ -51,12 +57,18 @@ int main(int argc, char **argv) {
     else if (strcmp(argv[1], "status") == 0) cmd_status();
     else if (strcmp(argv[1], "branch") == 0) cmd_branch(argc - 2, argv + 2);
     else if (strcmp(argv[1], "checkout") == 0) cmd_checkout(argc - 2, argv + 2);
+    else if (strcmp(argv[1], "sparse-checkout") == 0) cmd_sparse_checkout(argc - 2, argv + 2);
     else if (strcmp(argv[1], "daemon") == 0) cmd_daemon(argc - 2, argv + 2);
     else if (strcmp(argv[1], "push") == 0) cmd_push(argc - 2, argv + 2);
+    else if (strcmp(argv[1], "fetch") == 0) cmd_fetch(argc - 2, argv + 2);
+    else if (strcmp(argv[1], "remote-session") == 0) cmd_remote_session(argc - 2, argv + 2);
     else if (strcmp(argv[1], "pull") == 0) cmd_pull(argc - 2, argv + 2);
     else if (strcmp(argv[1], "clone") == 0) cmd_clone(argc - 2, argv + 2);
     else if (strcmp(argv[1], "restore") == 0) cmd_restore(argc - 2, argv + 2);
     else if (strcmp(argv[1], "gc") == 0) cmd_gc();
+    else if (strcmp(argv[1], "repack") == 0) cmd_repack();
+    else if (strcmp(argv[1], "pack-refs") == 0) cmd_pack_refs(argc - 2, argv + 2);
+    else if (strcmp(argv[1], "reflog") == 0) cmd_reflog(argc - 2, argv + 2);
     else if (strcmp(argv[1], "snapshot") == 0) cmd_snapshot(argc - 2, argv + 2);
     else if (strcmp(argv[1], "diff") == 0) cmd_diff(argc - 2, argv + 2);
     else if (strcmp(argv[1], "tag") == 0) cmd_tag(argc - 2, argv + 2);
@@ -112,6 +124,9 @@ static void cmd_add(int argc, char **argv) {
         return;
     }
 
+    sparse_t sparse;
+    if (sparse_load(&sparse) < 0) return;
+
     for (int i = 0; i < argc; i++) {
         if (!is_safe_path(argv[i])) {
             fprintf(stderr, "Error: Invalid or unsafe file path: %s\n", argv[i]);
@@ -121,12 +136,17 @@ static void cmd_add(int argc, char **argv) {
             fprintf(stderr, "Error: File path too long: %s\n", argv[i]);
             continue;
         }
+        if (!sparse_includes(&sparse, argv[i])) {
+            fprintf(stderr, "Error: %s is outside the sparse-checkout cone\n", argv[i]);
+            continue;
+        }
         if (index_add(argv[i]) == 0) {
             printf("Added %s\n", argv[i]);
         } else {
             fprintf(stderr, "Failed to add %s\n", argv[i]);
         }
     }
+    sparse_free(&sparse);
 }
 
 static void cmd_rm(int argc, char **argv) {
@@ -385,38 +405,54 @@ static void cmd_status(void) {
     index_entry_t *entries;
     index_read(&entries);
 
+    /* Entries outside the sparse cone are not on disk, so not listed */
+    sparse_t sparse;
+    if (sparse_load(&sparse) < 0) {
+        index_free(entries);
+        return;
+    }
+
     if (entries) {
         printf("\nChanges to be committed:\n");
         printf("  (use \"fit commit -m <message>\" to commit)\n\n");
+        size_t hidden = 0;
         for (index_entry_t *e = entries; e; e = e->next) {
+            if (!sparse_includes(&sparse, e->path)) {
+                hidden++;
+                continue;
+            }
             char hex[HASH_HEX_SIZE + 1];
             hash_to_hex(&e->hash, hex);
             printf("  \033[32mmodified:\033[0m   %-30s (%.8s)\n", e->path, hex);
         }
+        if (hidden) {
+            printf("\n  (%zu paths outside the sparse-checkout cone)\n", hidden);
+        }
     } else {
         printf("\nNo changes staged for commit\n");
         printf("  (use \"fit add <file>\" to stage changes)\n");
     }
 
     index_free(entries);
+    sparse_free(&sparse);
+}
+
+static int print_branch(const char *name, const hash_t *hash, void *data) {
+    (void)hash;
+    const char *current = data;
+    name += strlen("heads/");
+    if (current && strcmp(name, current) == 0) {
+        printf("* \033[32m%s\033[0m\n", name);
+    } else {
+        printf("  %s\n", name);
+    }
+    return 0;
 }
 
 static void cmd_branch(int argc, char **argv) {
     if (argc == 0) {
-        DIR *d = opendir(FIT_HEADS_DIR);
-        if (!d) return;
-        
         char *current = ref_current_branch();
-        struct dirent *entry;
-        while ((entry = readdir(d))) {
-            if (entry->d_name[0] == '.') continue;
-            if (current && strcmp(entry->d_name, current) == 0) {
-                printf("* \033[32m%s\033[0m\n", entry->d_name);
-            } else {
-                printf("  %s\n", entry->d_name);
-            }
-        }
-        closedir(d);
+        ref_for_each("heads", print_branch, current);
         if (current) free(current);
     } else if (strcmp(argv[0], "-d") == 0 || strcmp(argv[0], "--delete") == 0) {
         if (argc < 2) {
@@ -474,6 +510,16 @@ static void cmd_branch(int argc, char **argv) {
     }
 }
 
+/* Tree of the commit HEAD points at; NULL before the first commit */
+static const hash_t *head_tree(hash_t *tree) {
+    hash_t head;
+    commit_t commit;
+    if (ref_resolve_head(&head) < 0 || commit_read(&head, &commit) < 0) return NULL;
+    *tree = commit.tree;
+    commit_free(&commit);
+    return tree;
+}
+
 static void cmd_checkout(int argc, char **argv) {
     if (argc < 1) {
         fprintf(stderr, "Usage: fit checkout <branch|commit>\n");
@@ -483,11 +529,25 @@ static void cmd_checkout(int argc, char **argv) {
     hash_t hash;
     char ref_name[256];
 
+    /* Only paths that differ from the current checkout get written */
+    hash_t current_tree;
+    const hash_t *old_tree = head_tree(&current_tree);
+
     /* Try to interpret as branch name first (only if it's a valid ref name) */
     if (is_valid_ref_name(argv[0])) {
         snprintf(ref_name, sizeof(ref_name), "heads/%s", argv[0]);
 
         if (ref_read(ref_name, &hash) == 0) {
+            commit_t commit;
+            if (commit_read(&hash, &commit) == 0) {
+                int ret = checkout_switch(old_tree, &commit.tree);
+                commit_free(&commit);
+                if (ret < 0) {
+                    fprintf(stderr, "Checkout aborted: still on the previous branch\n");
+                    return;
+                }
+            }
+
             FILE *f = fopen(FIT_HEAD_FILE, "w");
             if (!f) {
                 fprintf(stderr, "Error: Failed to update HEAD file\n");
@@ -496,12 +556,6 @@ static void cmd_checkout(int argc, char **argv) {
             fprintf(f, "ref: refs/%s\n", ref_name);
             fclose(f);
 
-            commit_t commit;
-            if (commit_read(&hash, &commit) == 0) {
-                checkout_tree(&commit.tree, NULL);
-                commit_free(&commit);
-            }
-
             printf("Switched to branch %s\n", argv[0]);
             return;
         }
@@ -511,8 +565,12 @@ static void cmd_checkout(int argc, char **argv) {
     if (hex_to_hash(argv[0], &hash) == 0) {
         commit_t commit;
         if (commit_read(&hash, &commit) == 0) {
-            checkout_tree(&commit.tree, NULL);
+            int ret = checkout_switch(old_tree, &commit.tree);
             commit_free(&commit);
+            if (ret < 0) {
+                fprintf(stderr, "Checkout aborted: HEAD not moved\n");
+                return;
+            }
 
             FILE *f = fopen(FIT_HEAD_FILE, "w");
             if (!f) {
@@ -531,6 +589,51 @@ static void cmd_checkout(int argc, char **argv) {
     }
 }
 
+
+static void cmd_sparse_checkout(int argc, char **argv) {
+    if (argc < 1) {
+        fprintf(stderr, "Usage: fit sparse-checkout <set <dir>...|list|disable>\n");
+        return;
+    }
+
+    if (strcmp(argv[0], "list") == 0) {
+        sparse_t sparse;
+        if (sparse_load(&sparse) < 0) return;
+        if (!sparse.enabled) printf("Sparse checkout is disabled\n");
+        for (size_t i = 0; i < sparse.count; i++) printf("%s\n", sparse.dirs[i]);
+        sparse_free(&sparse);
+        return;
+    }
+
+    if (strcmp(argv[0], "set") == 0) {
+        for (int i = 1; i < argc; i++) {
+            size_t len = strlen(argv[i]);
+            while (len > 1 && argv[i][len - 1] == '/') argv[i][--len] = '\0';
+            if (!is_safe_path(argv[i])) {
+                fprintf(stderr, "Error: Invalid directory: %s\n", argv[i]);
+                return;
+            }
+        }
+        if (sparse_set(argv + 1, argc - 1) < 0) return;
+    } else if (strcmp(argv[0], "disable") == 0) {
+        if (sparse_disable() < 0) return;
+    } else {
+        fprintf(stderr, "Unknown sparse-checkout command: %s\n", argv[0]);
+        return;
+    }
+
+    /* Bring the working directory in line with the new cone */
+    hash_t tree;
+    if (head_tree(&tree) && checkout_refresh(&tree) < 0) {
+        fprintf(stderr, "Failed to update working directory\n");
+        return;
+    }
+    if (strcmp(argv[0], "set") == 0) {
+        printf("Sparse checkout set to %d directories\n", argc - 1);
+    } else {
+        printf("Sparse checkout disabled\n");
+    }
+}
 static void cmd_daemon(int argc, char **argv) {
     int port = 9418;
 
@@ -541,7 +644,79 @@ static void cmd_daemon(int argc, char **argv) {
                 fprintf(stderr, "Error: Invalid port number. Port must be between 1 and 65535\n");
                 return;
             }
-            break;
+            i++;
+        } else if (strcmp(argv[i], "--pack-threads") == 0 && i + 1 < argc) {
+            int threads = atoi(argv[i + 1]);
+            if (threads < 0 || threads > 64) {
+                fprintf(stderr, "Error: --pack-threads must be between 0 (auto) and 64\n");
+                return;
+            }
+            pack_set_threads(threads);
+            i++;
+        } else if (strcmp(argv[i], "--compression") == 0 && i + 1 < argc) {
+            int level = atoi(argv[i + 1]);
+            if (level < 0 || level > 9) {
+                fprintf(stderr, "Error: --compression must be between 0 and 9\n");
+                return;
+            }
+            pack_set_compression(level);
+            i++;
+        } else if (strcmp(argv[i], "--unpack-limit") == 0 && i + 1 < argc) {
+            int limit = atoi(argv[i + 1]);
+            if (limit < 0) {
+                fprintf(stderr, "Error: --unpack-limit must not be negative\n");
+                return;
+            }
+            pack_set_unpack_limit(limit);
+            i++;
+        } else if (strcmp(argv[i], "--pack-cache-size") == 0 && i + 1 < argc) {
+            long megabytes = atol(argv[i + 1]);
+            if (megabytes < 0) {
+                fprintf(stderr, "Error: --pack-cache-size must not be negative\n");
+                return;
+            }
+            pack_cache_set_limit((size_t)megabytes * 1024 * 1024);
+            i++;
+        } else if (strcmp(argv[i], "--socket-buffer") == 0 && i + 1 < argc) {
+            int kilobytes = atoi(argv[i + 1]);
+            if (kilobytes < 0 || kilobytes > 1024 * 1024) {
+                fprintf(stderr, "Error: --socket-buffer must be between 0 and 1048576 KB\n");
+                return;
+            }
+            net_set_socket_buffer(kilobytes * 1024);
+            i++;
+        } else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+            int backlog = atoi(argv[i + 1]);
+            if (backlog <= 0) {
+                fprintf(stderr, "Error: --backlog must be positive\n");
+                return;
+            }
+            net_set_backlog(backlog);
+            i++;
+        } else if (strcmp(argv[i], "--max-sessions") == 0 && i + 1 < argc) {
+            int sessions = atoi(argv[i + 1]);
+            if (sessions <= 0) {
+                fprintf(stderr, "Error: --max-sessions must be positive\n");
+                return;
+            }
+            net_set_max_sessions(sessions);
+            i++;
+        } else if (strcmp(argv[i], "--max-per-client") == 0 && i + 1 < argc) {
+            int sessions = atoi(argv[i + 1]);
+            if (sessions <= 0) {
+                fprintf(stderr, "Error: --max-per-client must be positive\n");
+                return;
+            }
+            net_set_max_per_client(sessions);
+            i++;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            int workers = atoi(argv[i + 1]);
+            if (workers < 0 || workers > 256) {
+                fprintf(stderr, "Error: --workers must be between 0 (auto) and 256\n");
+                return;
+            }
+            net_set_workers(workers);
+            i++;
         }
     }
 
@@ -549,51 +724,94 @@ static void cmd_daemon(int argc, char **argv) {
 }
 
 static void cmd_push(int argc, char **argv) {
+    /* --force lets the server rewind branches that have diverged */
+    int force = argc > 0 && strcmp(argv[0], "--force") == 0;
+    if (force) {
+        argc--;
+        argv++;
+    }
     if (argc < 2) {
-        fprintf(stderr, "Usage: fit push <host> <branch>\n");
+        fprintf(stderr, "Usage: fit push [--force] <host> <branch> [branch...]\n");
         return;
     }
-    
-    char ref_name[256];
-    snprintf(ref_name, sizeof(ref_name), "heads/%s", argv[1]);
-    
-    hash_t hash;
-    if (ref_read(ref_name, &hash) < 0) {
-        fprintf(stderr, "Branch %s not found\n", argv[1]);
+
+    for (int i = 1; i < argc; i++) {
+        if (!is_valid_ref_name(argv[i])) {
+            fprintf(stderr, "Error: Invalid branch name '%s'\n", argv[i]);
+            return;
+        }
+    }
+
+    net_set_push_force(force);
+    int ret = net_push(argv[0], 9418, argv + 1, argc - 1);
+    net_set_push_force(0);
+    if (ret == 0) {
+        printf("Pushed to %s\n", argv[0]);
+    } else {
+        fprintf(stderr, "Push failed\n");
+    }
+}
+
+static void cmd_fetch(int argc, char **argv) {
+    if (argc < 1) {
+        fprintf(stderr, "Usage: fit fetch <host> [branch...] [--depth N | --deepen N]\n");
         return;
     }
-    
-    hash_t hashes[256];
-    int count = 0;
-    
-    hash_t current = hash;
-    while (count < 256) {
-        hashes[count++] = current;
-        
-        commit_t commit;
-        if (commit_read(&current, &commit) < 0) break;
-        
-        int has_parent = 0;
-        for (int i = 0; i < HASH_SIZE; i++) {
-            if (commit.parent.hash[i]) {
-                has_parent = 1;
-                break;
+
+    /* Remote-tracking refs live under refs/remotes/<host>/ */
+    if (!is_valid_ref_name(argv[0])) {
+        fprintf(stderr, "Error: Invalid host name '%s'\n", argv[0]);
+        return;
+    }
+
+    char **branches = argv + 1;
+    int count = 0, depth = 0, deepen = 0;
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "--depth") == 0 || strcmp(argv[i], "--deepen") == 0) && i + 1 < argc) {
+            int n = atoi(argv[i + 1]);
+            if (n < 1 || n > 100000) {
+                fprintf(stderr, "Error: Invalid depth value (must be between 1 and 100000): %d\n", n);
+                return;
             }
+            if (strcmp(argv[i], "--deepen") == 0) deepen = n;
+            else depth = n;
+            i++;
+        } else if (!is_valid_ref_name(argv[i])) {
+            fprintf(stderr, "Error: Invalid branch name '%s'\n", argv[i]);
+            return;
+        } else {
+            branches[count++] = argv[i];
         }
-        
-        if (!has_parent) {
-            commit_free(&commit);
-            break;
-        }
-        
-        current = commit.parent;
-        commit_free(&commit);
     }
-    
-    if (net_send_objects(argv[0], 9418, hashes, count) == 0) {
-        printf("Pushed %d objects to %s\n", count, argv[0]);
+
+    printf("Fetching from %s...\n", argv[0]);
+    int ret;
+    if (deepen) {
+        ret = shallow_deepen(argv[0], 9418, deepen);
     } else {
-        fprintf(stderr, "Push failed\n");
+        net_set_fetch_depth(depth, 0);
+        ret = net_fetch(argv[0], 9418, branches, count);
+        net_set_fetch_depth(0, 0);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "Fetch failed\n");
+    }
+}
+
+static void cmd_remote_session(int argc, char **argv) {
+    if (argc < 1) {
+        fprintf(stderr, "Usage: fit remote-session <host>  (commands on stdin)\n");
+        return;
+    }
+
+    /* Fetches record refs/remotes/<host>/ */
+    if (!is_valid_ref_name(argv[0])) {
+        fprintf(stderr, "Error: Invalid host name '%s'\n", argv[0]);
+        return;
+    }
+
+    if (net_remote_session(argv[0], 9418) < 0) {
+        fprintf(stderr, "Some session commands failed\n");
     }
 }
 
@@ -601,6 +819,44 @@ static void cmd_gc(void) {
     gc_run();
 }
 
+static void cmd_pack_refs(int argc, char **argv) {
+    int reftable = argc > 0 && strcmp(argv[0], "--reftable") == 0;
+    if ((reftable ? ref_convert_reftable() : ref_pack()) < 0) {
+        fprintf(stderr, "Failed to pack refs\n");
+    }
+}
+
+static int print_reflog(const char *name, uint64_t update_index, const hash_t *old_hash,
+                        const hash_t *new_hash, time_t time, void *data) {
+    (void)data;
+    char old_hex[HASH_HEX_SIZE + 1], new_hex[HASH_HEX_SIZE + 1], date[32];
+    hash_to_hex(old_hash, old_hex);
+    hash_to_hex(new_hash, new_hex);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&time));
+
+    printf("%s@{%llu} %s  ", name, (unsigned long long)update_index, date);
+    if (hash_is_null(old_hash)) printf("created %.12s\n", new_hex);
+    else if (hash_is_null(new_hash)) printf("deleted (was %.12s)\n", old_hex);
+    else printf("%.12s -> %.12s\n", old_hex, new_hex);
+    return 0;
+}
+
+static void cmd_reflog(int argc, char **argv) {
+    if (!reftable_enabled()) {
+        fprintf(stderr, "Ref updates are only logged with reftable storage (fit pack-refs --reftable)\n");
+        return;
+    }
+    if (reftable_log_for_each(argc > 0 ? argv[0] : NULL, print_reflog, NULL) < 0) {
+        fprintf(stderr, "Failed to read ref log\n");
+    }
+}
+
+static void cmd_repack(void) {
+    if (repack_run() < 0) {
+        fprintf(stderr, "Repack failed\n");
+    }
+}
+
 static void cmd_snapshot(int argc, char **argv) {
     if (argc < 2 || strcmp(argv[0], "-m") != 0) {
         fprintf(stderr, "Usage: fit snapshot -m <message>\n");
@@ -636,23 +892,61 @@ static void cmd_pull(int argc, char **argv) {
     
     printf("Pulling from %s...\n", argv[0]);
     
-    if (net_recv_objects(argv[0], 9418, argv[1]) == 0) {
-        char ref_name[256];
-        snprintf(ref_name, sizeof(ref_name), "heads/%s", argv[1]);
-        
-        hash_t hash;
-        if (ref_read(ref_name, &hash) == 0) {
-            ref_update_head(&hash);
-            printf("Updated branch %s\n", argv[1]);
-        }
-    } else {
+    if (!is_valid_ref_name(argv[1])) {
+        fprintf(stderr, "Error: Invalid branch name '%s'\n", argv[1]);
+        return;
+    }
+
+    hash_t hash;
+    if (net_recv_objects(argv[0], 9418, argv[1], &hash) < 0) {
         fprintf(stderr, "Pull failed\n");
+        return;
+    }
+
+    char ref_name[256];
+    snprintf(ref_name, sizeof(ref_name), "heads/%s", argv[1]);
+    hash_t old = {0};
+    int have_old = ref_read(ref_name, &old) == 0;
+    if (have_old && hash_equal(&old, &hash)) {
+        printf("Already up to date\n");
+        return;
     }
+    if (have_old && !commit_is_ancestor(&old, &hash)) {
+        fprintf(stderr, "Rejected: %s has commits that are not in the remote branch (not a fast-forward)\n",
+                argv[1]);
+        return;
+    }
+
+    /* Only the checked-out branch moves the working tree, before its ref */
+    char *current = ref_current_branch();
+    int checked_out = current && strcmp(current, argv[1]) == 0;
+    free(current);
+    if (checked_out) {
+        hash_t current_tree;
+        const hash_t *old_tree = head_tree(&current_tree);
+        commit_t commit;
+        if (commit_read(&hash, &commit) < 0) {
+            fprintf(stderr, "Failed to read commit\n");
+            return;
+        }
+        int ret = checkout_switch(old_tree, &commit.tree);
+        commit_free(&commit);
+        if (ret < 0) {
+            fprintf(stderr, "Pull aborted: working tree not updated\n");
+            return;
+        }
+    }
+
+    ref_transaction_t *tx = ref_transaction_begin();
+    int ret = tx ? ref_transaction_update(tx, ref_name, &old, &hash) : -1;
+    if (ret == 0) ret = ref_transaction_commit(tx);
+    ref_transaction_free(tx);
+    if (ret == 0) printf("Updated branch %s\n", argv[1]);
 }
 
 static void cmd_clone(int argc, char **argv) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: fit clone <host> <branch> [directory] [--depth N]\n");
+        fprintf(stderr, "Usage: fit clone <host> <branch> [directory] [--depth N] [--filter=<spec>]\n");
         return;
     }
 
@@ -660,6 +954,7 @@ static void cmd_clone(int argc, char **argv) {
     const char *branch = argv[1];
     const char *dir = ".";
     int depth = 0; /* 0 means full clone */
+    object_filter_t filter = { FILTER_NONE, 0 };
 
     /* Parse optional arguments */
     for (int i = 2; i < argc; i++) {
@@ -670,6 +965,11 @@ static void cmd_clone(int argc, char **argv) {
                 return;
             }
             i++; /* Skip next arg */
+        } else if (strncmp(argv[i], "--filter=", 9) == 0) {
+            if (filter_parse(argv[i] + 9, &filter) < 0) {
+                fprintf(stderr, "Error: Unknown filter '%s' (use blob:none or blob:limit=<size>)\n", argv[i] + 9);
+                return;
+            }
         } else if (argv[i][0] != '-') {
             dir = argv[i];
         }
@@ -683,52 +983,35 @@ static void cmd_clone(int argc, char **argv) {
         }
     }
 
+    if (!is_valid_ref_name(branch)) {
+        fprintf(stderr, "Error: Invalid branch name '%s'\n", branch);
+        return;
+    }
     cmd_init();
 
-    /* Perform pull (which will respect depth if set) */
+    /* Check out the cloned branch; pull then writes the working tree */
+    FILE *head = fopen(FIT_HEAD_FILE, "w");
+    if (!head) {
+        fprintf(stderr, "Error: Failed to update HEAD file\n");
+        return;
+    }
+    fprintf(head, "ref: refs/heads/%s\n", branch);
+    fclose(head);
+
+    /* Partial clone: the remote is recorded as the source of left-out blobs */
+    if (filter.type != FILTER_NONE && promisor_write(host, &filter) < 0) return;
+
+    /* The server stops the history at depth commits */
+    net_set_fetch_depth(depth, 0);
     char *pull_argv[] = { (char*)host, (char*)branch };
     cmd_pull(2, pull_argv);
+    net_set_fetch_depth(0, 0);
 
     hash_t hash;
     if (ref_resolve_head(&hash) == 0) {
-        /* If shallow clone, mark the repository */
-        if (depth > 0) {
-            hash_t *commits = NULL;
-            size_t count = 0;
-
-            /* Collect commits up to depth */
-            if (shallow_collect_commits(&hash, depth, &commits, &count) == 0) {
-                /* Mark the last commit as shallow boundary */
-                if (count > 0) {
-                    hash_t shallow_boundary = commits[count - 1];
-
-                    /* Check if this commit has a parent */
-                    commit_t commit;
-                    if (commit_read(&shallow_boundary, &commit) == 0) {
-                        int has_parent = 0;
-                        for (int i = 0; i < HASH_SIZE; i++) {
-                            if (commit.parent.hash[i]) {
-                                has_parent = 1;
-                                break;
-                            }
-                        }
-
-                        if (has_parent) {
-                            /* Mark the parent as shallow */
-                            hash_t shallow_commits[1] = { commit.parent };
-                            shallow_mark(shallow_commits, 1);
-                            printf("Created shallow clone with depth %d\n", depth);
-                        }
-
-                        commit_free(&commit);
-                    }
-                }
-
-                free(commits);
-            }
+        if (shallow_is_repository_shallow()) {
+            printf("Created shallow clone with depth %d\n", depth);
         }
-
-        checkout_commit(&hash);
         printf("Cloned into %s\n", dir);
     }
 }
@@ -979,7 +1262,8 @@ static void cmd_merge(int argc, char **argv) {
             return;
         }
 
-        if (checkout_tree(&target_commit.tree, NULL) < 0) {
+        hash_t current_tree;
+        if (checkout_switch(head_tree(&current_tree), &target_commit.tree) < 0) {
             fprintf(stderr, "Failed to checkout tree\n");
             commit_free(&target_commit);
             free(current_branch);
@@ -1274,17 +1558,29 @@ static void cmd_help(void) {
     printf("  diff <commit1> [commit2]  Show differences between commits\n");
     printf("  branch [name|-d name]     List, create, or delete branches\n");
     printf("  checkout <branch>         Switch to a branch and restore files\n");
+    printf("  sparse-checkout <set <dir>...|list|disable>  Check out only some directories\n");
     printf("  merge <branch>            Merge a branch into current branch\n");
     printf("  tag [name|-a|-d]          List, create, or delete tags\n");
     printf("  remote [add|rm|list]      Manage remote repositories\n");
     printf("  stash [save|pop|list]     Stash and restore changes\n");
     printf("  snapshot -m <message>     Quick backup of all files\n");
-    printf("  push <host> <branch>      Push to remote server\n");
+    printf("  push [--force] <host> <branch...>\n");
+    printf("                            Push branches to remote server (--force rewinds diverged ones)\n");
+    printf("  fetch <host> [branch...] [--depth N | --deepen N]\n");
+    printf("                            Fetch branches into refs/remotes/<host>/ (--deepen extends a shallow clone)\n");
+    printf("  remote-session <host>     Run ls-refs/fetch/push lines from stdin over one connection\n");
     printf("  pull <host> <branch>      Pull from remote server\n");
-    printf("  clone <host> <branch> [dir] [--depth N]  Clone repository (optionally shallow)\n");
+    printf("  clone <host> <branch> [dir] [--depth N] [--filter=blob:none|blob:limit=N]\n");
+    printf("                            Clone repository (optionally shallow or partial)\n");
     printf("  restore <commit>          Restore files from commit\n");
     printf("  daemon --port <port>      Start server daemon\n");
+    printf("    [--pack-threads N] [--compression 0-9] [--unpack-limit N]\n");
+    printf("    [--pack-cache-size MB] [--socket-buffer KB]\n");
+    printf("    [--workers N] [--max-sessions N] [--max-per-client N] [--backlog N]\n");
     printf("  gc                        Run garbage collection\n");
+    printf("  repack                    Pack reachable objects and write bitmaps\n");
+    printf("  pack-refs [--reftable]    Move loose refs into .fit/packed-refs (or a reftable)\n");
+    printf("  reflog [ref]              Show logged ref updates (reftable storage)\n");
     printf("  verify                    Verify repository integrity\n");
     printf("  verify-commit <hash>      Verify commit signature\n");
     printf("  version                   Show version information\n");
@@ -1295,6 +1591,7 @@ static void cmd_help(void) {
     printf("  fit init\n");
     printf("  fit snapshot -m \"Daily backup\"\n");
     printf("  fit push 192.168.1.50 main\n");
+    printf("  fit fetch 192.168.1.50\n");
     printf("  fit pull 192.168.1.50 main\n");
     printf("  fit clone 192.168.1.50 main ~/backup\n");
     printf("  fit restore abc123def456\n");
@@ -1,30 +1,69 @@
-#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <signal.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <time.h>
 #include <pthread.h>
 #include "fit.h"
 
 #define PROTOCOL_VERSION 1
 #define PROTOCOL_MIN_VERSION 1
-#define PROTOCOL_MAX_VERSION 2
+#define PROTOCOL_MAX_VERSION 3
 #define CMD_SEND_OBJECTS 1
 #define CMD_REQUEST_OBJECTS 2
 #define CMD_NEGOTIATE 3
+#define CMD_FETCH 4       // v3: ref advertisement, then wants/haves
+#define CMD_PUSH 5        // v3: ref advertisement, then ref updates + pack
+#define CMD_LS_REFS 6     // v3: ref advertisement only
+#define CMD_FETCH_OBJECTS 7  // v3 + CAP_FILTER: blobs by hash, for partial clones
 #define SOCKET_TIMEOUT_SEC 30
+#define CONNECT_ATTEMPT_DELAY_MS 250  // Head start of each address over the next
+#define MAX_CONNECT_ADDRS 16
+#define HANDSHAKE_SIZE 6  // [MIN_VERSION:1][MAX_VERSION:1][CAPS:4]
 
 // Capability flags (bitfield)
 #define CAP_MULTI_THREADED (1 << 0)
 #define CAP_COMPRESSION    (1 << 1)
 #define CAP_STREAMING      (1 << 2)
+#define CAP_HAVES          (1 << 3)
+#define CAP_SIDEBAND       (1 << 4)
+#define CAP_RESUME         (1 << 5)
+#define CAP_FILTER         (1 << 6)
+#define CAP_SHALLOW        (1 << 7)
+
+#define FETCH_PARTIAL_FILE FIT_DIR "/fetch.partial"
+#define FETCH_PARTIAL_ID_FILE FIT_DIR "/fetch.partial.id"
+#define FETCH_RESUME_ATTEMPTS 5
+
+#define MAX_NEGOTIATION_HAVES 4096
+#define MAX_ADVERTISED_REFS 65536
+#define MAX_REF_UPDATES 4096
+#define MAX_FETCH_OBJECTS 1000000
+#define MAX_SHALLOW_COMMITS 65536
+
+// Daemon defaults, see net_set_*()
+#define DAEMON_DEFAULT_BACKLOG 128
+#define DAEMON_DEFAULT_MAX_SESSIONS 256
+#define DAEMON_DEFAULT_MAX_PER_CLIENT 8
+#define DAEMON_MAX_WORKERS 256
+#define DAEMON_MIN_WORKERS 16
+#define DAEMON_WORKERS_PER_CPU 4
+#define DAEMON_HANDSHAKE_TIMEOUT_SEC 10
+#define DAEMON_MAX_EVENTS 64
 
 // Protocol negotiation structure
 typedef struct {
@@ -33,20 +72,116 @@ typedef struct {
     uint32_t capabilities;
 } protocol_caps_t;
 
+// Growable list of hashes
+typedef struct {
+    hash_t *items;
+    size_t count;
+} hash_list_t;
+
+// A ref as advertised by the server, e.g. "heads/main"
+typedef struct {
+    char name[256];
+    hash_t hash;
+} remote_ref_t;
+
+typedef struct {
+    remote_ref_t *items;
+    size_t count;
+    size_t capacity;
+} remote_refs_t;
+
+// Serialises compare-and-swap ref updates between client threads
+static pthread_mutex_t ref_update_lock = PTHREAD_MUTEX_INITIALIZER;
+
 // Global flag for graceful shutdown
 static volatile sig_atomic_t daemon_running = 1;
 
-// Structure to pass client connection info to thread
+// Written by the signal handler to wake the event loop
+static int daemon_wake_fd = -1;
+
+static int daemon_backlog = DAEMON_DEFAULT_BACKLOG;
+static int daemon_max_sessions = DAEMON_DEFAULT_MAX_SESSIONS;
+static int daemon_max_per_client = DAEMON_DEFAULT_MAX_PER_CLIENT;
+static int daemon_workers = 0;  // 0 = DAEMON_WORKERS_PER_CPU per CPU
+static int socket_buffer = 0;   // SO_SNDBUF/SO_RCVBUF; 0 = kernel autotuning
+static __thread int client_quiet;  // Lazy fetches run under another command's output
+static int fetch_depth = 0;        // Fetch at most this many commits per tip; 0 = all
+static int fetch_deepen = 0;       // Extend the history behind the shallow commits
+static int push_force = 0;         // Let pushes replace diverged remote history
+
+// An accepted connection, owned by the event loop until handed to a worker
+typedef struct session {
+    int fd;
+    struct in6_addr addr;       // IPv4 clients as v4-mapped addresses
+    long long deadline;         // While watched: dropped if still silent by then
+    wire_t *wire;               // Set once negotiated; idle between commands
+    uint8_t version;
+    uint32_t caps;
+    int open;                   // Back from a worker still open, waiting for a command
+    struct session *next;
+    struct session *watch_prev, *watch_next;
+} session_t;
+
+// Connections from one client address: how many hold a slot, and the ones
+// queued behind them once the per-client limit is reached
+typedef struct {
+    struct in6_addr addr;
+    int active;
+    session_t *head, *tail;
+} client_slot_t;
+
+// Bounded queue of sessions ready for a worker, plus finished sessions
+// travelling back to the event loop
 typedef struct {
-    int client_fd;
-    struct sockaddr_in client_addr;
-} client_info_t;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    session_t **jobs;
+    size_t capacity, head, count;
+    session_t *done;
+    int stopping;
+} work_queue_t;
 
 // Signal handler for graceful shutdown
 static void handle_shutdown(int sig) {
     (void)sig;  // Unused parameter
     daemon_running = 0;
-    printf("\nShutting down daemon gracefully...\n");
+    if (daemon_wake_fd >= 0) {
+        uint64_t one = 1;
+        ssize_t n = write(daemon_wake_fd, &one, sizeof(one));
+        (void)n;
+    }
+}
+
+void net_set_backlog(int backlog) {
+    daemon_backlog = backlog > 0 ? backlog : DAEMON_DEFAULT_BACKLOG;
+}
+
+void net_set_max_sessions(int sessions) {
+    daemon_max_sessions = sessions > 0 ? sessions : DAEMON_DEFAULT_MAX_SESSIONS;
+}
+
+void net_set_max_per_client(int sessions) {
+    daemon_max_per_client = sessions > 0 ? sessions : DAEMON_DEFAULT_MAX_PER_CLIENT;
+}
+
+void net_set_workers(int workers) {
+    daemon_workers = workers < 0 ? 0 : workers;
+}
+
+void net_set_socket_buffer(int bytes) {
+    socket_buffer = bytes < 0 ? 0 : bytes;
+}
+
+// Depth of the following fetches; deepen extends a shallow repository's
+// history instead of cutting the new one short
+void net_set_fetch_depth(int depth, int deepen) {
+    fetch_depth = depth;
+    fetch_deepen = deepen;
+}
+
+// Whether the following pushes may rewind remote branches
+void net_set_push_force(int force) {
+    push_force = force;
 }
 
 // Helper function for reliable write
@@ -66,6 +201,430 @@ static ssize_t write_all(int fd, const void *buf, size_t count) {
     return written;
 }
 
+static int read_all(int fd, void *buf, size_t count) {
+    size_t got = 0;
+    while (got < count) {
+        ssize_t n = read(fd, (char *)buf + got, count - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        got += n;
+    }
+    return 0;
+}
+
+// Buffer sizes must be set before listen()/connect() for the TCP window
+// scale to cover them. Requests and replies are written whole, so Nagle's
+// algorithm would only hold them back; packs are corked instead.
+static void tune_socket(int sock, int connected) {
+    if (socket_buffer > 0) {
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &socket_buffer, sizeof(socket_buffer));
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &socket_buffer, sizeof(socket_buffer));
+    }
+    if (connected) {
+        int on = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+}
+
+// Pack stream source on top of the session transport
+static ssize_t read_wire(void *ctx, void *buf, size_t len) {
+    return wire_read(ctx, buf, len);
+}
+
+// Client-side status line, left out of lazy fetches
+static void client_note(const char *fmt, ...) {
+    if (client_quiet) return;
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+
+// Length-prefixed string: [LEN:4][BYTES]
+static int send_string(wire_t *w, const char *str) {
+    uint32_t len = strlen(str);
+    uint32_t len_network = htonl(len);
+    if (wire_write(w, &len_network, 4) < 0) return -1;
+    return wire_write(w, str, len);
+}
+
+static int recv_string(wire_t *w, char *buf, size_t buf_size) {
+    uint32_t len;
+    if (wire_read_full(w, &len, 4) < 0) return -1;
+    len = ntohl(len);
+    if (len >= buf_size) return -1;
+    if (wire_read_full(w, buf, len) < 0) return -1;
+    buf[len] = '\0';
+    return 0;
+}
+
+// Hash list: [COUNT:4][HASH:32]...
+static int send_hashes(wire_t *w, const hash_t *hashes, size_t count) {
+    uint32_t count_network = htonl(count);
+    if (wire_write(w, &count_network, 4) < 0) return -1;
+    for (size_t i = 0; i < count; i++) {
+        if (wire_write(w, hashes[i].hash, HASH_SIZE) < 0) return -1;
+    }
+    return 0;
+}
+
+static int recv_hashes(wire_t *w, size_t max, hash_t **hashes_out, size_t *count_out) {
+    uint32_t count;
+    if (wire_read_full(w, &count, 4) < 0) return -1;
+    count = ntohl(count);
+    if (count > max) return -1;
+
+    hash_t *hashes = malloc((count ? count : 1) * sizeof(hash_t));
+    if (!hashes) return -1;
+    for (uint32_t i = 0; i < count; i++) {
+        if (wire_read_full(w, hashes[i].hash, HASH_SIZE) < 0) {
+            free(hashes);
+            return -1;
+        }
+    }
+
+    *hashes_out = hashes;
+    *count_out = count;
+    return 0;
+}
+
+static int remote_refs_add(remote_refs_t *refs, const char *name, const hash_t *hash) {
+    if (strlen(name) >= sizeof(refs->items[0].name)) return -1;
+    if (refs->count >= refs->capacity) {
+        size_t capacity = refs->capacity ? refs->capacity * 2 : 64;
+        remote_ref_t *items = realloc(refs->items, capacity * sizeof(remote_ref_t));
+        if (!items) return -1;
+        refs->items = items;
+        refs->capacity = capacity;
+    }
+    strcpy(refs->items[refs->count].name, name);
+    refs->items[refs->count].hash = *hash;
+    refs->count++;
+    return 0;
+}
+
+static const remote_ref_t *remote_refs_find(const remote_refs_t *refs, const char *name) {
+    for (size_t i = 0; i < refs->count; i++) {
+        if (strcmp(refs->items[i].name, name) == 0) return &refs->items[i];
+    }
+    return NULL;
+}
+
+static int collect_advertised(const char *name, const hash_t *hash, void *data) {
+    return remote_refs_add(data, name, hash) < 0;
+}
+
+// Only branches and tags can be advertised or updated over the wire
+static int is_valid_wire_ref(const char *name) {
+    if (strncmp(name, "heads/", 6) == 0) return is_valid_ref_name(name + 6);
+    if (strncmp(name, "tags/", 5) == 0) return is_valid_ref_name(name + 5);
+    return 0;
+}
+
+// Ref advertisement: [COUNT:4] then [HASH:32][LEN:4][NAME] per ref
+static int send_ref_advertisement(wire_t *w, remote_refs_t *refs) {
+    ref_for_each("heads", collect_advertised, refs);
+    ref_for_each("tags", collect_advertised, refs);
+
+    uint32_t count_network = htonl(refs->count);
+    if (wire_write(w, &count_network, 4) < 0) return -1;
+    for (size_t i = 0; i < refs->count; i++) {
+        if (wire_write(w, refs->items[i].hash.hash, HASH_SIZE) < 0 ||
+            send_string(w, refs->items[i].name) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int recv_ref_advertisement(wire_t *w, remote_refs_t *refs) {
+    uint32_t count;
+    if (wire_read_full(w, &count, 4) < 0) return -1;
+    count = ntohl(count);
+    if (count > MAX_ADVERTISED_REFS) return -1;
+
+    for (uint32_t i = 0; i < count; i++) {
+        hash_t hash;
+        char name[256];
+        if (wire_read_full(w, hash.hash, HASH_SIZE) < 0 ||
+            recv_string(w, name, sizeof(name)) < 0 ||
+            remote_refs_add(refs, name, &hash) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Report a failure locally and, when the client listens, on the error channel
+static void session_error(wire_t *w, const char *fmt, ...) {
+    char msg[512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    fprintf(stderr, "%s\n", msg);
+    wire_sideband(w, WIRE_CHANNEL_ERROR, msg);
+}
+
+// Progress goes to the peer's sideband when we are serving, to our own
+// terminal when we are the client
+typedef struct {
+    wire_t *w;
+    int remote;
+    int percent;
+    uint64_t skip;              // Pack bytes the peer already has
+    pack_cache_writer_t *cache; // Also store the pack, when serving
+} pack_stream_t;
+
+// Resume point of a fetch: which pack, and how many of its bytes are held
+typedef struct {
+    hash_t id;
+    uint64_t offset;
+} pack_resume_t;
+
+static int send_resume(wire_t *w, const pack_resume_t *resume) {
+    uint32_t offset[2] = { htonl(resume->offset >> 32), htonl(resume->offset & 0xffffffff) };
+    return wire_write(w, resume->id.hash, HASH_SIZE) < 0 ? -1 : wire_write(w, offset, 8);
+}
+
+static int recv_resume(wire_t *w, pack_resume_t *resume) {
+    uint32_t offset[2];
+    if (wire_read_full(w, resume->id.hash, HASH_SIZE) < 0 || wire_read_full(w, offset, 8) < 0) {
+        return -1;
+    }
+    resume->offset = (uint64_t)ntohl(offset[0]) << 32 | ntohl(offset[1]);
+    return 0;
+}
+
+// Object filter: [TYPE:1][LIMIT:8]
+static int send_filter(wire_t *w, const object_filter_t *filter) {
+    unsigned char buf[9] = { filter->type };
+    for (int i = 0; i < 8; i++) buf[1 + i] = filter->limit >> (56 - 8 * i);
+    return wire_write(w, buf, sizeof(buf));
+}
+
+static int recv_filter(wire_t *w, object_filter_t *filter) {
+    unsigned char buf[9];
+    if (wire_read_full(w, buf, sizeof(buf)) < 0 || buf[0] > FILTER_BLOB_LIMIT) return -1;
+    filter->type = buf[0];
+    filter->limit = 0;
+    for (int i = 0; i < 8; i++) filter->limit = filter->limit << 8 | buf[1 + i];
+    return 0;
+}
+
+// Shallow request: [DEPTH:4][DEEPEN:1] then the client's shallow commits
+static int send_shallow(wire_t *w, const shallow_spec_t *spec) {
+    unsigned char buf[5] = { spec->depth >> 24, spec->depth >> 16, spec->depth >> 8, spec->depth,
+                             spec->deepen != 0 };
+    return wire_write(w, buf, sizeof(buf)) < 0 ? -1 : send_hashes(w, spec->commits, spec->count);
+}
+
+static int recv_shallow(wire_t *w, shallow_spec_t *spec, hash_t **commits) {
+    unsigned char buf[5];
+    size_t count;
+    if (wire_read_full(w, buf, sizeof(buf)) < 0 ||
+        recv_hashes(w, MAX_SHALLOW_COMMITS, commits, &count) < 0) {
+        return -1;
+    }
+    spec->depth = (int)((uint32_t)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3]);
+    spec->deepen = buf[4];
+    spec->commits = *commits;
+    spec->count = count;
+    return spec->depth < 0 ? -1 : 0;
+}
+
+// What a fetch asked for beyond its wants and haves
+typedef struct {
+    const pack_resume_t *resume;
+    const object_filter_t *filter;
+    const shallow_spec_t *shallow;
+    hash_t *new_shallow;        // Out: commits sent without their parents
+    size_t new_shallow_count;
+} pack_request_t;
+
+static void stream_progress(pack_stream_t *stream, const char *fmt, ...) {
+    char msg[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    if (stream->remote) {
+        wire_sideband(stream->w, WIRE_CHANNEL_PROGRESS, msg);
+    } else if (isatty(STDERR_FILENO)) {
+        fputs(msg, stderr);
+    }
+}
+
+static int write_pack_stream(void *ctx, const void *buf, size_t len) {
+    pack_stream_t *stream = ctx;
+    if (stream->cache && pack_cache_write(stream->cache, buf, len) < 0) {
+        pack_cache_abort(stream->cache);
+        stream->cache = NULL;
+    }
+    if (stream->skip >= len) {
+        stream->skip -= len;
+        return 0;
+    }
+    const char *p = (const char *)buf + stream->skip;
+    len -= stream->skip;
+    stream->skip = 0;
+    return wire_write(stream->w, p, len);
+}
+
+static void pack_stream_progress(void *ctx, size_t done, size_t total) {
+    pack_stream_t *stream = ctx;
+    int percent = (int)(done * 100 / total);
+    if (percent == stream->percent && done != total) return;
+    stream->percent = percent;
+    stream_progress(stream, "Sending objects: %3d%% (%zu/%zu)%s", percent, done, total,
+                    done == total ? ", done.\n" : "\r");
+}
+
+// Answer a resume request for the pack named id: the stream starts at the
+// requested offset if the client holds part of this very pack, else at zero
+static int send_resume_start(wire_t *w, const hash_t *id, const pack_resume_t *resume,
+                             uint64_t *offset) {
+    pack_resume_t start = { .id = *id, .offset = 0 };
+    if (hash_equal(id, &resume->id)) start.offset = resume->offset;
+    if (send_resume(w, &start) < 0) return -1;
+    if (start.offset > 0) {
+        printf("Resuming pack at byte %llu\n", (unsigned long long)start.offset);
+    }
+    *offset = start.offset;
+    return 0;
+}
+
+// Send a pack that already exists on disk, size bytes from the current
+// position of fd, copying it from the page cache straight to the socket
+static int send_pack_file(wire_t *w, int fd, const hash_t *id, uint64_t size,
+                          const pack_resume_t *resume) {
+    uint64_t offset = 0;
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    if (start < 0) return -1;
+    if (resume && send_resume_start(w, id, resume, &offset) < 0) return -1;
+    if (offset > size) return -1;
+
+    wire_set_compress(w, 0);
+    wire_set_cork(w, 1);
+    int ret = wire_sendfile(w, fd, start + (off_t)offset, size - offset);
+    if (ret == 0) ret = wire_flush(w);
+    wire_set_cork(w, 0);
+    wire_set_compress(w, 1);
+    return ret;
+}
+
+// Generate and stream a pack of exactly these objects
+static int stream_pack(wire_t *w, const hash_t *objects, size_t count, pack_stream_t *stream) {
+    // Pack entries are already deflated; don't compress them again
+    wire_set_compress(w, 0);
+    wire_set_cork(w, 1);
+    int ret = pack_write(objects, count, write_pack_stream, pack_stream_progress, stream);
+    if (ret == 0) ret = wire_flush(w);
+    wire_set_cork(w, 0);
+    wire_set_compress(w, 1);
+    return ret;
+}
+
+// Generate a pack of everything reachable from wants minus haves and stream it.
+// With a resume request, first answer with the pack's id and the offset the
+// stream starts at. When serving, packs are kept in and reused from the pack
+// cache, and a stored pack holding exactly the objects is sent as is. A
+// filter (partial clone) leaves blobs out, and bypasses both. A shallow
+// request cuts the history short and bypasses the cache.
+static int send_pack(wire_t *w, const hash_t *wants, size_t want_count,
+                     const hash_t *haves, size_t have_count, int remote,
+                     pack_request_t *req) {
+    pack_stream_t stream = { .w = w, .remote = remote, .percent = -1 };
+    const pack_resume_t *resume = req ? req->resume : NULL;
+    const object_filter_t *filter = req ? req->filter : NULL;
+    const shallow_spec_t *shallow = req ? req->shallow : NULL;
+    hash_t *objects = NULL;
+    size_t count = 0;
+    hash_t key, id;
+
+    int filtered = filter && filter->type != FILTER_NONE;
+    if (shallow && shallow->depth == 0 && shallow->count == 0) shallow = NULL;
+    int cacheable = remote && !filtered && !shallow && pack_cache_enabled() &&
+                    pack_cache_key(wants, want_count, haves, have_count, &key) == 0;
+    if (cacheable) {
+        uint64_t size;
+        int fd = pack_cache_open(&key, &id, &size);
+        if (fd >= 0) {
+            pack_stream_t stream = { .w = w, .remote = 1 };
+            printf("Sending cached pack (%llu bytes)\n", (unsigned long long)size);
+            stream_progress(&stream, "Reusing cached pack: %llu bytes, done.\n",
+                            (unsigned long long)size);
+            int ret = send_pack_file(w, fd, &id, size, resume);
+            close(fd);
+            return ret;
+        }
+    }
+
+    stream_progress(&stream, "Enumerating objects...\r");
+    int listed = shallow ? rev_list_shallow(wants, want_count, haves, have_count, shallow,
+                                            &objects, &count, &req->new_shallow,
+                                            &req->new_shallow_count)
+                         : rev_list_objects(wants, want_count, haves, have_count, &objects, &count);
+    if (listed < 0) {
+        fprintf(stderr, "Failed to enumerate objects\n");
+        return -1;
+    }
+    stream_progress(&stream, "Enumerating objects: %zu, done.\n", count);
+
+    if (filtered) {
+        size_t kept = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (!filter_omits(filter, &objects[i])) objects[kept++] = objects[i];
+        }
+        stream_progress(&stream, "Filtered out %zu blobs\n", count - kept);
+        count = kept;
+    }
+
+    printf("Sending %zu objects\n", count);
+
+    // A full clone usually asks for exactly what the last repack stored
+    if (remote && !filtered) {
+        uint64_t size;
+        int fd = pack_open_matching(objects, count, &id, &size);
+        if (fd >= 0) {
+            free(objects);
+            printf("Sending stored pack (%llu bytes)\n", (unsigned long long)size);
+            stream_progress(&stream, "Reusing stored pack: %llu bytes, done.\n",
+                            (unsigned long long)size);
+            int ret = send_pack_file(w, fd, &id, size, resume);
+            close(fd);
+            return ret;
+        }
+    }
+
+    if ((resume || cacheable) && pack_id(objects, count, &id) < 0) {
+        free(objects);
+        return -1;
+    }
+    if (resume && send_resume_start(w, &id, resume, &stream.skip) < 0) {
+        free(objects);
+        return -1;
+    }
+    if (cacheable && count > 0) {
+        stream.cache = pack_cache_begin(&key, &id, wants, want_count);
+    }
+
+    int ret = stream_pack(w, objects, count, &stream);
+    free(objects);
+
+    if (stream.cache) {
+        if (ret == 0) {
+            pack_cache_commit(stream.cache);
+        } else {
+            pack_cache_abort(stream.cache);
+        }
+    }
+    return ret;
+}
+
 // Helper function for setting socket timeouts
 static int set_socket_timeout(int sock, int seconds) {
     struct timeval tv;
@@ -86,40 +645,42 @@ static protocol_caps_t get_server_capabilities(void) {
     protocol_caps_t caps;
     caps.min_version = PROTOCOL_MIN_VERSION;
     caps.max_version = PROTOCOL_MAX_VERSION;
-    caps.capabilities = CAP_MULTI_THREADED | CAP_COMPRESSION | CAP_STREAMING;
+    caps.capabilities = CAP_MULTI_THREADED | CAP_COMPRESSION | CAP_STREAMING | CAP_HAVES | CAP_SIDEBAND |
+                        CAP_RESUME | CAP_FILTER | CAP_SHALLOW;
     return caps;
 }
 
+static void encode_caps(const protocol_caps_t *caps, unsigned char *buf) {
+    uint32_t caps_network = htonl(caps->capabilities);
+    buf[0] = caps->min_version;
+    buf[1] = caps->max_version;
+    memcpy(buf + 2, &caps_network, 4);
+}
+
+static void decode_caps(const unsigned char *buf, protocol_caps_t *caps) {
+    uint32_t caps_network;
+    memcpy(&caps_network, buf + 2, 4);
+    caps->min_version = buf[0];
+    caps->max_version = buf[1];
+    caps->capabilities = ntohl(caps_network);
+}
+
 // Negotiate protocol version with client
 static int negotiate_protocol(int client_fd, uint8_t *negotiated_version, uint32_t *negotiated_caps) {
     protocol_caps_t server_caps = get_server_capabilities();
     protocol_caps_t client_caps;
+    unsigned char buf[HANDSHAKE_SIZE];
 
     // Receive client capabilities
-    ssize_t bytes_read;
-    bytes_read = read(client_fd, &client_caps.min_version, 1);
-    if (bytes_read != 1) {
-        fprintf(stderr, "Failed to read client min_version (read %zd bytes)\n", bytes_read);
-        return -1;
-    }
-    bytes_read = read(client_fd, &client_caps.max_version, 1);
-    if (bytes_read != 1) {
-        fprintf(stderr, "Failed to read client max_version (read %zd bytes)\n", bytes_read);
-        return -1;
-    }
-    bytes_read = read(client_fd, &client_caps.capabilities, sizeof(uint32_t));
-    if (bytes_read != sizeof(uint32_t)) {
-        fprintf(stderr, "Failed to read client capabilities (read %zd bytes)\n", bytes_read);
+    if (read_all(client_fd, buf, sizeof(buf)) < 0) {
+        fprintf(stderr, "Failed to read client capabilities\n");
         return -1;
     }
-
-    client_caps.capabilities = ntohl(client_caps.capabilities);
+    decode_caps(buf, &client_caps);
 
     // Send server capabilities
-    uint32_t caps_network = htonl(server_caps.capabilities);
-    if (write_all(client_fd, &server_caps.min_version, 1) != 1 ||
-        write_all(client_fd, &server_caps.max_version, 1) != 1 ||
-        write_all(client_fd, &caps_network, sizeof(uint32_t)) != sizeof(uint32_t)) {
+    encode_caps(&server_caps, buf);
+    if (write_all(client_fd, buf, sizeof(buf)) != sizeof(buf)) {
         fprintf(stderr, "Failed to send server capabilities\n");
         return -1;
     }
@@ -149,45 +710,24 @@ static int client_negotiate_protocol(int sock, uint8_t *negotiated_version, uint
     protocol_caps_t client_caps;
     client_caps.min_version = PROTOCOL_MIN_VERSION;
     client_caps.max_version = PROTOCOL_MAX_VERSION;
-    client_caps.capabilities = CAP_MULTI_THREADED | CAP_COMPRESSION | CAP_STREAMING;
+    client_caps.capabilities = CAP_MULTI_THREADED | CAP_COMPRESSION | CAP_STREAMING | CAP_HAVES |
+                               CAP_SIDEBAND | CAP_RESUME | CAP_FILTER | CAP_SHALLOW;
 
-    // Send negotiation command
-    uint8_t version = PROTOCOL_MAX_VERSION;
-    uint8_t cmd = CMD_NEGOTIATE;
-    if (write_all(sock, &version, 1) != 1 || write_all(sock, &cmd, 1) != 1) {
-        fprintf(stderr, "Failed to send negotiation header\n");
-        return -1;
-    }
-
-    // Send client capabilities
-    uint32_t caps_network = htonl(client_caps.capabilities);
-    if (write_all(sock, &client_caps.min_version, 1) != 1 ||
-        write_all(sock, &client_caps.max_version, 1) != 1 ||
-        write_all(sock, &caps_network, sizeof(uint32_t)) != sizeof(uint32_t)) {
+    // Negotiation command and client capabilities go out in one segment
+    unsigned char buf[2 + HANDSHAKE_SIZE] = { PROTOCOL_MAX_VERSION, CMD_NEGOTIATE };
+    encode_caps(&client_caps, buf + 2);
+    if (write_all(sock, buf, sizeof(buf)) != sizeof(buf)) {
         fprintf(stderr, "Failed to send client capabilities\n");
         return -1;
     }
 
     // Receive server capabilities
     protocol_caps_t server_caps;
-    ssize_t srv_bytes_read;
-    srv_bytes_read = read(sock, &server_caps.min_version, 1);
-    if (srv_bytes_read != 1) {
-        fprintf(stderr, "Failed to read server min_version (read %zd bytes)\n", srv_bytes_read);
-        return -1;
-    }
-    srv_bytes_read = read(sock, &server_caps.max_version, 1);
-    if (srv_bytes_read != 1) {
-        fprintf(stderr, "Failed to read server max_version (read %zd bytes)\n", srv_bytes_read);
-        return -1;
-    }
-    srv_bytes_read = read(sock, &server_caps.capabilities, sizeof(uint32_t));
-    if (srv_bytes_read != sizeof(uint32_t)) {
-        fprintf(stderr, "Failed to read server capabilities (read %zd bytes)\n", srv_bytes_read);
+    if (read_all(sock, buf, HANDSHAKE_SIZE) < 0) {
+        fprintf(stderr, "Failed to read server capabilities\n");
         return -1;
     }
-
-    server_caps.capabilities = ntohl(server_caps.capabilities);
+    decode_caps(buf, &server_caps);
 
     // Negotiate version
     uint8_t max_common = (client_caps.max_version < server_caps.max_version)
@@ -203,408 +743,1026 @@ static int client_negotiate_protocol(int sock, uint8_t *negotiated_version, uint
     *negotiated_version = max_common;
     *negotiated_caps = client_caps.capabilities & server_caps.capabilities;
 
-    printf("Negotiated protocol version %d with capabilities 0x%x\n",
-           *negotiated_version, *negotiated_caps);
+    client_note("Negotiated protocol version %d with capabilities 0x%x\n",
+                *negotiated_version, *negotiated_caps);
 
     return 0;
 }
 
-// Handle client connection (called from thread)
-static void handle_client(int client_fd, struct sockaddr_in client_addr) {
-    // Set timeout on client socket
-    if (set_socket_timeout(client_fd, SOCKET_TIMEOUT_SEC) < 0) {
-        fprintf(stderr, "Warning: Failed to set socket timeout\n");
-    }
-
-    printf("Client connected from %s\n", inet_ntoa(client_addr.sin_addr));
+// Framing (and compression on top of it) is only used from v3 on: older
+// peers advertised CAP_STREAMING/CAP_COMPRESSION without implementing them
+static wire_t *session_wire(int fd, uint8_t version, uint32_t caps) {
+    int framed = version >= 3 && (caps & CAP_STREAMING);
+    return wire_new(fd, framed, framed && (caps & CAP_COMPRESSION),
+                    framed && (caps & CAP_SIDEBAND));
+}
 
-    uint8_t version, cmd;
-    if (read(client_fd, &version, 1) != 1 || read(client_fd, &cmd, 1) != 1) {
-        fprintf(stderr, "Failed to read protocol header\n");
-        close(client_fd);
-        return;
+// Apply one ref update; returns NULL on success or the reason it was refused.
+// Unless forced, a branch may only move to a descendant of its current tip.
+static const char *apply_ref_update(const char *name, const hash_t *old_hash,
+                                    const hash_t *new_hash, int force) {
+    if (!is_valid_wire_ref(name)) return "invalid ref name";
+
+    hash_t current = {0};
+    ref_read(name, &current);
+    if (!hash_equal(&current, old_hash)) return "stale old value";
+
+    if (!hash_is_null(new_hash)) {
+        commit_t commit;
+        if (commit_read(new_hash, &commit) < 0) return "missing objects";
+        commit_free(&commit);
+        if (!force && !hash_is_null(&current) && !commit_is_ancestor(&current, new_hash)) {
+            return "non-fast-forward";
+        }
     }
 
-    uint8_t negotiated_version = version;
-    uint32_t negotiated_caps = 0;
+    // The old value is checked again under the ref's lock
+    ref_transaction_t *tx = ref_transaction_begin();
+    int ok = tx && ref_transaction_update(tx, name, old_hash, new_hash) == 0 &&
+             ref_transaction_commit(tx) == 0;
+    ref_transaction_free(tx);
+    if (!ok) return hash_is_null(new_hash) ? "delete failed" : "write failed";
 
-    // Handle protocol negotiation for version 2+
-    if (cmd == CMD_NEGOTIATE) {
-        if (negotiate_protocol(client_fd, &negotiated_version, &negotiated_caps) < 0) {
-            fprintf(stderr, "Protocol negotiation failed\n");
-            close(client_fd);
-            return;
-        }
+    if (!hash_is_null(&current)) pack_cache_invalidate(&current);
+    return NULL;
+}
 
-        // Read actual command after negotiation
-        if (read(client_fd, &cmd, 1) != 1) {
-            fprintf(stderr, "Failed to read command after negotiation\n");
-            close(client_fd);
-            return;
-        }
-    } else {
-        // Legacy protocol (version 1), no negotiation
-        if (version != PROTOCOL_VERSION) {
-            fprintf(stderr, "Protocol version mismatch: got %d, expected %d\n", version, PROTOCOL_VERSION);
-            close(client_fd);
-            return;
-        }
-    }
-
-    if (cmd == CMD_SEND_OBJECTS) {
-        printf("Receiving objects...\n");
-        char pack_file[256];
-        snprintf(pack_file, sizeof(pack_file), "/tmp/fit_recv_%d_%ld.pack", getpid(), (long)pthread_self());
-
-        FILE *f = fopen(pack_file, "wb");
-        if (!f) {
-            perror("Failed to create pack file");
-            close(client_fd);
-            return;
-        }
-
-        char buf[8192];
-        ssize_t n;
-        size_t total = 0;
-        while ((n = read(client_fd, buf, sizeof(buf))) > 0) {
-            size_t written = fwrite(buf, 1, n, f);
-            if (written != (size_t)n) {
-                fprintf(stderr, "Failed to write to pack file\n");
-                fclose(f);
-                close(client_fd);
-                unlink(pack_file);
-                return;
-            }
-            total += n;
-        }
-        fclose(f);
-
-        printf("Received %zu bytes\n", total);
-
-        if (unpack_objects(pack_file) == 0) {
-            printf("Successfully unpacked objects\n");
-            hash_t latest_commit = {0};
-            FILE *pf = fopen(pack_file, "rb");
-            if (pf) {
-                char sig[4];
-                if (fread(sig, 1, 4, pf) == 4) {
-                    uint32_t version_val, num_objects;
-                    if (fread(&version_val, 4, 1, pf) == 1 && fread(&num_objects, 4, 1, pf) == 1) {
-                        num_objects = ntohl(num_objects);
-
-                        if (num_objects > 0) {
-                            uint32_t type, size;
-                            if (fread(&type, 4, 1, pf) == 1 &&
-                                fread(&size, 4, 1, pf) == 1 &&
-                                fread(latest_commit.hash, HASH_SIZE, 1, pf) == 1) {
-
-                                if (ntohl(type) == OBJ_COMMIT) {
-                                    if (ref_write("heads/main", &latest_commit) == 0) {
-                                        printf("Updated main branch\n");
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-                fclose(pf);
-            }
-        } else {
-            fprintf(stderr, "Failed to unpack objects\n");
-        }
-        unlink(pack_file);
-    } else if (cmd == CMD_REQUEST_OBJECTS) {
-        printf("Sending objects...\n");
-        size_t branch_len;
-        if (read(client_fd, &branch_len, sizeof(branch_len)) != sizeof(branch_len)) {
-            fprintf(stderr, "Failed to read branch length\n");
-            close(client_fd);
-            return;
-        }
+// Push: receive a pack and move the pushed branch
+static int serve_receive_pack(wire_t *w, uint32_t caps) {
+    printf("Receiving objects...\n");
 
-        char branch[256] = {0};
-        if (branch_len >= sizeof(branch)) {
-            fprintf(stderr, "Branch name too long: %zu\n", branch_len);
-            close(client_fd);
-            return;
-        }
+    char branch[256] = "main";
+    hash_t old_tip = {0}, new_tip = {0};
 
-        if (branch_len > 0 && read(client_fd, branch, branch_len) != (ssize_t)branch_len) {
-            fprintf(stderr, "Failed to read branch name\n");
-            close(client_fd);
-            return;
+    // Tell the client where the branch is so it only sends what is missing
+    if (caps & CAP_HAVES) {
+        if (recv_string(w, branch, sizeof(branch)) < 0 || !is_valid_ref_name(branch)) {
+            session_error(w, "Invalid branch in push request");
+            return -1;
         }
 
-        char ref_name[256];
+        char ref_name[512];
         snprintf(ref_name, sizeof(ref_name), "heads/%s", branch);
+        ref_read(ref_name, &old_tip);
 
-        hash_t hash;
-        if (ref_read(ref_name, &hash) == 0) {
-            hash_t hashes[256];
-            int count = 0;
-
-            hash_t current = hash;
-            while (count < 256) {
-                hashes[count++] = current;
-
-                commit_t commit;
-                if (commit_read(&current, &commit) < 0) break;
-
-                int has_parent = 0;
-                for (int i = 0; i < HASH_SIZE; i++) {
-                    if (commit.parent.hash[i]) {
-                        has_parent = 1;
-                        break;
-                    }
-                }
-
-                if (!has_parent) {
-                    commit_free(&commit);
-                    break;
-                }
-
-                current = commit.parent;
-                commit_free(&commit);
-            }
-
-            char pack_file[256];
-            snprintf(pack_file, sizeof(pack_file), "/tmp/fit_send_%d_%ld.pack", getpid(), (long)pthread_self());
-            if (pack_objects(hashes, count, pack_file) == 0) {
-                FILE *f = fopen(pack_file, "rb");
-                if (f) {
-                    char buf[8192];
-                    size_t n;
-                    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
-                        if (write_all(client_fd, buf, n) != (ssize_t)n) {
-                            fprintf(stderr, "Failed to send data to client\n");
-                            break;
-                        }
-                    }
-                    fclose(f);
-                    unlink(pack_file);
-                } else {
-                    fprintf(stderr, "Failed to open pack file for reading\n");
-                }
-            } else {
-                fprintf(stderr, "Failed to create pack file\n");
-            }
-        } else {
-            fprintf(stderr, "Branch '%s' not found\n", branch);
+        if (wire_write(w, old_tip.hash, HASH_SIZE) < 0 || wire_flush(w) < 0 ||
+            wire_read_full(w, new_tip.hash, HASH_SIZE) < 0) {
+            fprintf(stderr, "Failed to exchange branch tips\n");
+            return -1;
         }
     }
 
-    close(client_fd);
-}
-
-// Thread entry point
-static void *client_thread(void *arg) {
-    client_info_t *info = (client_info_t *)arg;
-    handle_client(info->client_fd, info->client_addr);
-    free(info);
-    return NULL;
-}
+    pack_index_result_t result;
+    if (pack_receive(read_wire, w, &result) < 0 || wire_expect_flush(w) < 0) {
+        session_error(w, "Failed to receive objects");
+        return -1;
+    }
+    printf("Received %zu bytes, stored %u objects\n", result.bytes, result.num_objects);
 
-int net_daemon_start(int port) {
-    // Setup signal handlers for graceful shutdown
-    struct sigaction sa;
-    sa.sa_handler = handle_shutdown;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
+    if (!(caps & CAP_HAVES)) {
+        // Legacy clients: the first object of the pack is the pushed tip
+        if (!result.has_first_commit) return 0;
+        new_tip = result.first_commit;
+    }
 
-    if (sigaction(SIGINT, &sa, NULL) < 0) {
-        perror("Warning: Failed to set SIGINT handler");
+    commit_t commit;
+    if (commit_read(&new_tip, &commit) < 0) {
+        session_error(w, "Pushed tip is missing, not updating %s", branch);
+        return -1;
     }
-    if (sigaction(SIGTERM, &sa, NULL) < 0) {
-        perror("Warning: Failed to set SIGTERM handler");
+    commit_free(&commit);
+
+    // Same rules as a v3 push: the tip the client built on, fast-forward only
+    char ref_name[512];
+    snprintf(ref_name, sizeof(ref_name), "heads/%s", branch);
+    pthread_mutex_lock(&ref_update_lock);
+    if (!(caps & CAP_HAVES)) ref_read(ref_name, &old_tip);
+    const char *error = apply_ref_update(ref_name, &old_tip, &new_tip, 0);
+    pthread_mutex_unlock(&ref_update_lock);
+    if (error) {
+        session_error(w, "Rejected %s: %s", branch, error);
+        return -1;
     }
+    printf("Updated %s branch\n", branch);
+    return 0;
+}
 
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        perror("Failed to create socket");
+// Pull/clone: send everything the client is missing for one branch
+static int serve_upload_pack(wire_t *w, uint32_t caps) {
+    printf("Sending objects...\n");
+    size_t branch_len;
+    if (wire_read_full(w, &branch_len, sizeof(branch_len)) < 0) {
+        fprintf(stderr, "Failed to read branch length\n");
         return -1;
     }
 
-    int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-
-    struct sockaddr_in addr = {0};
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(port);
-
-    if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("Failed to bind to port");
-        close(server_fd);
+    char branch[256] = {0};
+    if (branch_len >= sizeof(branch)) {
+        session_error(w, "Branch name too long: %zu", branch_len);
         return -1;
     }
 
-    if (listen(server_fd, 5) < 0) {
-        perror("Failed to listen");
-        close(server_fd);
+    if (branch_len > 0 && wire_read_full(w, branch, branch_len) < 0) {
+        fprintf(stderr, "Failed to read branch name\n");
         return -1;
     }
 
-    printf("Fit daemon listening on port %d (multi-threaded)\n", port);
-    printf("Press Ctrl+C to stop\n");
+    hash_t *haves = NULL;
+    size_t have_count = 0;
+    if ((caps & CAP_HAVES) &&
+        recv_hashes(w, MAX_NEGOTIATION_HAVES, &haves, &have_count) < 0) {
+        fprintf(stderr, "Failed to read client haves\n");
+        return -1;
+    }
 
-    while (daemon_running) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
+    char ref_name[512];
+    snprintf(ref_name, sizeof(ref_name), "heads/%s", branch);
 
-        if (client_fd < 0) {
-            if (!daemon_running) break;  // Shutting down
-            perror("Failed to accept connection");
-            continue;
-        }
+    hash_t tip = {0};
+    int found = is_valid_ref_name(branch) && ref_read(ref_name, &tip) == 0;
+    int ret = -1;
 
-        // Allocate client info structure
-        client_info_t *info = malloc(sizeof(client_info_t));
-        if (!info) {
-            fprintf(stderr, "Failed to allocate memory for client info\n");
-            close(client_fd);
-            continue;
+    if ((caps & CAP_HAVES) && wire_write(w, tip.hash, HASH_SIZE) < 0) {
+        fprintf(stderr, "Failed to send branch tip\n");
+    } else if (!found) {
+        session_error(w, "Branch '%s' not found", branch);
+        wire_flush(w);
+    } else if (send_pack(w, &tip, 1, haves, have_count, 1, NULL) < 0) {
+        session_error(w, "Failed to send pack");
+    } else {
+        ret = 0;
+    }
+
+    free(haves);
+    return ret;
+}
+
+// The client's shallow commits become walk starts when deepening, so keep
+// only those in the history of an advertised tip; returns how many remain
+static size_t keep_advertised_shallow(const remote_refs_t *refs, hash_t *commits, size_t count) {
+    hash_set_t pending, seen;
+    hash_set_init(&pending);
+    hash_set_init(&seen);
+    size_t left = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (hash_set_add(&pending, &commits[i]) == 1) left++;
+    }
+
+    hash_set_t found;
+    hash_set_init(&found);
+    for (size_t i = 0; i < refs->count && left > 0; i++) {
+        hash_t current = refs->items[i].hash;
+        while (left > 0 && !hash_is_null(&current) && hash_set_add(&seen, &current) == 1) {
+            if (hash_set_contains(&pending, &current) && hash_set_add(&found, &current) == 1) left--;
+            commit_t commit;
+            if (commit_read(&current, &commit) < 0) break;  // Tag, or our own shallow boundary
+            current = commit.parent;
+            commit_free(&commit);
         }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (hash_set_contains(&found, &commits[i])) commits[kept++] = commits[i];
+    }
+    hash_set_free(&pending);
+    hash_set_free(&seen);
+    hash_set_free(&found);
+    return kept;
+}
+
+// v3 fetch: advertise refs, then send objects for any advertised tips wanted
+static int serve_fetch(wire_t *w, uint32_t caps) {
+    remote_refs_t refs = {0};
+    pack_resume_t resume = {0};
+    object_filter_t filter = { FILTER_NONE, 0 };
+    shallow_spec_t shallow = {0};
+    pack_request_t req = { .filter = &filter, .shallow = &shallow };
+    hash_t *wants = NULL, *haves = NULL, *client_shallow = NULL;
+    size_t want_count = 0, have_count = 0;
+    int ret = -1;
+
+    if (send_ref_advertisement(w, &refs) < 0 || wire_flush(w) < 0 ||
+        recv_hashes(w, MAX_ADVERTISED_REFS, &wants, &want_count) < 0) {
+        fprintf(stderr, "Failed to exchange refs\n");
+        goto out;
+    }
 
-        info->client_fd = client_fd;
-        info->client_addr = client_addr;
+    // Client already has everything
+    if (want_count == 0) {
+        ret = 0;
+        goto out;
+    }
 
-        // Create detached thread to handle client
-        pthread_t thread;
-        pthread_attr_t attr;
-        pthread_attr_init(&attr);
-        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (recv_hashes(w, MAX_NEGOTIATION_HAVES, &haves, &have_count) < 0 ||
+        ((caps & CAP_FILTER) && recv_filter(w, &filter) < 0) ||
+        ((caps & CAP_SHALLOW) && recv_shallow(w, &shallow, &client_shallow) < 0) ||
+        ((caps & CAP_RESUME) && recv_resume(w, &resume) < 0)) {
+        fprintf(stderr, "Failed to read client haves\n");
+        goto out;
+    }
 
-        if (pthread_create(&thread, &attr, client_thread, info) != 0) {
-            fprintf(stderr, "Failed to create thread for client\n");
-            close(client_fd);
-            free(info);
+    // Only advertised tips may be requested
+    for (size_t i = 0; i < want_count; i++) {
+        int advertised = 0;
+        for (size_t j = 0; j < refs.count && !advertised; j++) {
+            advertised = hash_equal(&wants[i], &refs.items[j].hash);
+        }
+        if (!advertised) {
+            session_error(w, "Client wants an unadvertised object");
+            goto out;
         }
+    }
+    if (shallow.count > 0) {
+        size_t kept = keep_advertised_shallow(&refs, client_shallow, shallow.count);
+        if (kept < shallow.count) {
+            fprintf(stderr, "Ignoring %zu shallow commits not reachable from advertised refs\n",
+                    shallow.count - kept);
+        }
+        shallow.count = kept;
+    }
 
-        pthread_attr_destroy(&attr);
+    if (caps & CAP_RESUME) req.resume = &resume;
+    if (send_pack(w, wants, want_count, haves, have_count, 1, &req) < 0) {
+        session_error(w, "Failed to send pack");
+        goto out;
     }
 
-    printf("Daemon stopped\n");
-    close(server_fd);
-    return 0;
+    // The client's new shallow commits follow the pack
+    if ((caps & CAP_SHALLOW) &&
+        (send_hashes(w, req.new_shallow, req.new_shallow_count) < 0 || wire_flush(w) < 0)) {
+        fprintf(stderr, "Failed to send shallow commits\n");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    free(wants);
+    free(haves);
+    free(client_shallow);
+    free(req.new_shallow);
+    free(refs.items);
+    return ret;
 }
 
-int net_send_objects(const char *host, int port, const hash_t *hashes, size_t count) {
-    struct addrinfo hints = {0}, *result;
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
+// v3 push: advertise refs, read [OLD][NEW][NAME] updates and a pack, then
+// apply each update as a compare-and-swap and report a status per ref. A
+// NAME starting with '+' asks for a forced, non-fast-forward update.
+static int serve_push(wire_t *w) {
+    remote_refs_t refs = {0};
+    int sent = send_ref_advertisement(w, &refs) == 0 && wire_flush(w) == 0;
+    free(refs.items);
+    if (!sent) return -1;
+
+    uint32_t count;
+    if (wire_read_full(w, &count, 4) < 0 || (count = ntohl(count)) > MAX_REF_UPDATES) {
+        session_error(w, "Invalid ref update list");
+        return -1;
+    }
 
-    char port_str[16];
-    snprintf(port_str, sizeof(port_str), "%d", port);
+    remote_refs_t updates = {0};
+    hash_t *old_hashes = malloc((count ? count : 1) * sizeof(hash_t));
+    int ret = -1;
+    if (!old_hashes) return -1;
+    for (uint32_t i = 0; i < count; i++) {
+        hash_t new_hash;
+        char name[256];
+        if (wire_read_full(w, old_hashes[i].hash, HASH_SIZE) < 0 ||
+            wire_read_full(w, new_hash.hash, HASH_SIZE) < 0 ||
+            recv_string(w, name, sizeof(name)) < 0 ||
+            remote_refs_add(&updates, name, &new_hash) < 0) {
+            fprintf(stderr, "Failed to read ref updates\n");
+            goto out;
+        }
+    }
 
-    if (getaddrinfo(host, port_str, &hints, &result) != 0) {
-        fprintf(stderr, "Failed to resolve host '%s'\n", host);
-        return -1;
+    pack_index_result_t result;
+    if (pack_receive(read_wire, w, &result) < 0 || wire_expect_flush(w) < 0) {
+        session_error(w, "Failed to receive objects");
+        goto out;
     }
+    printf("Received %zu bytes, stored %u objects\n", result.bytes, result.num_objects);
+
+    // Status: [COUNT:4] then [OK:1][LEN:4][MESSAGE] per update
+    uint32_t count_network = htonl(count);
+    ret = wire_write(w, &count_network, 4);
+
+    pthread_mutex_lock(&ref_update_lock);
+    for (uint32_t i = 0; ret == 0 && i < count; i++) {
+        const remote_ref_t *update = &updates.items[i];
+        const char *name = update->name + (update->name[0] == '+');  // '+' forces
+        const char *error = apply_ref_update(name, &old_hashes[i], &update->hash, name != update->name);
+        uint8_t ok = error == NULL;
+        if (ok) {
+            printf("Updated %s\n", name);
+        } else {
+            fprintf(stderr, "Rejected %s: %s\n", name, error);
+        }
+        if (wire_write(w, &ok, 1) < 0 || send_string(w, ok ? "ok" : error) < 0) {
+            ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&ref_update_lock);
+    if (ret == 0) ret = wire_flush(w);
 
-    int sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
-    if (sock < 0) {
-        perror("Failed to create socket");
-        freeaddrinfo(result);
+out:
+    free(old_hashes);
+    free(updates.items);
+    return ret;
+}
+
+static int serve_ls_refs(wire_t *w) {
+    remote_refs_t refs = {0};
+    int ret = send_ref_advertisement(w, &refs) < 0 || wire_flush(w) < 0 ? -1 : 0;
+    free(refs.items);
+    return ret;
+}
+
+// Partial clones: send the requested blobs, skipping any we don't have.
+// Only blobs are served, as only blobs are ever filtered out of a pack.
+static int serve_fetch_objects(wire_t *w) {
+    hash_t *objects = NULL;
+    size_t count = 0;
+    if (recv_hashes(w, MAX_FETCH_OBJECTS, &objects, &count) < 0) {
+        fprintf(stderr, "Failed to read requested objects\n");
         return -1;
     }
 
-    // Set socket timeout
-    if (set_socket_timeout(sock, SOCKET_TIMEOUT_SEC) < 0) {
-        fprintf(stderr, "Warning: Failed to set socket timeout\n");
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        obj_type type;
+        size_t size;
+        if (object_info(&objects[i], &type, &size) == 0 && type == OBJ_BLOB) {
+            objects[kept++] = objects[i];
+        }
     }
+    printf("Sending %zu of %zu requested objects\n", kept, count);
 
-    if (connect(sock, result->ai_addr, result->ai_addrlen) < 0) {
-        perror("Failed to connect to server");
-        close(sock);
-        freeaddrinfo(result);
-        return -1;
+    pack_stream_t stream = { .w = w, .remote = 1, .percent = -1 };
+    int ret = stream_pack(w, objects, kept, &stream);
+    if (ret < 0) session_error(w, "Failed to send objects");
+    free(objects);
+    return ret;
+}
+
+static int serve_command(wire_t *w, uint8_t cmd, uint8_t version, uint32_t caps) {
+    switch (cmd) {
+    case CMD_SEND_OBJECTS:
+        return serve_receive_pack(w, caps);
+    case CMD_REQUEST_OBJECTS:
+        return serve_upload_pack(w, caps);
+    case CMD_FETCH:
+        if (version >= 3) return serve_fetch(w, caps);
+        break;
+    case CMD_PUSH:
+        if (version >= 3) return serve_push(w);
+        break;
+    case CMD_LS_REFS:
+        if (version >= 3) return serve_ls_refs(w);
+        break;
+    case CMD_FETCH_OBJECTS:
+        if (version >= 3 && (caps & CAP_FILTER)) return serve_fetch_objects(w);
+        break;
     }
+    session_error(w, "Unknown command %d for protocol v%d", cmd, version);
+    return -1;
+}
 
-    freeaddrinfo(result);
+// Negotiate and set up the session's transport, leaving the first command
+// in cmd if the client sent it with the header
+static int session_start(session_t *session, uint8_t *cmd) {
+    int client_fd = session->fd;
+    // Set timeout on client socket
+    if (set_socket_timeout(client_fd, SOCKET_TIMEOUT_SEC) < 0) {
+        fprintf(stderr, "Warning: Failed to set socket timeout\n");
+    }
 
-    printf("Connected to %s:%d\n", host, port);
+    tune_socket(client_fd, 1);
 
-    // Try protocol negotiation (version 2+), fall back to legacy
-    uint8_t negotiated_version = PROTOCOL_VERSION;
+    char host[INET6_ADDRSTRLEN];
+    if (IN6_IS_ADDR_V4MAPPED(&session->addr)) {
+        inet_ntop(AF_INET, &session->addr.s6_addr[12], host, sizeof(host));
+    } else {
+        inet_ntop(AF_INET6, &session->addr, host, sizeof(host));
+    }
+    printf("Client connected from %s\n", host);
+
+    uint8_t header[2];
+    if (read_all(client_fd, header, sizeof(header)) < 0) {
+        fprintf(stderr, "Failed to read protocol header\n");
+        return -1;
+    }
+    uint8_t version = header[0];
+    *cmd = header[1];
+
+    uint8_t negotiated_version = version;
     uint32_t negotiated_caps = 0;
 
-    if (client_negotiate_protocol(sock, &negotiated_version, &negotiated_caps) == 0) {
-        // Negotiation succeeded, send command
-        uint8_t cmd = CMD_SEND_OBJECTS;
-        if (write_all(sock, &cmd, 1) != 1) {
-            perror("Failed to send command");
-            close(sock);
+    // Handle protocol negotiation for version 2+
+    if (*cmd == CMD_NEGOTIATE) {
+        if (negotiate_protocol(client_fd, &negotiated_version, &negotiated_caps) < 0) {
+            fprintf(stderr, "Protocol negotiation failed\n");
             return -1;
         }
+
     } else {
-        // Negotiation failed, fall back to legacy protocol
-        printf("Falling back to legacy protocol v1\n");
-        uint8_t version = PROTOCOL_VERSION;
-        uint8_t cmd = CMD_SEND_OBJECTS;
-        if (write_all(sock, &version, 1) != 1 || write_all(sock, &cmd, 1) != 1) {
-            perror("Failed to send protocol header");
-            close(sock);
+        // Legacy protocol (version 1), no negotiation
+        if (version != PROTOCOL_VERSION) {
+            fprintf(stderr, "Protocol version mismatch: got %d, expected %d\n", version, PROTOCOL_VERSION);
             return -1;
         }
     }
 
-    char pack_file[256];
-    snprintf(pack_file, sizeof(pack_file), "/tmp/fit_send_%d.pack", getpid());
+    session->wire = session_wire(client_fd, negotiated_version, negotiated_caps);
+    if (!session->wire) {
+        fprintf(stderr, "Failed to set up session\n");
+        return -1;
+    }
+    session->version = negotiated_version;
+    session->caps = negotiated_caps;
+    return 0;
+}
 
-    if (pack_objects(hashes, count, pack_file) < 0) {
-        fprintf(stderr, "Failed to create pack file\n");
-        close(sock);
+// Serve a session's commands on a worker (called from thread). With sideband
+// the client may run several commands before hanging up; once it has none
+// queued the session goes back to the event loop to wait for the next, so an
+// idle session does not hold a worker. Returns 1 if it stays open.
+static int handle_client(session_t *session) {
+    uint8_t cmd = 0;
+    int first = !session->wire;
+    if (first && session_start(session, &cmd) < 0) {
+        close(session->fd);
+        return 0;
+    }
+    wire_t *w = session->wire;
+    int multi = wire_has_sideband(w);
+
+    for (;;) {
+        // Read actual command after negotiation
+        if (cmd == CMD_NEGOTIATE || !first) {
+            if (wire_read_full(w, &cmd, 1) < 0) {
+                if (first) fprintf(stderr, "Failed to read command after negotiation\n");
+                break;
+            }
+        }
+        if (serve_command(w, cmd, session->version, session->caps) < 0 || !multi) break;
+        if (wire_push(w) < 0) break;
+        if (!wire_pending(w)) return 1;
+        first = 0;
+    }
+
+    wire_close(w);
+    session->wire = NULL;
+    return 0;
+}
+
+// Worker: run session commands (negotiation, pack generation, indexing)
+static void *session_worker(void *arg) {
+    work_queue_t *q = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        while (q->count == 0 && !q->stopping) {
+            pthread_cond_wait(&q->not_empty, &q->lock);
+        }
+        if (q->count == 0) {
+            pthread_mutex_unlock(&q->lock);
+            return NULL;
+        }
+        session_t *session = q->jobs[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_mutex_unlock(&q->lock);
+
+        session->open = handle_client(session);
+
+        // Hand the session back to the event loop
+        pthread_mutex_lock(&q->lock);
+        session->next = q->done;
+        q->done = session;
+        pthread_mutex_unlock(&q->lock);
+
+        uint64_t one = 1;
+        ssize_t n = write(daemon_wake_fd, &one, sizeof(one));
+        (void)n;
+    }
+}
+
+static client_slot_t *client_slot_get(client_slot_t *slots, int *count, const struct in6_addr *addr) {
+    for (int i = 0; i < *count; i++) {
+        if (IN6_ARE_ADDR_EQUAL(&slots[i].addr, addr)) return &slots[i];
+    }
+    client_slot_t *slot = &slots[(*count)++];
+    memset(slot, 0, sizeof(*slot));
+    slot->addr = *addr;
+    return slot;
+}
+
+// One key per client whichever socket family it arrived on
+static void client_address(const struct sockaddr_storage *ss, struct in6_addr *addr) {
+    if (ss->ss_family == AF_INET6) {
+        *addr = ((const struct sockaddr_in6 *)ss)->sin6_addr;
+        return;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->s6_addr[10] = addr->s6_addr[11] = 0xff;
+    memcpy(&addr->s6_addr[12], &((const struct sockaddr_in *)ss)->sin_addr, 4);
+}
+
+// Listen on IPv6 and IPv4 with one socket where the host supports IPv6
+static int daemon_listen_socket(int port) {
+    int family = AF_INET6;
+    int server_fd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (server_fd < 0 && errno == EAFNOSUPPORT) {
+        family = AF_INET;
+        server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    }
+    if (server_fd < 0) {
+        perror("Failed to create socket");
         return -1;
     }
 
-    FILE *f = fopen(pack_file, "rb");
-    if (!f) {
-        perror("Failed to open pack file");
-        close(sock);
-        unlink(pack_file);
+    int opt = 1, off = 0;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (family == AF_INET6) {
+        setsockopt(server_fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    }
+    tune_socket(server_fd, 0);  // Accepted sockets inherit the buffer sizes
+
+    struct sockaddr_in6 addr6 = {0};
+    struct sockaddr_in addr4 = {0};
+    int ret;
+    if (family == AF_INET6) {
+        addr6.sin6_family = AF_INET6;
+        addr6.sin6_addr = in6addr_any;
+        addr6.sin6_port = htons(port);
+        ret = bind(server_fd, (struct sockaddr *)&addr6, sizeof(addr6));
+    } else {
+        addr4.sin_family = AF_INET;
+        addr4.sin_addr.s_addr = INADDR_ANY;
+        addr4.sin_port = htons(port);
+        ret = bind(server_fd, (struct sockaddr *)&addr4, sizeof(addr4));
+    }
+    if (ret < 0) {
+        perror("Failed to bind to port");
+        close(server_fd);
         return -1;
     }
+    return server_fd;
+}
 
-    char buf[8192];
-    size_t n, total = 0;
-    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
-        if (write_all(sock, buf, n) != (ssize_t)n) {
-            perror("Failed to send data");
-            fclose(f);
-            close(sock);
-            unlink(pack_file);
-            return -1;
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// State owned by the event loop thread
+typedef struct {
+    int epoll_fd;
+    client_slot_t *slots;
+    int slot_count;
+    int sessions;               // Accepted and not yet closed
+    session_t *watching;        // Waiting for the client to send something
+} event_loop_t;
+
+// Wait for the client's bytes before tying up a worker. A client that stays
+// silent past the deadline loses the session, so silent connects cannot hold
+// every slot.
+static int session_watch(event_loop_t *loop, session_t *session, int timeout_sec) {
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = session;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, session->fd, &ev) < 0) return -1;
+
+    session->deadline = now_ms() + timeout_sec * 1000LL;
+    session->watch_prev = NULL;
+    session->watch_next = loop->watching;
+    if (loop->watching) loop->watching->watch_prev = session;
+    loop->watching = session;
+    return 0;
+}
+
+static void session_unwatch(event_loop_t *loop, session_t *session) {
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, session->fd, NULL);
+    if (session->watch_prev) session->watch_prev->watch_next = session->watch_next;
+    else loop->watching = session->watch_next;
+    if (session->watch_next) session->watch_next->watch_prev = session->watch_prev;
+    session->watch_prev = session->watch_next = NULL;
+}
+
+// Close from the event loop: an idle session has nothing left to flush, and
+// the loop must not block draining it
+static void session_drop(session_t *session) {
+    wire_free(session->wire);
+    close(session->fd);
+    free(session);
+}
+
+// Give back the slot of a closed session and admit whoever is queued behind it
+static void session_release(event_loop_t *loop, const struct in6_addr *addr) {
+    client_slot_t *slot = client_slot_get(loop->slots, &loop->slot_count, addr);
+    slot->active--;
+    loop->sessions--;
+
+    while (slot->head) {
+        session_t *waiting = slot->head;
+        slot->head = waiting->next;
+        if (!slot->head) slot->tail = NULL;
+        if (session_watch(loop, waiting, DAEMON_HANDSHAKE_TIMEOUT_SEC) == 0) {
+            slot->active++;
+            break;
+        }
+        session_drop(waiting);
+        loop->sessions--;
+    }
+    if (slot->active == 0 && !slot->head) {
+        *slot = loop->slots[--loop->slot_count];
+    }
+}
+
+// Drop the sessions whose deadline has passed; returns how long epoll may
+// wait for the next one (-1: nothing is being watched)
+static int sweep_watched(event_loop_t *loop) {
+    long long now = now_ms();
+    session_t *session = loop->watching;
+    while (session) {
+        session_t *following = session->watch_next;
+        if (session->deadline <= now) {
+            struct in6_addr addr = session->addr;
+            session_unwatch(loop, session);
+            session_drop(session);
+            session_release(loop, &addr);  // May watch a queued session at the head
+        }
+        session = following;
+    }
+
+    long long next = -1;
+    for (session = loop->watching; session; session = session->watch_next) {
+        if (next < 0 || session->deadline < next) next = session->deadline;
+    }
+    return next < 0 ? -1 : (int)(next > now ? next - now : 0);
+}
+
+// Sessions block on their socket while a pack goes out or comes in, so a
+// slow client holds a worker while the CPU idles: run several per CPU
+static int daemon_worker_count(void) {
+    long workers = daemon_workers;
+    if (workers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = (cpus > 0 ? cpus : 1) * DAEMON_WORKERS_PER_CPU;
+        if (workers < DAEMON_MIN_WORKERS) workers = DAEMON_MIN_WORKERS;
+    }
+    if (workers > DAEMON_MAX_WORKERS) workers = DAEMON_MAX_WORKERS;
+    return (int)workers;
+}
+
+int net_daemon_start(int port) {
+    int server_fd = daemon_listen_socket(port);
+    if (server_fd < 0) return -1;
+
+    if (listen(server_fd, daemon_backlog) < 0) {
+        perror("Failed to listen");
+        close(server_fd);
+        return -1;
+    }
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+
+    event_loop_t loop = {0};
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    daemon_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd < 0 || daemon_wake_fd < 0) {
+        perror("Failed to set up event loop");
+        if (epoll_fd >= 0) close(epoll_fd);
+        close(server_fd);
+        return -1;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &server_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev);
+    ev.data.ptr = &daemon_wake_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, daemon_wake_fd, &ev);
+
+    // Setup signal handlers for graceful shutdown; no SA_RESTART so that
+    // epoll_wait() returns on a signal
+    struct sigaction sa;
+    sa.sa_handler = handle_shutdown;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+
+    if (sigaction(SIGINT, &sa, NULL) < 0) {
+        perror("Warning: Failed to set SIGINT handler");
+    }
+    if (sigaction(SIGTERM, &sa, NULL) < 0) {
+        perror("Warning: Failed to set SIGTERM handler");
+    }
+
+    // A client hanging up mid-pack must only end its own session
+    signal(SIGPIPE, SIG_IGN);
+
+    work_queue_t q = {0};
+    q.capacity = daemon_max_sessions;
+    q.jobs = calloc(q.capacity, sizeof(session_t *));
+    client_slot_t *slots = calloc(daemon_max_sessions, sizeof(client_slot_t));
+    int worker_count = daemon_worker_count();
+    pthread_t *workers = calloc(worker_count, sizeof(pthread_t));
+    if (!q.jobs || !slots || !workers) {
+        fprintf(stderr, "Failed to allocate daemon state\n");
+        free(q.jobs);
+        free(slots);
+        free(workers);
+        close(epoll_fd);
+        close(daemon_wake_fd);
+        close(server_fd);
+        return -1;
+    }
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.not_empty, NULL);
+    loop.epoll_fd = epoll_fd;
+    loop.slots = slots;
+
+    // Signals are handled by the event loop thread only
+    sigset_t block, old_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old_mask);
+    int started = 0;
+    while (started < worker_count &&
+           pthread_create(&workers[started], NULL, session_worker, &q) == 0) {
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    printf("Fit daemon listening on port %d (%d workers, max %d sessions)\n",
+           port, started, daemon_max_sessions);
+    printf("Press Ctrl+C to stop\n");
+
+    int accepting = 1;
+    struct epoll_event events[DAEMON_MAX_EVENTS];
+
+    while (daemon_running && started > 0) {
+        int timeout = sweep_watched(&loop);
+
+        // Leave further connections in the kernel backlog while we are full
+        int want_accept = loop.sessions < daemon_max_sessions;
+        if (want_accept != accepting) {
+            ev.events = want_accept ? EPOLLIN : 0;
+            ev.data.ptr = &server_fd;
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, server_fd, &ev);
+            accepting = want_accept;
+        }
+
+        int n = epoll_wait(epoll_fd, events, DAEMON_MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
         }
-        total += n;
+
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+
+            if (tag == &daemon_wake_fd) {
+                uint64_t value;
+                ssize_t r = read(daemon_wake_fd, &value, sizeof(value));
+                (void)r;
+
+                pthread_mutex_lock(&q.lock);
+                session_t *done = q.done;
+                q.done = NULL;
+                pthread_mutex_unlock(&q.lock);
+
+                // Wait for the next command of open sessions; release
+                // finished ones and admit anyone queued behind them
+                while (done) {
+                    session_t *next = done->next;
+                    if (!done->open || session_watch(&loop, done, SOCKET_TIMEOUT_SEC) < 0) {
+                        struct in6_addr addr = done->addr;
+                        if (done->open) session_drop(done);
+                        else free(done);
+                        session_release(&loop, &addr);
+                    }
+                    done = next;
+                }
+            } else if (tag == &server_fd) {
+                while (loop.sessions < daemon_max_sessions) {
+                    struct sockaddr_storage client_addr;
+                    socklen_t client_len = sizeof(client_addr);
+                    int client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
+                    if (client_fd < 0) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                            perror("Failed to accept connection");
+                        }
+                        break;
+                    }
+
+                    session_t *session = calloc(1, sizeof(session_t));
+                    if (!session) {
+                        fprintf(stderr, "Failed to allocate memory for client info\n");
+                        close(client_fd);
+                        continue;
+                    }
+                    session->fd = client_fd;
+                    client_address(&client_addr, &session->addr);
+                    loop.sessions++;
+
+                    client_slot_t *slot = client_slot_get(slots, &loop.slot_count, &session->addr);
+                    if (slot->active < daemon_max_per_client) {
+                        if (session_watch(&loop, session, DAEMON_HANDSHAKE_TIMEOUT_SEC) == 0) {
+                            slot->active++;
+                        } else {
+                            session_drop(session);
+                            loop.sessions--;
+                            if (slot->active == 0 && !slot->head) *slot = slots[--loop.slot_count];
+                        }
+                    } else {
+                        // Over the per-client limit: park it until a slot frees up
+                        if (slot->tail) slot->tail->next = session;
+                        else slot->head = session;
+                        slot->tail = session;
+                    }
+                }
+            } else {
+                // Client sent its handshake or next command: hand the session to a worker
+                session_t *session = tag;
+                session_unwatch(&loop, session);
+
+                pthread_mutex_lock(&q.lock);
+                q.jobs[(q.head + q.count) % q.capacity] = session;
+                q.count++;
+                pthread_cond_signal(&q.not_empty);
+                pthread_mutex_unlock(&q.lock);
+            }
+        }
+    }
+
+    printf("\nShutting down daemon gracefully...\n");
+    close(server_fd);
+
+    // Let running sessions finish; queued ones are dropped
+    pthread_mutex_lock(&q.lock);
+    while (q.count > 0) {
+        session_drop(q.jobs[q.head]);
+        q.head = (q.head + 1) % q.capacity;
+        q.count--;
+    }
+    q.stopping = 1;
+    pthread_cond_broadcast(&q.not_empty);
+    pthread_mutex_unlock(&q.lock);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
     }
-    fclose(f);
-    unlink(pack_file);
 
-    printf("Sent %zu bytes\n", total);
+    // Workers already closed finished sessions; open ones still hold a socket
+    while (q.done) {
+        session_t *next = q.done->next;
+        if (q.done->open) session_drop(q.done);
+        else free(q.done);
+        q.done = next;
+    }
+    while (loop.watching) {
+        session_t *session = loop.watching;
+        session_unwatch(&loop, session);
+        session_drop(session);
+    }
+    for (int i = 0; i < loop.slot_count; i++) {
+        while (slots[i].head) {
+            session_t *next = slots[i].head->next;
+            session_drop(slots[i].head);
+            slots[i].head = next;
+        }
+    }
 
-    close(sock);
+    pthread_mutex_destroy(&q.lock);
+    pthread_cond_destroy(&q.not_empty);
+    free(q.jobs);
+    free(slots);
+    free(workers);
+    close(epoll_fd);
+    close(daemon_wake_fd);
+    daemon_wake_fd = -1;
+
+    printf("Daemon stopped\n");
     return 0;
 }
 
-int net_recv_objects(const char *host, int port, const char *branch) {
+// Start a non-blocking connect; returns the socket, or -1 with errno set
+static int connect_start(const struct addrinfo *ai) {
+    int sock = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK, ai->ai_protocol);
+    if (sock < 0) return -1;
+    tune_socket(sock, 1);
+    if (connect(sock, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+    return sock;
+}
+
+// Connect to whichever address answers first (RFC 8305 "Happy Eyeballs").
+// Addresses are tried alternating between families, each getting a short
+// head start before the next is raced against it, so a dead IPv4 or IPv6
+// path costs 250 ms rather than a full connect timeout.
+static int connect_any(const struct addrinfo *list) {
+    const struct addrinfo *by_family[2][MAX_CONNECT_ADDRS];
+    size_t family_count[2] = {0, 0};
+    int first_family = list->ai_family;
+    for (const struct addrinfo *ai = list; ai; ai = ai->ai_next) {
+        int f = ai->ai_family != first_family;
+        if (family_count[f] < MAX_CONNECT_ADDRS) by_family[f][family_count[f]++] = ai;
+    }
+    const struct addrinfo *order[2 * MAX_CONNECT_ADDRS];
+    size_t count = 0;
+    for (size_t i = 0; i < MAX_CONNECT_ADDRS; i++) {
+        if (i < family_count[0]) order[count++] = by_family[0][i];
+        if (i < family_count[1]) order[count++] = by_family[1][i];
+    }
+
+    struct pollfd pending[2 * MAX_CONNECT_ADDRS];
+    size_t pending_count = 0, next = 0;
+    int sock = -1, err = ECONNREFUSED;
+    long long deadline = now_ms() + SOCKET_TIMEOUT_SEC * 1000LL;
+    long long next_start = 0;
+
+    while (sock < 0 && (next < count || pending_count > 0)) {
+        long long now = now_ms();
+        if (now >= deadline) {
+            err = ETIMEDOUT;
+            break;
+        }
+        if (next < count && now >= next_start) {
+            int s = connect_start(order[next++]);
+            if (s < 0) {
+                err = errno;
+                continue;   // Failed at once: go straight to the next address
+            }
+            pending[pending_count].fd = s;
+            pending[pending_count].events = POLLOUT;
+            pending_count++;
+            next_start = now + CONNECT_ATTEMPT_DELAY_MS;
+            continue;
+        }
+
+        long long wake = next < count && next_start < deadline ? next_start : deadline;
+        int ready = poll(pending, pending_count, (int)(wake - now));
+        if (ready < 0 && errno != EINTR) {
+            err = errno;
+            break;
+        }
+        for (size_t i = 0; ready > 0 && i < pending_count && sock < 0;) {
+            if (!pending[i].revents) {
+                i++;
+                continue;
+            }
+            int so_error = 0;
+            socklen_t len = sizeof(so_error);
+            if (getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &so_error, &len) < 0) so_error = errno;
+            if (so_error == 0) {
+                sock = pending[i].fd;
+            } else {
+                err = so_error;
+                close(pending[i].fd);
+                next_start = 0;  // Don't wait out the head start of a failed attempt
+            }
+            pending[i] = pending[--pending_count];
+        }
+    }
+
+    for (size_t i = 0; i < pending_count; i++) close(pending[i].fd);
+    if (sock < 0) {
+        errno = err;
+        return -1;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+    return sock;
+}
+
+// Connect and negotiate; returns the session or NULL. The command byte is
+// sent separately with send_command() once the caller knows the version.
+static wire_t *client_open(const char *host, int port, uint8_t *version_out, uint32_t *caps_out) {
     struct addrinfo hints = {0}, *result;
-    hints.ai_family = AF_INET;
+    hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
 
     char port_str[16];
     snprintf(port_str, sizeof(port_str), "%d", port);
 
     if (getaddrinfo(host, port_str, &hints, &result) != 0) {
         fprintf(stderr, "Failed to resolve host '%s'\n", host);
-        return -1;
+        return NULL;
     }
 
-    int sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    int sock = connect_any(result);
+    freeaddrinfo(result);
     if (sock < 0) {
-        perror("Failed to create socket");
-        freeaddrinfo(result);
-        return -1;
+        perror("Failed to connect to server");
+        return NULL;
     }
 
     // Set socket timeout
@@ -612,85 +1770,718 @@ int net_recv_objects(const char *host, int port, const char *branch) {
         fprintf(stderr, "Warning: Failed to set socket timeout\n");
     }
 
-    if (connect(sock, result->ai_addr, result->ai_addrlen) < 0) {
-        perror("Failed to connect to server");
+    client_note("Connected to %s:%d\n", host, port);
+
+    // Try protocol negotiation (version 2+), fall back to legacy
+    uint8_t negotiated_version = PROTOCOL_VERSION;
+    uint32_t negotiated_caps = 0;
+
+    if (client_negotiate_protocol(sock, &negotiated_version, &negotiated_caps) < 0) {
+        client_note("Falling back to legacy protocol v1\n");
+        negotiated_version = PROTOCOL_VERSION;
+        negotiated_caps = 0;
+    }
+
+    wire_t *w = session_wire(sock, negotiated_version, negotiated_caps);
+    if (!w) {
         close(sock);
-        freeaddrinfo(result);
+        return NULL;
+    }
+
+    *version_out = negotiated_version;
+    *caps_out = negotiated_caps;
+    return w;
+}
+
+static int send_command(wire_t *w, uint8_t version, uint8_t cmd) {
+    // Legacy v1 has no negotiation step, so the header carries the version
+    if (version == PROTOCOL_VERSION && wire_write(w, &version, 1) < 0) {
+        perror("Failed to send protocol header");
         return -1;
     }
+    if (wire_write(w, &cmd, 1) < 0 || wire_flush(w) < 0) {
+        perror("Failed to send command");
+        return -1;
+    }
+    return 0;
+}
 
-    freeaddrinfo(result);
+// v1/v2 push of a single branch
+static int push_branch_legacy(wire_t *w, uint32_t caps, const char *branch, const hash_t *tip) {
+    // Learn the remote tip; anything reachable from it need not be sent
+    hash_t remote_tip = {0};
+    if (caps & CAP_HAVES) {
+        if (send_string(w, branch) < 0 || wire_flush(w) < 0 ||
+            wire_read_full(w, remote_tip.hash, HASH_SIZE) < 0 ||
+            wire_write(w, tip->hash, HASH_SIZE) < 0) {
+            fprintf(stderr, "Failed to negotiate push\n");
+            return -1;
+        }
+    }
 
-    printf("Connected to %s:%d\n", host, port);
+    int have_count = hash_is_null(&remote_tip) ? 0 : 1;
+    if (send_pack(w, tip, 1, &remote_tip, have_count, 0, NULL) < 0) {
+        fprintf(stderr, "Failed to send objects\n");
+        return -1;
+    }
+    return 0;
+}
 
-    // Try protocol negotiation (version 2+), fall back to legacy
-    uint8_t negotiated_version = PROTOCOL_VERSION;
-    uint32_t negotiated_caps = 0;
+// v3 push: one update per branch, a single pack, and a status per ref
+static int push_branches(wire_t *w, char **branches, const hash_t *tips, int count) {
+    remote_refs_t advertised = {0};
+    if (recv_ref_advertisement(w, &advertised) < 0) {
+        fprintf(stderr, "Failed to read ref advertisement\n");
+        free(advertised.items);
+        return -1;
+    }
 
-    if (client_negotiate_protocol(sock, &negotiated_version, &negotiated_caps) == 0) {
-        // Negotiation succeeded, send command
-        uint8_t cmd = CMD_REQUEST_OBJECTS;
-        if (write_all(sock, &cmd, 1) != 1) {
-            perror("Failed to send command");
-            close(sock);
-            return -1;
+    // Everything the server advertises that we also have is a have
+    hash_t *haves = malloc((advertised.count ? advertised.count : 1) * sizeof(hash_t));
+    remote_refs_t updates = {0};
+    hash_t *old_hashes = malloc(count * sizeof(hash_t));
+    int ret = -1;
+    size_t have_count = 0;
+    if (!haves || !old_hashes) goto out;
+
+    for (size_t i = 0; i < advertised.count; i++) {
+        commit_t commit;
+        if (commit_read(&advertised.items[i].hash, &commit) == 0) {
+            commit_free(&commit);
+            haves[have_count++] = advertised.items[i].hash;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        char name[256];
+        snprintf(name, sizeof(name), "heads/%s", branches[i]);
+        const remote_ref_t *remote = remote_refs_find(&advertised, name);
+        hash_t old_hash = {0};
+        if (remote) old_hash = remote->hash;
+
+        if (hash_equal(&old_hash, &tips[i])) {
+            printf("  %s: up to date\n", branches[i]);
+            continue;
+        }
+        old_hashes[updates.count] = old_hash;
+        if (remote_refs_add(&updates, name, &tips[i]) < 0) goto out;
+    }
+
+    uint32_t count_network = htonl(updates.count);
+    if (wire_write(w, &count_network, 4) < 0) goto out;
+    for (size_t i = 0; i < updates.count; i++) {
+        char name[260];
+        snprintf(name, sizeof(name), "%s%s", push_force ? "+" : "", updates.items[i].name);
+        if (wire_write(w, old_hashes[i].hash, HASH_SIZE) < 0 ||
+            wire_write(w, updates.items[i].hash.hash, HASH_SIZE) < 0 ||
+            send_string(w, name) < 0) {
+            goto out;
+        }
+    }
+
+    hash_t *wants = malloc((updates.count ? updates.count : 1) * sizeof(hash_t));
+    if (!wants) goto out;
+    for (size_t i = 0; i < updates.count; i++) wants[i] = updates.items[i].hash;
+    int sent = send_pack(w, wants, updates.count, haves, have_count, 0, NULL);
+    free(wants);
+    if (sent < 0) {
+        fprintf(stderr, "Failed to send objects\n");
+        goto out;
+    }
+
+    uint32_t status_count;
+    if (wire_read_full(w, &status_count, 4) < 0 || ntohl(status_count) != updates.count) {
+        fprintf(stderr, "Failed to read push status\n");
+        goto out;
+    }
+
+    ret = 0;
+    for (size_t i = 0; i < updates.count; i++) {
+        uint8_t ok;
+        char message[256];
+        if (wire_read_full(w, &ok, 1) < 0 || recv_string(w, message, sizeof(message)) < 0) {
+            fprintf(stderr, "Failed to read push status\n");
+            ret = -1;
+            break;
+        }
+        if (ok) {
+            printf("  %s: updated\n", updates.items[i].name + 6);
+        } else {
+            fprintf(stderr, "  %s: rejected (%s)\n", updates.items[i].name + 6, message);
+            ret = -1;
+        }
+    }
+
+out:
+    free(haves);
+    free(old_hashes);
+    free(updates.items);
+    free(advertised.items);
+    return ret;
+}
+
+static hash_t *read_branch_tips(char **branches, int count) {
+    hash_t *tips = malloc((count ? count : 1) * sizeof(hash_t));
+    if (!tips) return NULL;
+
+    for (int i = 0; i < count; i++) {
+        char ref_name[512];
+        snprintf(ref_name, sizeof(ref_name), "heads/%s", branches[i]);
+        if (ref_read(ref_name, &tips[i]) < 0) {
+            fprintf(stderr, "Branch %s not found\n", branches[i]);
+            free(tips);
+            return NULL;
+        }
+    }
+    return tips;
+}
+
+int net_push(const char *host, int port, char **branches, int count) {
+    hash_t *tips = read_branch_tips(branches, count);
+    if (!tips) return -1;
+
+    uint8_t version;
+    uint32_t caps;
+    wire_t *w = client_open(host, port, &version, &caps);
+    if (!w) {
+        free(tips);
+        return -1;
+    }
+
+    int ret = 0;
+    if (version >= 3) {
+        if (send_command(w, version, CMD_PUSH) < 0 ||
+            push_branches(w, branches, tips, count) < 0) {
+            ret = -1;
         }
+        wire_close(w);
     } else {
-        // Negotiation failed, fall back to legacy protocol
-        printf("Falling back to legacy protocol v1\n");
-        uint8_t version = PROTOCOL_VERSION;
-        uint8_t cmd = CMD_REQUEST_OBJECTS;
-        if (write_all(sock, &version, 1) != 1 || write_all(sock, &cmd, 1) != 1) {
-            perror("Failed to send protocol header");
-            close(sock);
-            return -1;
+        // Older servers take one branch per connection
+        for (int i = 0; i < count; i++) {
+            if (i > 0 && !(w = client_open(host, port, &version, &caps))) {
+                ret = -1;
+                break;
+            }
+            if (send_command(w, version, CMD_SEND_OBJECTS) < 0 ||
+                push_branch_legacy(w, caps, branches[i], &tips[i]) < 0) {
+                ret = -1;
+            }
+            wire_close(w);
         }
     }
 
+    free(tips);
+    return ret;
+}
+
+static int collect_have(const char *name, const hash_t *hash, void *data) {
+    (void)name;
+    hash_list_t *haves = data;
+    if (haves->count >= MAX_NEGOTIATION_HAVES) return 1;
+    haves->items[haves->count++] = *hash;
+    return 0;
+}
+
+// Send our ref tips so the server can leave out shared history
+static int send_local_haves(wire_t *w, const char *prefix) {
+    hash_list_t haves = { .items = malloc(MAX_NEGOTIATION_HAVES * sizeof(hash_t)) };
+    if (!haves.items) return -1;
+    ref_for_each(prefix, collect_have, &haves);
+    int ret = send_hashes(w, haves.items, haves.count);
+    free(haves.items);
+    return ret;
+}
+
+static int receive_pack(wire_t *w) {
+    pack_index_result_t result;
+    if (pack_receive(read_wire, w, &result) < 0 || wire_expect_flush(w) < 0) {
+        fprintf(stderr, "Failed to receive objects\n");
+        return -1;
+    }
+    client_note("Received %zu bytes, stored %u objects\n", result.bytes, result.num_objects);
+    return 0;
+}
+
+// An interrupted fetch leaves the id of the pack it was receiving in
+// FETCH_PARTIAL_ID_FILE and, for a pack large enough to be indexed rather
+// than unpacked, the stream received so far in FETCH_PARTIAL_FILE. Nothing
+// is spooled while a transfer runs: the indexer's temporary pack becomes the
+// partial file only when the connection drops. A resumed transfer replays
+// the file before reading the socket.
+typedef struct {
+    wire_t *w;
+    FILE *partial;
+    uint64_t replay;            // Bytes of the file still to be replayed
+    int lost;                   // The connection dropped mid-pack
+} resume_reader_t;
+
+static ssize_t read_resume(void *ctx, void *buf, size_t len) {
+    resume_reader_t *r = ctx;
+    if (r->replay > 0) {
+        if (len > r->replay) len = r->replay;
+        size_t n = fread(buf, 1, len, r->partial);
+        if (n == 0) return -1;
+        r->replay -= n;
+        return n;
+    }
+
+    ssize_t n = wire_read(r->w, buf, len);
+    if (n <= 0) r->lost = 1;
+    return n;
+}
+
+static void discard_partial(void) {
+    unlink(FETCH_PARTIAL_ID_FILE);
+    unlink(FETCH_PARTIAL_FILE);
+}
+
+// Receive a pack, continuing a partial one if the server still produces it
+static int receive_pack_resumable(wire_t *w, int *interrupted) {
+    resume_reader_t r = { .w = w };
+    pack_resume_t held = {0}, start;
+
+    FILE *id = fopen(FETCH_PARTIAL_ID_FILE, "rb");
+    r.partial = fopen(FETCH_PARTIAL_FILE, "rb");
+    if (id && r.partial && fread(held.id.hash, 1, HASH_SIZE, id) == HASH_SIZE &&
+        fseek(r.partial, 0, SEEK_END) == 0) {
+        long size = ftell(r.partial);
+        held.offset = size > 0 ? (uint64_t)size : 0;
+        rewind(r.partial);
+    }
+    if (id) fclose(id);
+
+    if (send_resume(w, &held) < 0 || wire_flush(w) < 0 || recv_resume(w, &start) < 0 ||
+        start.offset > held.offset) {
+        fprintf(stderr, "Failed to negotiate resume point\n");
+        if (r.partial) fclose(r.partial);
+        return -1;
+    }
+
+    if (start.offset > 0 && hash_equal(&start.id, &held.id)) {
+        printf("Resuming fetch at byte %llu\n", (unsigned long long)start.offset);
+        r.replay = start.offset;
+    } else {
+        // Starting over: a stale partial file must not pass for this pack's
+        unlink(FETCH_PARTIAL_FILE);
+    }
+
+    pack_index_result_t result;
+    int ok = pack_receive_partial(read_resume, &r, FETCH_PARTIAL_FILE, &result) == 0 &&
+             wire_expect_flush(w) == 0;
+    if (r.partial) fclose(r.partial);
+
+    if (ok || !r.lost) {
+        discard_partial();
+    } else {
+        // Also marks the fetch unfinished when a small pack left no file
+        FILE *f = fopen(FETCH_PARTIAL_ID_FILE, "wb");
+        if (!f || fwrite(start.id.hash, 1, HASH_SIZE, f) != HASH_SIZE) unlink(FETCH_PARTIAL_FILE);
+        if (f && fclose(f) != 0) unlink(FETCH_PARTIAL_FILE);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Failed to receive objects\n");
+        *interrupted = r.lost;
+        return -1;
+    }
+    printf("Received %zu bytes, stored %u objects\n", result.bytes, result.num_objects);
+    return 0;
+}
+
+// v1/v2 fetch of a single branch
+static int fetch_branch_legacy(wire_t *w, uint32_t caps, const char *branch, hash_t *tip_out) {
     size_t branch_len = strlen(branch);
-    if (write_all(sock, &branch_len, sizeof(branch_len)) != sizeof(branch_len) ||
-        write_all(sock, branch, branch_len) != (ssize_t)branch_len) {
+    if (wire_write(w, &branch_len, sizeof(branch_len)) < 0 ||
+        wire_write(w, branch, branch_len) < 0 || wire_flush(w) < 0) {
         perror("Failed to send branch name");
-        close(sock);
         return -1;
     }
 
-    char pack_file[256];
-    snprintf(pack_file, sizeof(pack_file), "/tmp/fit_recv_%d.pack", getpid());
+    hash_t remote_tip = {0};
+    if (caps & CAP_HAVES) {
+        if (send_local_haves(w, "heads") < 0 || wire_flush(w) < 0 ||
+            wire_read_full(w, remote_tip.hash, HASH_SIZE) < 0) {
+            fprintf(stderr, "Failed to negotiate fetch\n");
+            return -1;
+        }
+        if (hash_is_null(&remote_tip)) {
+            fprintf(stderr, "Branch '%s' not found on remote\n", branch);
+            return -1;
+        }
+    }
 
-    FILE *f = fopen(pack_file, "wb");
-    if (!f) {
-        perror("Failed to create pack file");
-        close(sock);
+    pack_index_result_t pack_result;
+    if (pack_receive(read_wire, w, &pack_result) < 0 || wire_expect_flush(w) < 0) {
+        fprintf(stderr, "Failed to receive objects\n");
         return -1;
     }
+    printf("Received %zu bytes, stored %u objects\n", pack_result.bytes, pack_result.num_objects);
 
-    char buf[8192];
-    ssize_t n;
-    size_t total = 0;
-    while ((n = read(sock, buf, sizeof(buf))) > 0) {
-        size_t written = fwrite(buf, 1, n, f);
-        if (written != (size_t)n) {
-            fprintf(stderr, "Failed to write to pack file\n");
-            fclose(f);
-            close(sock);
-            unlink(pack_file);
+    if (!(caps & CAP_HAVES)) {
+        if (!pack_result.has_first_commit) {
+            fprintf(stderr, "Remote did not send a commit\n");
             return -1;
         }
-        total += n;
+        remote_tip = pack_result.first_commit;
     }
-    fclose(f);
-    close(sock);
 
-    printf("Received %zu bytes\n", total);
+    *tip_out = remote_tip;
+    return 0;
+}
 
-    int ret = unpack_objects(pack_file);
-    if (ret < 0) {
-        fprintf(stderr, "Failed to unpack objects\n");
+// v3 fetch: pick the wanted branches out of the advertisement (all of them
+// when count is 0) and fetch every missing tip in one pack
+static int fetch_branches(wire_t *w, uint32_t caps, char **branches, int count,
+                          remote_refs_t *fetched, int *interrupted) {
+    remote_refs_t advertised = {0};
+    hash_set_t seen;
+    hash_t *wants = NULL, *client_shallow = NULL, *new_shallow = NULL;
+    size_t want_count = 0, new_shallow_count = 0;
+    int ret = -1;
+
+    hash_set_init(&seen);
+    if (recv_ref_advertisement(w, &advertised) < 0) {
+        fprintf(stderr, "Failed to read ref advertisement\n");
+        goto out;
+    }
+
+    for (size_t i = 0; i < advertised.count; i++) {
+        const remote_ref_t *ref = &advertised.items[i];
+        if (strncmp(ref->name, "heads/", 6) != 0) continue;
+
+        int selected = count == 0;
+        for (int j = 0; j < count && !selected; j++) {
+            selected = strcmp(ref->name + 6, branches[j]) == 0;
+        }
+        if (selected && remote_refs_add(fetched, ref->name + 6, &ref->hash) < 0) goto out;
+    }
+
+    for (int j = 0; j < count; j++) {
+        char name[256];
+        snprintf(name, sizeof(name), "heads/%s", branches[j]);
+        if (!remote_refs_find(&advertised, name)) {
+            fprintf(stderr, "Branch '%s' not found on remote\n", branches[j]);
+            goto out;
+        }
+    }
+
+    // Tips we already have need not be fetched. After an interrupted fetch
+    // they may exist without their history (small packs are unpacked as they
+    // arrive), so ask for all of them until the partial pack is finished.
+    // Deepening asks for all of them too: their history is what is missing.
+    int pending = access(FETCH_PARTIAL_ID_FILE, F_OK) == 0 || fetch_deepen;
+    wants = malloc((fetched->count ? fetched->count : 1) * sizeof(hash_t));
+    if (!wants) goto out;
+    for (size_t i = 0; i < fetched->count; i++) {
+        if (!pending && object_exists(&fetched->items[i].hash)) continue;
+        if (hash_set_add(&seen, &fetched->items[i].hash) == 1) {
+            wants[want_count++] = fetched->items[i].hash;
+        }
+    }
+
+    if (send_hashes(w, wants, want_count) < 0 || (want_count == 0 && wire_flush(w) < 0)) {
+        fprintf(stderr, "Failed to send wants\n");
+        goto out;
+    }
+
+    if (want_count > 0) {
+        // A partial clone keeps asking for what it was cloned with
+        object_filter_t filter = { FILTER_NONE, 0 };
+        char host[256];
+        if (promisor_read(host, sizeof(host), &filter) && !(caps & CAP_FILTER)) {
+            fprintf(stderr, "Warning: Server does not support filters; fetching all blobs\n");
+        }
+
+        // A shallow repository tells the server where its history ends
+        shallow_spec_t shallow = { .depth = fetch_depth, .deepen = fetch_deepen };
+        if (shallow_read_commits(&client_shallow, &shallow.count) < 0) goto out;
+        shallow.commits = client_shallow;
+        if ((fetch_depth > 0 || fetch_deepen) && !(caps & CAP_SHALLOW)) {
+            fprintf(stderr, "Warning: Server does not support shallow fetches; fetching full history\n");
+        }
+
+        if (send_local_haves(w, "") < 0 || ((caps & CAP_FILTER) && send_filter(w, &filter) < 0) ||
+            ((caps & CAP_SHALLOW) && send_shallow(w, &shallow) < 0) || wire_flush(w) < 0) {
+            fprintf(stderr, "Failed to send haves\n");
+            goto out;
+        }
+        if ((caps & CAP_RESUME) ? receive_pack_resumable(w, interrupted) < 0
+                                : receive_pack(w) < 0) {
+            goto out;
+        }
+
+        if ((caps & CAP_SHALLOW) &&
+            (recv_hashes(w, MAX_SHALLOW_COMMITS, &new_shallow, &new_shallow_count) < 0 ||
+             wire_expect_flush(w) < 0)) {
+            fprintf(stderr, "Failed to read shallow commits\n");
+            goto out;
+        }
+        if (shallow_update(new_shallow, new_shallow_count) < 0) {
+            fprintf(stderr, "Failed to update shallow commits\n");
+            goto out;
+        }
+    }
+    ret = 0;
+
+out:
+    free(wants);
+    free(client_shallow);
+    free(new_shallow);
+    free(advertised.items);
+    hash_set_free(&seen);
+    return ret;
+}
+
+// v3 fetch that reconnects and continues the pack when the connection drops
+// mid-transfer. Consumes w.
+static int fetch_resumable(wire_t *w, const char *host, int port, uint8_t version,
+                           uint32_t caps, char **branches, int count, remote_refs_t *fetched) {
+    for (int attempt = 1;; attempt++) {
+        int interrupted = 0;
+        int ret = send_command(w, version, CMD_FETCH) < 0 ? -1
+            : fetch_branches(w, caps, branches, count, fetched, &interrupted);
+        wire_close(w);
+        if (ret == 0 || !interrupted || attempt == FETCH_RESUME_ATTEMPTS) return ret;
+
+        fprintf(stderr, "Connection lost, retrying (%d/%d)\n", attempt + 1, FETCH_RESUME_ATTEMPTS);
+        sleep(attempt);
+        fetched->count = 0;
+        if (!(w = client_open(host, port, &version, &caps))) return -1;
+        if (version < 3) {
+            wire_close(w);
+            return -1;
+        }
+    }
+}
+
+// Record fetched branches under refs/remotes/<host>/, all in one transaction
+static int update_remote_refs(const char *host, const remote_refs_t *fetched) {
+    ref_transaction_t *tx = ref_transaction_begin();
+    unsigned char *changed = calloc(fetched->count ? fetched->count : 1, 1);
+    int ret = tx && changed ? 0 : -1, updates = 0;
+
+    for (size_t i = 0; ret == 0 && i < fetched->count; i++) {
+        char ref_name[512];
+        snprintf(ref_name, sizeof(ref_name), "remotes/%s/%s", host, fetched->items[i].name);
+
+        hash_t old_hash = {0};
+        ref_read(ref_name, &old_hash);
+        if (hash_equal(&old_hash, &fetched->items[i].hash)) continue;
+
+        ret = ref_transaction_update(tx, ref_name, &old_hash, &fetched->items[i].hash);
+        changed[i] = 1;
+        updates++;
+    }
+    if (ret == 0 && updates > 0) ret = ref_transaction_commit(tx);
+    ref_transaction_free(tx);
+
+    for (size_t i = 0; ret == 0 && i < fetched->count; i++) {
+        if (!changed[i]) continue;
+        char hex[HASH_HEX_SIZE + 1];
+        hash_to_hex(&fetched->items[i].hash, hex);
+        printf("  %.8s  %s -> %s/%s\n", hex, fetched->items[i].name, host, fetched->items[i].name);
+    }
+    free(changed);
+    if (ret < 0) fprintf(stderr, "Failed to update refs/remotes/%s/\n", host);
+    return ret;
+}
+
+int net_fetch(const char *host, int port, char **branches, int count) {
+    uint8_t version;
+    uint32_t caps;
+    wire_t *w = client_open(host, port, &version, &caps);
+    if (!w) return -1;
+
+    remote_refs_t fetched = {0};
+    int ret = 0;
+
+    if (version >= 3) {
+        ret = fetch_resumable(w, host, port, version, caps, branches, count, &fetched);
+    } else if (count == 0) {
+        fprintf(stderr, "Server does not advertise refs; name the branches to fetch\n");
+        wire_close(w);
+        return -1;
     } else {
-        printf("Successfully unpacked objects\n");
+        // Older servers take one branch per connection
+        for (int i = 0; i < count && ret == 0; i++) {
+            hash_t tip;
+            if (i > 0 && !(w = client_open(host, port, &version, &caps))) {
+                ret = -1;
+                break;
+            }
+            if (send_command(w, version, CMD_REQUEST_OBJECTS) < 0 ||
+                fetch_branch_legacy(w, caps, branches[i], &tip) < 0 ||
+                remote_refs_add(&fetched, branches[i], &tip) < 0) {
+                ret = -1;
+            }
+            wire_close(w);
+        }
+    }
+
+    if (ret == 0) ret = update_remote_refs(host, &fetched);
+    free(fetched.items);
+    return ret;
+}
+
+int net_recv_objects(const char *host, int port, const char *branch, hash_t *tip_out) {
+    uint8_t version;
+    uint32_t caps;
+    wire_t *w = client_open(host, port, &version, &caps);
+    if (!w) return -1;
+
+    if (version >= 3) {
+        remote_refs_t fetched = {0};
+        char *names[] = { (char *)branch };
+        int ret = fetch_resumable(w, host, port, version, caps, names, 1, &fetched);
+        if (ret == 0) *tip_out = fetched.items[0].hash;
+        free(fetched.items);
+        return ret;
+    }
+
+    int ret = send_command(w, version, CMD_REQUEST_OBJECTS) < 0 ? -1
+        : fetch_branch_legacy(w, caps, branch, tip_out);
+    wire_close(w);
+    return ret;
+}
+
+// Fetch objects by hash for a partial clone, quietly: this runs whenever a
+// read misses, in the middle of some other command
+int net_fetch_objects(const char *host, int port, const hash_t *hashes, size_t count) {
+    client_quiet = 1;
+    uint8_t version;
+    uint32_t caps;
+    wire_t *w = client_open(host, port, &version, &caps);
+    int ret = -1;
+
+    if (w && (version < 3 || !(caps & CAP_FILTER))) {
+        fprintf(stderr, "Server %s cannot supply missing objects\n", host);
+    } else if (w && send_command(w, version, CMD_FETCH_OBJECTS) == 0) {
+        if (send_hashes(w, hashes, count) < 0 || wire_flush(w) < 0) {
+            fprintf(stderr, "Failed to request objects\n");
+        } else {
+            ret = receive_pack(w);
+        }
     }
 
-    unlink(pack_file);
+    if (w) wire_close(w);
+    client_quiet = 0;
     return ret;
 }
+
+#define SESSION_MAX_ARGS 64
+
+static int session_ls_refs(wire_t *w, uint8_t version) {
+    remote_refs_t refs = {0};
+    if (send_command(w, version, CMD_LS_REFS) < 0 || recv_ref_advertisement(w, &refs) < 0) {
+        fprintf(stderr, "Failed to read ref advertisement\n");
+        free(refs.items);
+        return -1;
+    }
+    for (size_t i = 0; i < refs.count; i++) {
+        char hex[HASH_HEX_SIZE + 1];
+        hash_to_hex(&refs.items[i].hash, hex);
+        printf("%s\t%s\n", hex, refs.items[i].name);
+    }
+    free(refs.items);
+    return 0;
+}
+
+// Fetch over the open session; an interrupted pack is resumed on a new
+// connection, which then replaces *w
+static int session_fetch(wire_t **w, const char *host, int port, uint8_t version, uint32_t caps,
+                         char **branches, int count) {
+    remote_refs_t fetched = {0};
+    int interrupted = 0;
+    int ret = send_command(*w, version, CMD_FETCH) < 0 ? -1
+        : fetch_branches(*w, caps, branches, count, &fetched, &interrupted);
+    if (ret < 0 && interrupted) {
+        wire_close(*w);
+        *w = NULL;
+        wire_t *retry = client_open(host, port, &version, &caps);
+        fetched.count = 0;
+        if (retry) {
+            fprintf(stderr, "Connection lost, retrying\n");
+            ret = fetch_resumable(retry, host, port, version, caps, branches, count, &fetched);
+        }
+    }
+    if (ret == 0) ret = update_remote_refs(host, &fetched);
+    free(fetched.items);
+    return ret;
+}
+
+// Returns 0 on success, -1 if the command failed on the connection, 1 if
+// it was refused before anything was sent
+static int session_run(wire_t **w, const char *host, int port, uint8_t version, uint32_t caps,
+                       char **argv, int argc) {
+    for (int i = 1; i < argc; i++) {
+        if (!is_valid_ref_name(argv[i])) {
+            fprintf(stderr, "Invalid branch name '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (strcmp(argv[0], "ls-refs") == 0 && argc == 1) {
+        return session_ls_refs(*w, version);
+    }
+    if (strcmp(argv[0], "fetch") == 0) {
+        return session_fetch(w, host, port, version, caps, argv + 1, argc - 1);
+    }
+    if (strcmp(argv[0], "push") == 0 && argc > 1) {
+        hash_t *tips = read_branch_tips(argv + 1, argc - 1);
+        if (!tips) return 1;
+        int ret = send_command(*w, version, CMD_PUSH) < 0 ? -1
+            : push_branches(*w, argv + 1, tips, argc - 1);
+        free(tips);
+        return ret;
+    }
+    fprintf(stderr, "Unknown session command '%s' (ls-refs, fetch [branch...], push <branch...>, quit)\n",
+            argv[0]);
+    return 1;
+}
+
+// Run commands from stdin, one per line, over one negotiated connection, so
+// scripts issuing many small operations pay for connection setup once. The
+// output of every command ends with a line "ok" or "error". A connection the
+// server has dropped (idle timeout, failed command) is reopened on demand.
+int net_remote_session(const char *host, int port) {
+    wire_t *w = NULL;
+    uint8_t version = 0;
+    uint32_t caps = 0;
+    int failures = 0;
+    char line[4096];
+
+    while (fgets(line, sizeof(line), stdin)) {
+        char *argv[SESSION_MAX_ARGS];
+        int argc = 0;
+        for (char *tok = strtok(line, " \t\r\n"); tok && argc < SESSION_MAX_ARGS;
+             tok = strtok(NULL, " \t\r\n")) {
+            argv[argc++] = tok;
+        }
+        if (argc == 0 || argv[0][0] == '#') continue;
+        if (strcmp(argv[0], "quit") == 0) break;
+
+        if (w && wire_peer_closed(w)) {
+            wire_close(w);
+            w = NULL;
+        }
+        if (!w && (w = client_open(host, port, &version, &caps)) && version < 3) {
+            fprintf(stderr, "Server speaks protocol v%d; sessions need v3\n", version);
+            wire_close(w);
+            return -1;
+        }
+
+        int ret = w ? session_run(&w, host, port, version, caps, argv, argc) : -1;
+        // Without sideband the server serves one command per connection; a
+        // failed command may have left the stream anywhere
+        if (w && (ret < 0 || !(caps & CAP_SIDEBAND))) {
+            wire_close(w);
+            w = NULL;
+        }
+        if (ret != 0) failures++;
+        printf(ret == 0 ? "ok\n" : "error\n");
+        fflush(stdout);
+    }
+
+    if (w) wire_close(w);
+    return failures ? -1 : 0;
+}
@@ -1,10 +1,35 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <zlib.h>
 #include "fit.h"
 
+/*
+ * Batched loose object writer. Objects are written to temporary files and
+ * left open; every `limit` objects the whole batch is fsynced, renamed into
+ * place and the touched fan-out directories are fsynced once each. A crash
+ * therefore never exposes a partially written object, and a large unpack
+ * pays for one round of syncs per batch instead of one per object.
+ */
+typedef struct {
+    int fd;
+    char tmp_path[272];
+    char path[256];
+} pending_object_t;
+
+struct object_batch {
+    pthread_mutex_t lock;
+    pending_object_t *pending;
+    size_t count;
+    size_t limit;
+    int failed;
+};
+
 char* object_path(const hash_t *hash) {
     char hex[HASH_HEX_SIZE + 1];
     hash_to_hex(hash, hex);
@@ -18,13 +43,20 @@ char* object_path(const hash_t *hash) {
     return path;
 }
 
+/* Build the "<type> <size>\0" prefix that object hashes are computed over */
+int object_header(obj_type type, size_t size, char *buf, size_t buf_size) {
+    const char *type_str = type == OBJ_BLOB ? "blob" :
+                           type == OBJ_TREE ? "tree" : "commit";
+
+    int header_len = snprintf(buf, buf_size, "%s %zu", type_str, size);
+    if (header_len < 0 || (size_t)header_len >= buf_size) return -1;
+    return header_len + 1;
+}
+
 int object_write(const object_t *obj, hash_t *out) {
     char header[64];
-    const char *type_str = obj->type == OBJ_BLOB ? "blob" :
-                           obj->type == OBJ_TREE ? "tree" : "commit";
-
-    int header_len = snprintf(header, sizeof(header), "%s %zu", type_str, obj->size);
-    header[header_len++] = '\0';
+    int header_len = object_header(obj->type, obj->size, header, sizeof(header));
+    if (header_len < 0) return -1;
 
     size_t total = header_len + obj->size;
     char *full = malloc(total);
@@ -95,13 +127,205 @@ int object_write(const object_t *obj, hash_t *out) {
     return 0;
 }
 
+object_batch_t* object_batch_new(size_t limit) {
+    object_batch_t *batch = calloc(1, sizeof(object_batch_t));
+    if (!batch) return NULL;
+
+    batch->limit = limit ? limit : 1;
+    batch->pending = calloc(batch->limit, sizeof(pending_object_t));
+    if (!batch->pending) {
+        free(batch);
+        return NULL;
+    }
+    pthread_mutex_init(&batch->lock, NULL);
+    return batch;
+}
+
+/* Caller holds batch->lock */
+static int object_batch_sync(object_batch_t *batch) {
+    uint8_t touched[256] = {0};
+
+    for (size_t i = 0; i < batch->count; i++) {
+        pending_object_t *p = &batch->pending[i];
+        if (fsync(p->fd) != 0) batch->failed = 1;
+        close(p->fd);
+        if (!batch->failed && rename(p->tmp_path, p->path) != 0) batch->failed = 1;
+        if (batch->failed) unlink(p->tmp_path);
+
+        /* Fan-out directory is the two hex characters after FIT_OBJECTS_DIR/ */
+        unsigned int dir_byte;
+        if (sscanf(p->path + strlen(FIT_OBJECTS_DIR) + 1, "%2x", &dir_byte) == 1) {
+            touched[dir_byte] = 1;
+        }
+    }
+    batch->count = 0;
+
+    for (int i = 0; i < 256; i++) {
+        if (!touched[i]) continue;
+        char dir[256];
+        snprintf(dir, sizeof(dir), "%s/%02x", FIT_OBJECTS_DIR, i);
+        int dir_fd = open(dir, O_RDONLY);
+        if (dir_fd >= 0) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    }
+
+    return batch->failed ? -1 : 0;
+}
+
+int object_batch_add(object_batch_t *batch, const hash_t *hash, obj_type type,
+                     const void *data, size_t size) {
+    char *path = object_path(hash);
+    if (!path) return -1;
+    if (file_exists(path) || pack_has_object(hash)) {
+        free(path);
+        return 0;
+    }
+
+    char header[64];
+    int header_len = object_header(type, size, header, sizeof(header));
+    if (header_len < 0) {
+        free(path);
+        return -1;
+    }
+
+    size_t total = header_len + size;
+    unsigned char *full = malloc(total);
+    uLongf compressed_size = compressBound(total);
+    unsigned char *compressed = malloc(compressed_size);
+    if (!full || !compressed) {
+        free(full);
+        free(compressed);
+        free(path);
+        return -1;
+    }
+    memcpy(full, header, header_len);
+    memcpy(full + header_len, data, size);
+
+    int ret = compress(compressed, &compressed_size, full, total);
+    free(full);
+    if (ret != Z_OK) {
+        free(compressed);
+        free(path);
+        return -1;
+    }
+
+    pending_object_t p;
+    snprintf(p.path, sizeof(p.path), "%s", path);
+    free(path);
+
+    char *slash = strrchr(p.path, '/');
+    *slash = '\0';
+    if (mkdirp(p.path) != 0) {
+        free(compressed);
+        return -1;
+    }
+    snprintf(p.tmp_path, sizeof(p.tmp_path), "%s/tmp_obj_XXXXXX", p.path);
+    *slash = '/';
+
+    p.fd = mkstemp(p.tmp_path);
+    if (p.fd < 0) {
+        free(compressed);
+        return -1;
+    }
+    fchmod(p.fd, 0444);
+
+    size_t written = 0;
+    while (written < compressed_size) {
+        ssize_t n = write(p.fd, compressed + written, compressed_size - written);
+        if (n <= 0) break;
+        written += n;
+    }
+    free(compressed);
+
+    if (written != compressed_size) {
+        close(p.fd);
+        unlink(p.tmp_path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    batch->pending[batch->count++] = p;
+    ret = 0;
+    if (batch->count >= batch->limit) {
+        ret = object_batch_sync(batch);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return ret;
+}
+
+int object_batch_flush(object_batch_t *batch) {
+    pthread_mutex_lock(&batch->lock);
+    int ret = object_batch_sync(batch);
+    pthread_mutex_unlock(&batch->lock);
+    return ret;
+}
+
+void object_batch_free(object_batch_t *batch) {
+    if (!batch) return;
+    object_batch_flush(batch);
+    pthread_mutex_destroy(&batch->lock);
+    free(batch->pending);
+    free(batch);
+}
+
+int object_exists(const hash_t *hash) {
+    char *path = object_path(hash);
+    if (!path) return 0;
+    int exists = file_exists(path) || pack_has_object(hash);
+    free(path);
+    return exists;
+}
+
+/* Type and size of an object, inflating no more than its header */
+int object_info(const hash_t *hash, obj_type *type, size_t *size) {
+    char *path = object_path(hash);
+    if (!path) return -1;
+    FILE *f = fopen(path, "rb");
+    free(path);
+    if (!f) return pack_object_info(hash, type, size);
+
+    unsigned char in[64];
+    char header[64];
+    size_t in_len = fread(in, 1, sizeof(in), f);
+    fclose(f);
+
+    z_stream zs = {0};
+    if (inflateInit(&zs) != Z_OK) return -1;
+    zs.next_in = in;
+    zs.avail_in = in_len;
+    zs.next_out = (unsigned char *)header;
+    zs.avail_out = sizeof(header) - 1;
+    int ret = inflate(&zs, Z_SYNC_FLUSH);
+    size_t out_len = sizeof(header) - 1 - zs.avail_out;
+    inflateEnd(&zs);
+    if ((ret != Z_OK && ret != Z_STREAM_END) || !memchr(header, '\0', out_len)) return -1;
+
+    char *space = strchr(header, ' ');
+    if (!space) return -1;
+    *space = '\0';
+    if (strcmp(header, "blob") == 0) *type = OBJ_BLOB;
+    else if (strcmp(header, "tree") == 0) *type = OBJ_TREE;
+    else if (strcmp(header, "commit") == 0) *type = OBJ_COMMIT;
+    else return -1;
+    *size = strtoull(space + 1, NULL, 10);
+    return 0;
+}
+
 int object_read(const hash_t *hash, object_t *obj) {
     char *path = object_path(hash);
     if (!path) return -1;
 
     FILE *f = fopen(path, "rb");
     free(path);
-    if (!f) return -1;
+    if (!f) {
+        /* Not stored loose; look it up in the pack store, and in a partial
+         * clone ask the promisor remote for it */
+        if (pack_read_object(hash, obj) == 0) return 0;
+        if (promisor_fetch(hash, 1) < 0) return -1;
+        return object_read(hash, obj);
+    }
 
     if (fseek(f, 0, SEEK_END) != 0) {
         fclose(f);
@@ -1,177 +1,511 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <zlib.h>
 #include <arpa/inet.h>
 #include "fit.h"
 
-#define PACK_SIGNATURE "PACK"
-#define PACK_VERSION 2
+/*
+ * Objects are read and deflated on a pool of worker threads. Results land in
+ * a bounded reorder window indexed by position, and the calling thread writes
+ * them out strictly in input order, so the pack is byte-for-byte identical
+ * regardless of the thread count.
+ */
+
+#define PACK_WINDOW_PER_THREAD 4
+#define PACK_MAX_THREADS 64
 
 typedef struct {
+    int ready;
+    int status;
     uint32_t type;
     uint32_t size;
-    hash_t hash;
-    void *data;
-} pack_entry_t;
+    unsigned char *data;
+    uLongf comp_size;
+} pack_slot_t;
 
-int pack_objects(const hash_t *hashes, size_t count, const char *pack_file) {
-    FILE *f = fopen(pack_file, "wb");
-    if (!f) return -1;
+typedef struct {
+    const hash_t *hashes;
+    size_t count;
+    size_t next;        /* Next position to be claimed by a worker */
+    size_t written;     /* Next position the writer will emit */
+    size_t window;
+    pack_slot_t *slots;
+    int level;
+    int abort;
+    pthread_mutex_t lock;
+    pthread_cond_t slot_ready;
+    pthread_cond_t slot_free;
+} pack_job_t;
+
+static int pack_threads = 0;  /* 0 = one per online CPU */
+static int pack_level = Z_DEFAULT_COMPRESSION;
 
-    if (fwrite(PACK_SIGNATURE, 1, 4, f) != 4) {
-        fclose(f);
+void pack_set_threads(int threads) {
+    pack_threads = threads < 0 ? 0 : threads;
+}
+
+void pack_set_compression(int level) {
+    pack_level = (level < 0 || level > 9) ? Z_DEFAULT_COMPRESSION : level;
+}
+
+static int pack_thread_count(size_t count) {
+    long threads = pack_threads;
+    if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+    if (threads > PACK_MAX_THREADS) threads = PACK_MAX_THREADS;
+    if ((size_t)threads > count) threads = count ? (long)count : 1;
+    return (int)threads;
+}
+
+static int deflate_object(const hash_t *hash, int level, pack_slot_t *slot) {
+    object_t obj;
+    if (object_read(hash, &obj) < 0) {
+        char hex[HASH_HEX_SIZE + 1];
+        hash_to_hex(hash, hex);
+        fprintf(stderr, "Error: Object %s is missing, cannot pack it\n", hex);
         return -1;
     }
 
-    uint32_t version = htonl(PACK_VERSION);
-    if (fwrite(&version, 4, 1, f) != 1) {
-        fclose(f);
+    slot->comp_size = compressBound(obj.size);
+    slot->data = malloc(slot->comp_size);
+    if (!slot->data) {
+        object_free(&obj);
         return -1;
     }
 
-    uint32_t num_objects = htonl(count);
-    if (fwrite(&num_objects, 4, 1, f) != 1) {
-        fclose(f);
+    if (compress2(slot->data, &slot->comp_size, (unsigned char*)obj.data, obj.size, level) != Z_OK) {
+        free(slot->data);
+        slot->data = NULL;
+        object_free(&obj);
         return -1;
     }
 
-    for (size_t i = 0; i < count; i++) {
-        object_t obj;
-        if (object_read(&hashes[i], &obj) < 0) continue;
+    slot->type = obj.type;
+    slot->size = obj.size;
+    object_free(&obj);
+    return 0;
+}
 
-        uint32_t type = htonl(obj.type);
-        uint32_t size = htonl(obj.size);
+static void *pack_worker(void *arg) {
+    pack_job_t *job = arg;
 
-        if (fwrite(&type, 4, 1, f) != 1 ||
-            fwrite(&size, 4, 1, f) != 1 ||
-            fwrite(hashes[i].hash, HASH_SIZE, 1, f) != 1) {
-            object_free(&obj);
-            fclose(f);
-            return -1;
+    pthread_mutex_lock(&job->lock);
+    for (;;) {
+        while (!job->abort && job->next < job->count &&
+               job->next >= job->written + job->window) {
+            pthread_cond_wait(&job->slot_free, &job->lock);
         }
+        if (job->abort || job->next >= job->count) break;
+
+        size_t i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        pack_slot_t result = {0};
+        result.status = deflate_object(&job->hashes[i], job->level, &result);
+        result.ready = 1;
+
+        pthread_mutex_lock(&job->lock);
+        job->slots[i % job->window] = result;
+        pthread_cond_broadcast(&job->slot_ready);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+static int pack_write_entry(pack_write_fn write_fn, void *ctx, const hash_t *hash, const pack_slot_t *slot) {
+    unsigned char header[PACK_ENTRY_HEADER_SIZE];
+    uint32_t type = htonl(slot->type);
+    uint32_t size = htonl(slot->size);
+    uint32_t comp_size = htonl(slot->comp_size);
+
+    memcpy(header, &type, 4);
+    memcpy(header + 4, &size, 4);
+    memcpy(header + 8, hash->hash, HASH_SIZE);
+    memcpy(header + 8 + HASH_SIZE, &comp_size, 4);
+
+    if (write_fn(ctx, header, sizeof(header)) < 0) return -1;
+    return write_fn(ctx, slot->data, slot->comp_size);
+}
+
+int pack_write(const hash_t *hashes, size_t count, pack_write_fn write_fn,
+               pack_progress_fn progress_fn, void *ctx) {
+    unsigned char header[PACK_HEADER_SIZE];
+    uint32_t version = htonl(PACK_VERSION);
+    uint32_t num_objects = htonl(count);
+    memcpy(header, PACK_SIGNATURE, 4);
+    memcpy(header + 4, &version, 4);
+    memcpy(header + 8, &num_objects, 4);
+    if (write_fn(ctx, header, sizeof(header)) < 0) return -1;
+    if (count == 0) return 0;
 
-        uLongf compressed_size = compressBound(obj.size);
-        unsigned char *compressed = malloc(compressed_size);
-        if (!compressed) {
-            object_free(&obj);
-            fclose(f);
-            return -1;
+    int threads = pack_thread_count(count);
+
+    pack_job_t job = {0};
+    job.hashes = hashes;
+    job.count = count;
+    job.window = (size_t)threads * PACK_WINDOW_PER_THREAD;
+    job.level = pack_level;
+    job.slots = calloc(job.window, sizeof(pack_slot_t));
+    if (!job.slots) return -1;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.slot_ready, NULL);
+    pthread_cond_init(&job.slot_free, NULL);
+
+    pthread_t *workers = calloc(threads, sizeof(pthread_t));
+    int started = 0;
+    if (workers) {
+        for (; started < threads; started++) {
+            if (pthread_create(&workers[started], NULL, pack_worker, &job) != 0) break;
         }
+    }
 
-        int compress_result = compress(compressed, &compressed_size, (unsigned char*)obj.data, obj.size);
-        if (compress_result != Z_OK) {
-            free(compressed);
-            object_free(&obj);
-            fclose(f);
-            return -1;
+    int ret = started > 0 ? 0 : -1;
+    for (size_t i = 0; ret == 0 && i < count; i++) {
+        pack_slot_t *slot = &job.slots[i % job.window];
+
+        pthread_mutex_lock(&job.lock);
+        while (!slot->ready) {
+            pthread_cond_wait(&job.slot_ready, &job.lock);
         }
+        pack_slot_t result = *slot;
+        memset(slot, 0, sizeof(*slot));
+        job.written = i + 1;
+        pthread_cond_broadcast(&job.slot_free);
+        pthread_mutex_unlock(&job.lock);
 
-        uint32_t comp_size = htonl(compressed_size);
-        if (fwrite(&comp_size, 4, 1, f) != 1 ||
-            fwrite(compressed, compressed_size, 1, f) != 1) {
-            free(compressed);
-            object_free(&obj);
-            fclose(f);
-            return -1;
+        if (result.status < 0 || pack_write_entry(write_fn, ctx, &hashes[i], &result) < 0) {
+            ret = -1;
+        } else if (progress_fn) {
+            progress_fn(ctx, i + 1, count);
         }
+        free(result.data);
+    }
 
-        free(compressed);
-        object_free(&obj);
+    pthread_mutex_lock(&job.lock);
+    job.abort = 1;
+    pthread_cond_broadcast(&job.slot_free);
+    pthread_mutex_unlock(&job.lock);
+
+    for (int t = 0; t < started; t++) {
+        pthread_join(workers[t], NULL);
     }
 
-    if (fclose(f) != 0) {
-        return -1;
+    /* Drop anything workers finished after an early failure */
+    for (size_t i = 0; i < job.window; i++) {
+        free(job.slots[i].data);
     }
 
+    free(workers);
+    free(job.slots);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.slot_ready);
+    pthread_cond_destroy(&job.slot_free);
+    return ret;
+}
+
+/* Names the exact bytes pack_write() produces for this object list, so a
+ * transfer can be resumed against a pack regenerated later */
+int pack_id(const hash_t *hashes, size_t count, hash_t *out) {
+    unsigned char params[8];
+    uint32_t version = htonl(PACK_VERSION);
+    uint32_t level = htonl((uint32_t)pack_level);
+    memcpy(params, &version, 4);
+    memcpy(params + 4, &level, 4);
+
+    hash_ctx_t ctx;
+    if (hash_init(&ctx) < 0) return -1;
+    hash_update(&ctx, params, sizeof(params));
+    hash_update(&ctx, hashes, count * sizeof(hash_t));
+    hash_final(&ctx, out);
     return 0;
 }
 
-int unpack_objects(const char *pack_file) {
-    FILE *f = fopen(pack_file, "rb");
+static int write_to_file(void *ctx, const void *buf, size_t len) {
+    return fwrite(buf, 1, len, (FILE*)ctx) == len ? 0 : -1;
+}
+
+int pack_objects(const hash_t *hashes, size_t count, const char *pack_file) {
+    FILE *f = fopen(pack_file, "wb");
     if (!f) return -1;
 
-    char sig[4];
-    if (fread(sig, 1, 4, f) != 4) {
-        fclose(f);
+    int ret = pack_write(hashes, count, write_to_file, NULL, f);
+
+    if (fclose(f) != 0) {
+        return -1;
+    }
+
+    return ret;
+}
+
+/*
+ * Unpacking reads entries sequentially on the calling thread and hands them
+ * to a worker pool through a bounded queue. Each worker inflates its object,
+ * recomputes the hash and rejects the pack if it differs from the hash the
+ * entry was advertised under; verified objects go through an object batch
+ * so they are fsynced UNPACK_FSYNC_BATCH at a time.
+ */
+
+#define UNPACK_QUEUE_PER_THREAD 4
+#define UNPACK_FSYNC_BATCH 256
+#define UNPACK_DEFAULT_LIMIT 100
+
+typedef struct unpack_item {
+    uint32_t type;
+    uint32_t size;
+    uint32_t comp_size;
+    hash_t hash;
+    unsigned char *compressed;
+    struct unpack_item *next;
+} unpack_item_t;
+
+typedef struct {
+    unpack_item_t *head;
+    unpack_item_t *tail;
+    size_t queued;
+    size_t capacity;
+    int done;
+    int failed;
+    object_batch_t *batch;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} unpack_queue_t;
+
+static int unpack_limit = UNPACK_DEFAULT_LIMIT;
+
+void pack_set_unpack_limit(int limit) {
+    unpack_limit = limit < 0 ? 0 : limit;
+}
+
+static int unpack_one(unpack_item_t *item, object_batch_t *batch) {
+    uLongf size = item->size;
+    unsigned char *data = malloc(item->size ? item->size : 1);
+    if (!data) return -1;
+
+    if (uncompress(data, &size, item->compressed, item->comp_size) != Z_OK || size != item->size) {
+        fprintf(stderr, "Error: Corrupt object data in pack\n");
+        free(data);
         return -1;
     }
 
-    if (memcmp(sig, PACK_SIGNATURE, 4) != 0) {
-        fclose(f);
+    char header[64];
+    int header_len = object_header(item->type, item->size, header, sizeof(header));
+    hash_ctx_t ctx;
+    if (header_len < 0 || hash_init(&ctx) < 0) {
+        free(data);
         return -1;
     }
+    hash_update(&ctx, header, header_len);
+    hash_update(&ctx, data, item->size);
 
-    uint32_t version, num_objects;
-    if (fread(&version, 4, 1, f) != 1 || fread(&num_objects, 4, 1, f) != 1) {
-        fclose(f);
+    hash_t actual;
+    hash_final(&ctx, &actual);
+    if (!hash_equal(&actual, &item->hash)) {
+        char hex[HASH_HEX_SIZE + 1];
+        hash_to_hex(&item->hash, hex);
+        fprintf(stderr, "Error: Object %s does not match its advertised hash\n", hex);
+        free(data);
         return -1;
     }
 
-    num_objects = ntohl(num_objects);
+    int ret = object_batch_add(batch, &actual, item->type, data, item->size);
+    free(data);
+    return ret;
+}
 
-    for (uint32_t i = 0; i < num_objects; i++) {
-        uint32_t type, size;
-        hash_t hash;
+static void *unpack_worker(void *arg) {
+    unpack_queue_t *q = arg;
 
-        if (fread(&type, 4, 1, f) != 1 ||
-            fread(&size, 4, 1, f) != 1 ||
-            fread(hash.hash, HASH_SIZE, 1, f) != 1) {
-            fclose(f);
-            return -1;
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        while (!q->head && !q->done) {
+            pthread_cond_wait(&q->not_empty, &q->lock);
         }
+        unpack_item_t *item = q->head;
+        if (!item) {
+            pthread_mutex_unlock(&q->lock);
+            break;
+        }
+        q->head = item->next;
+        if (!q->head) q->tail = NULL;
+        q->queued--;
+        int failed = q->failed;
+        pthread_cond_signal(&q->not_full);
+        pthread_mutex_unlock(&q->lock);
+
+        if (!failed && unpack_one(item, q->batch) < 0) {
+            pthread_mutex_lock(&q->lock);
+            q->failed = 1;
+            pthread_mutex_unlock(&q->lock);
+        }
+        free(item->compressed);
+        free(item);
+    }
+    return NULL;
+}
 
-        type = ntohl(type);
-        size = ntohl(size);
+int unpack_stream(pack_read_fn read_fn, void *ctx, pack_index_result_t *result) {
+    memset(result, 0, sizeof(*result));
 
-        uint32_t comp_size;
-        if (fread(&comp_size, 4, 1, f) != 1) {
-            fclose(f);
-            return -1;
+    unsigned char header[PACK_HEADER_SIZE];
+    if (read_full(read_fn, ctx, header, sizeof(header)) < 0 ||
+        memcmp(header, PACK_SIGNATURE, 4) != 0 || get_be32(header + 4) != PACK_VERSION) {
+        fprintf(stderr, "Error: Not a supported pack stream\n");
+        return -1;
+    }
+    uint32_t num_objects = get_be32(header + 8);
+
+    int threads = pack_thread_count(num_objects);
+
+    unpack_queue_t q = {0};
+    q.capacity = (size_t)threads * UNPACK_QUEUE_PER_THREAD;
+    q.batch = object_batch_new(UNPACK_FSYNC_BATCH);
+    if (!q.batch) return -1;
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.not_empty, NULL);
+    pthread_cond_init(&q.not_full, NULL);
+
+    pthread_t *workers = calloc(threads, sizeof(pthread_t));
+    int started = 0;
+    if (workers) {
+        for (; started < threads; started++) {
+            if (pthread_create(&workers[started], NULL, unpack_worker, &q) != 0) break;
         }
-        comp_size = ntohl(comp_size);
+    }
 
-        unsigned char *compressed = malloc(comp_size);
-        if (!compressed) {
-            fclose(f);
-            return -1;
+    int ret = started > 0 ? 0 : -1;
+    size_t bytes = sizeof(header);
+    for (uint32_t i = 0; ret == 0 && i < num_objects; i++) {
+        unsigned char entry[PACK_ENTRY_HEADER_SIZE];
+        if (read_full(read_fn, ctx, entry, sizeof(entry)) < 0) {
+            fprintf(stderr, "Error: Pack truncated at object %u of %u\n", i, num_objects);
+            ret = -1;
+            break;
         }
 
-        if (fread(compressed, comp_size, 1, f) != 1) {
-            free(compressed);
-            fclose(f);
-            return -1;
+        unpack_item_t *item = calloc(1, sizeof(unpack_item_t));
+        if (!item) {
+            ret = -1;
+            break;
         }
+        item->type = get_be32(entry);
+        item->size = get_be32(entry + 4);
+        memcpy(item->hash.hash, entry + 8, HASH_SIZE);
+        item->comp_size = get_be32(entry + 8 + HASH_SIZE);
 
-        uLongf uncompressed_size = size;
-        unsigned char *uncompressed = malloc(uncompressed_size);
-        if (!uncompressed) {
-            free(compressed);
-            fclose(f);
-            return -1;
+        if (item->type < OBJ_BLOB || item->type > OBJ_COMMIT || item->comp_size == 0 ||
+            !(item->compressed = malloc(item->comp_size)) ||
+            read_full(read_fn, ctx, item->compressed, item->comp_size) < 0) {
+            fprintf(stderr, "Error: Invalid or truncated object entry in pack\n");
+            free(item->compressed);
+            free(item);
+            ret = -1;
+            break;
         }
+        bytes += sizeof(entry) + item->comp_size;
 
-        int uncompress_result = uncompress(uncompressed, &uncompressed_size, compressed, comp_size);
-        if (uncompress_result != Z_OK) {
-            free(compressed);
-            free(uncompressed);
-            fclose(f);
-            return -1;
+        if (i == 0 && item->type == OBJ_COMMIT) {
+            result->first_commit = item->hash;
+            result->has_first_commit = 1;
         }
 
-        object_t obj = { .data = (char*)uncompressed, .size = size, .type = type };
-        hash_t verify_hash;
-        if (object_write(&obj, &verify_hash) < 0) {
-            free(compressed);
-            free(uncompressed);
-            fclose(f);
-            return -1;
+        pthread_mutex_lock(&q.lock);
+        while (q.queued >= q.capacity && !q.failed) {
+            pthread_cond_wait(&q.not_full, &q.lock);
         }
+        if (q.tail) q.tail->next = item;
+        else q.head = item;
+        q.tail = item;
+        q.queued++;
+        if (q.failed) ret = -1;
+        pthread_cond_signal(&q.not_empty);
+        pthread_mutex_unlock(&q.lock);
+    }
+
+    pthread_mutex_lock(&q.lock);
+    q.done = 1;
+    if (ret < 0) q.failed = 1;
+    pthread_cond_broadcast(&q.not_empty);
+    pthread_mutex_unlock(&q.lock);
 
-        free(compressed);
-        free(uncompressed);
+    for (int t = 0; t < started; t++) {
+        pthread_join(workers[t], NULL);
     }
+    free(workers);
+
+    if (object_batch_flush(q.batch) < 0) q.failed = 1;
+    object_batch_free(q.batch);
+    if (q.failed) ret = -1;
+
+    pthread_mutex_destroy(&q.lock);
+    pthread_cond_destroy(&q.not_empty);
+    pthread_cond_destroy(&q.not_full);
+
+    if (ret == 0) {
+        result->num_objects = num_objects;
+        result->bytes = bytes;
+    }
+    return ret;
+}
 
+static ssize_t read_from_file(void *ctx, void *buf, size_t len) {
+    size_t n = fread(buf, 1, len, (FILE*)ctx);
+    if (n == 0 && ferror((FILE*)ctx)) return -1;
+    return n;
+}
+
+int unpack_objects(const char *pack_file) {
+    FILE *f = fopen(pack_file, "rb");
+    if (!f) return -1;
+
+    pack_index_result_t result;
+    int ret = unpack_stream(read_from_file, f, &result);
     fclose(f);
-    return 0;
+    return ret;
+}
+
+/* Replays an already consumed pack header before the rest of the stream */
+typedef struct {
+    pack_read_fn read_fn;
+    void *ctx;
+    unsigned char header[PACK_HEADER_SIZE];
+    size_t header_pos;
+} replay_reader_t;
+
+static ssize_t read_replay(void *ctx, void *buf, size_t len) {
+    replay_reader_t *r = ctx;
+    if (r->header_pos < sizeof(r->header)) {
+        size_t n = sizeof(r->header) - r->header_pos;
+        if (n > len) n = len;
+        memcpy(buf, r->header + r->header_pos, n);
+        r->header_pos += n;
+        return n;
+    }
+    return r->read_fn(r->ctx, buf, len);
+}
+
+/* Store a received pack. A large one that breaks off leaves the bytes
+ * received in partial_path (see pack_index_partial); a small one has
+ * nothing to keep, its objects are stored as they arrive. */
+int pack_receive_partial(pack_read_fn read_fn, void *ctx, const char *partial_path,
+                         pack_index_result_t *result) {
+    replay_reader_t r = { .read_fn = read_fn, .ctx = ctx };
+    if (read_full(read_fn, ctx, r.header, sizeof(r.header)) < 0) {
+        fprintf(stderr, "Error: Failed to read pack header\n");
+        return -1;
+    }
+
+    /* Small packs are exploded into loose objects, large ones kept as packs */
+    if (get_be32(r.header + 8) < (uint32_t)unpack_limit) {
+        return unpack_stream(read_replay, &r, result);
+    }
+    return pack_index_partial(read_replay, &r, partial_path, result);
+}
+
+int pack_receive(pack_read_fn read_fn, void *ctx, pack_index_result_t *result) {
+    return pack_receive_partial(read_fn, ctx, NULL, result);
 }
@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include "fit.h"
+
+/*
+ * Cache of packs the daemon has generated, so identical requests (e.g. CI
+ * clones of the same tip) cost one history walk and one round of
+ * compression. Entries live in .fit/pack-cache/<key>.pack:
+ *
+ *   [MAGIC:4][PACK_ID:32][WANT_COUNT:4][WANTS:32*N][PACK...]
+ *
+ * The key hashes the wants, the (sorted) haves and the compression level,
+ * i.e. everything that determines the pack's bytes. Objects never change,
+ * so an entry stays correct forever; entries for a tip are dropped once a
+ * ref moves off it, and the least recently used ones go when the cache
+ * outgrows its limit.
+ */
+
+#define PACK_CACHE_DIR FIT_DIR "/pack-cache"
+#define PACK_CACHE_MAGIC "FPC1"
+#define PACK_CACHE_DEFAULT_LIMIT (256UL * 1024 * 1024)
+#define PACK_CACHE_MAX_WANTS 4096
+
+struct pack_cache_writer {
+    FILE *f;
+    char tmp_path[512];
+    char path[512];
+};
+
+static size_t cache_limit = PACK_CACHE_DEFAULT_LIMIT;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void pack_cache_set_limit(size_t bytes) {
+    cache_limit = bytes;
+}
+
+int pack_cache_enabled(void) {
+    return cache_limit > 0;
+}
+
+static int compare_hashes(const void *a, const void *b) {
+    return memcmp(a, b, sizeof(hash_t));
+}
+
+int pack_cache_key(const hash_t *wants, size_t want_count,
+                   const hash_t *haves, size_t have_count, hash_t *key) {
+    hash_t *sorted = malloc((have_count ? have_count : 1) * sizeof(hash_t));
+    if (!sorted) return -1;
+    memcpy(sorted, haves, have_count * sizeof(hash_t));
+    qsort(sorted, have_count, sizeof(hash_t), compare_hashes);
+
+    // The empty pack's id stands in for the pack format and compression level
+    hash_t params;
+    uint32_t counts[2] = { htonl(want_count), htonl(have_count) };
+    hash_ctx_t ctx;
+    if (pack_id(NULL, 0, &params) < 0 || hash_init(&ctx) < 0) {
+        free(sorted);
+        return -1;
+    }
+    hash_update(&ctx, params.hash, HASH_SIZE);
+    hash_update(&ctx, counts, sizeof(counts));
+    hash_update(&ctx, wants, want_count * sizeof(hash_t));
+    hash_update(&ctx, sorted, have_count * sizeof(hash_t));
+    hash_final(&ctx, key);
+    free(sorted);
+    return 0;
+}
+
+static void entry_path(const hash_t *key, char *path, size_t size) {
+    char hex[HASH_HEX_SIZE + 1];
+    hash_to_hex(key, hex);
+    snprintf(path, size, "%s/%s.pack", PACK_CACHE_DIR, hex);
+}
+
+// Read an entry header; leaves fd at the start of the pack
+static int read_entry_header(int fd, hash_t *id, hash_t **wants, uint32_t *want_count) {
+    char magic[4];
+    uint32_t count;
+    if (read(fd, magic, 4) != 4 || memcmp(magic, PACK_CACHE_MAGIC, 4) != 0 ||
+        read(fd, id->hash, HASH_SIZE) != HASH_SIZE || read(fd, &count, 4) != 4) {
+        return -1;
+    }
+    count = ntohl(count);
+    if (count > PACK_CACHE_MAX_WANTS) return -1;
+
+    if (!wants) {
+        return lseek(fd, (off_t)count * HASH_SIZE, SEEK_CUR) < 0 ? -1 : 0;
+    }
+    *wants = malloc((count ? count : 1) * sizeof(hash_t));
+    if (!*wants) return -1;
+    if (read(fd, *wants, count * sizeof(hash_t)) != (ssize_t)(count * sizeof(hash_t))) {
+        free(*wants);
+        return -1;
+    }
+    *want_count = count;
+    return 0;
+}
+
+int pack_cache_open(const hash_t *key, hash_t *id, uint64_t *size) {
+    if (!pack_cache_enabled()) return -1;
+
+    char path[512];
+    entry_path(key, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || read_entry_header(fd, id, NULL, NULL) < 0) {
+        close(fd);
+        return -1;
+    }
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    *size = st.st_size - start;
+
+    // Mark as recently used for eviction
+    futimens(fd, NULL);
+    return fd;
+}
+
+pack_cache_writer_t *pack_cache_begin(const hash_t *key, const hash_t *id,
+                                      const hash_t *wants, size_t want_count) {
+    if (!pack_cache_enabled() || want_count > PACK_CACHE_MAX_WANTS) return NULL;
+    if (mkdirp(PACK_CACHE_DIR) != 0) return NULL;
+
+    pack_cache_writer_t *cw = calloc(1, sizeof(*cw));
+    if (!cw) return NULL;
+    entry_path(key, cw->path, sizeof(cw->path));
+    snprintf(cw->tmp_path, sizeof(cw->tmp_path), "%s/tmp_XXXXXX", PACK_CACHE_DIR);
+
+    int fd = mkstemp(cw->tmp_path);
+    if (fd < 0 || !(cw->f = fdopen(fd, "wb"))) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(cw->tmp_path);
+        }
+        free(cw);
+        return NULL;
+    }
+
+    uint32_t count = htonl(want_count);
+    if (fwrite(PACK_CACHE_MAGIC, 4, 1, cw->f) != 1 ||
+        fwrite(id->hash, HASH_SIZE, 1, cw->f) != 1 ||
+        fwrite(&count, 4, 1, cw->f) != 1 ||
+        fwrite(wants, sizeof(hash_t), want_count, cw->f) != want_count) {
+        pack_cache_abort(cw);
+        return NULL;
+    }
+    return cw;
+}
+
+int pack_cache_write(pack_cache_writer_t *cw, const void *buf, size_t len) {
+    return fwrite(buf, 1, len, cw->f) == len ? 0 : -1;
+}
+
+void pack_cache_abort(pack_cache_writer_t *cw) {
+    if (!cw) return;
+    fclose(cw->f);
+    unlink(cw->tmp_path);
+    free(cw);
+}
+
+typedef struct {
+    char name[HASH_HEX_SIZE + 8];
+    off_t size;
+    struct timespec used;
+} cache_entry_t;
+
+static int compare_by_use(const void *a, const void *b) {
+    const struct timespec *x = &((const cache_entry_t *)a)->used;
+    const struct timespec *y = &((const cache_entry_t *)b)->used;
+    if (x->tv_sec != y->tv_sec) return x->tv_sec < y->tv_sec ? -1 : 1;
+    if (x->tv_nsec != y->tv_nsec) return x->tv_nsec < y->tv_nsec ? -1 : 1;
+    return 0;
+}
+
+// Drop least recently used entries until the cache fits its limit
+static void pack_cache_evict(void) {
+    DIR *dir = opendir(PACK_CACHE_DIR);
+    if (!dir) return;
+
+    cache_entry_t *entries = NULL;
+    size_t count = 0, capacity = 0;
+    uint64_t total = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        size_t len = strlen(de->d_name);
+        if (len != HASH_HEX_SIZE + 5 || strcmp(de->d_name + HASH_HEX_SIZE, ".pack") != 0) continue;
+
+        struct stat st;
+        if (fstatat(dirfd(dir), de->d_name, &st, 0) < 0) continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            cache_entry_t *grown = realloc(entries, capacity * sizeof(cache_entry_t));
+            if (!grown) break;
+            entries = grown;
+        }
+        memcpy(entries[count].name, de->d_name, len + 1);
+        entries[count].size = st.st_size;
+        entries[count].used = st.st_mtim;
+        total += st.st_size;
+        count++;
+    }
+
+    qsort(entries, count, sizeof(cache_entry_t), compare_by_use);
+    for (size_t i = 0; i < count && total > cache_limit; i++) {
+        if (unlinkat(dirfd(dir), entries[i].name, 0) == 0) total -= entries[i].size;
+    }
+
+    closedir(dir);
+    free(entries);
+}
+
+int pack_cache_commit(pack_cache_writer_t *cw) {
+    // Durable before the rename, or a crash could publish a torn pack
+    int ok = fflush(cw->f) == 0 && fsync(fileno(cw->f)) == 0;
+    if (fclose(cw->f) != 0) ok = 0;
+    if (!ok || rename(cw->tmp_path, cw->path) < 0) {
+        unlink(cw->tmp_path);
+        free(cw);
+        return -1;
+    }
+    free(cw);
+
+    pthread_mutex_lock(&cache_lock);
+    pack_cache_evict();
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+// A ref moved off tip: packs built for it will not be asked for again
+void pack_cache_invalidate(const hash_t *tip) {
+    DIR *dir = opendir(PACK_CACHE_DIR);
+    if (!dir) return;
+
+    pthread_mutex_lock(&cache_lock);
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        size_t len = strlen(de->d_name);
+        if (len != HASH_HEX_SIZE + 5 || strcmp(de->d_name + HASH_HEX_SIZE, ".pack") != 0) continue;
+
+        int fd = openat(dirfd(dir), de->d_name, O_RDONLY);
+        if (fd < 0) continue;
+        hash_t id, *wants = NULL;
+        uint32_t want_count = 0;
+        int stale = 0;
+        if (read_entry_header(fd, &id, &wants, &want_count) == 0) {
+            for (uint32_t i = 0; i < want_count && !stale; i++) {
+                stale = hash_equal(&wants[i], tip);
+            }
+            free(wants);
+        }
+        close(fd);
+        if (stale) unlinkat(dirfd(dir), de->d_name, 0);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    closedir(dir);
+}
@@ -0,0 +1,596 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include "fit.h"
+
+#define IDX_SIGNATURE "FIDX"
+#define IDX_VERSION 1
+#define IDX_HEADER_SIZE 12
+#define IDX_FANOUT_SIZE (256 * 4)
+#define STREAM_CHUNK 65536
+
+/*
+ * Stored packs live in .fit/objects/pack as pack-<hash>.pack exactly as they
+ * arrived on the wire, next to a pack-<hash>.idx built while receiving them.
+ *
+ * Index layout:
+ *   [SIGNATURE:4 "FIDX"][VERSION:4][COUNT:4]
+ *   [FANOUT:256 x 4]       cumulative count of hashes by first byte
+ *   [HASHES:COUNT x 32]    sorted object hashes
+ *   [OFFSETS:COUNT x 8]    entry offsets into the pack, big-endian
+ *   [PACK_HASH:32]         checksum of the pack file
+ */
+
+typedef struct packed_file {
+    char *pack_path;
+    int pack_fd;
+    unsigned char *idx_map;
+    size_t idx_size;
+    uint32_t count;
+    const unsigned char *fanout;
+    const unsigned char *hashes;
+    const unsigned char *offsets;
+    struct packed_file *next;
+} packed_file_t;
+
+typedef struct {
+    hash_t hash;
+    uint64_t offset;
+} idx_entry_t;
+
+static packed_file_t *packs = NULL;
+static int packs_loaded = 0;
+static struct timespec packs_mtime;
+static pthread_mutex_t packs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static packed_file_t* pack_open(const char *idx_path) {
+    int fd = open(idx_path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < IDX_HEADER_SIZE + IDX_FANOUT_SIZE + HASH_SIZE) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)st.st_size;
+    unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    uint32_t count = get_be32(map + 8);
+    if (memcmp(map, IDX_SIGNATURE, 4) != 0 || get_be32(map + 4) != IDX_VERSION ||
+        size != IDX_HEADER_SIZE + IDX_FANOUT_SIZE + (size_t)count * (HASH_SIZE + 8) + HASH_SIZE) {
+        fprintf(stderr, "Warning: Ignoring malformed pack index %s\n", idx_path);
+        munmap(map, size);
+        return NULL;
+    }
+
+    packed_file_t *p = calloc(1, sizeof(packed_file_t));
+    if (!p) {
+        munmap(map, size);
+        return NULL;
+    }
+
+    /* pack-<hash>.idx -> pack-<hash>.pack */
+    size_t path_len = strlen(idx_path);
+    p->pack_path = malloc(path_len + 2);
+    if (!p->pack_path) {
+        free(p);
+        munmap(map, size);
+        return NULL;
+    }
+    memcpy(p->pack_path, idx_path, path_len - 3);
+    strcpy(p->pack_path + path_len - 3, "pack");
+
+    p->pack_fd = open(p->pack_path, O_RDONLY);
+    if (p->pack_fd < 0) {
+        free(p->pack_path);
+        free(p);
+        munmap(map, size);
+        return NULL;
+    }
+
+    p->idx_map = map;
+    p->idx_size = size;
+    p->count = count;
+    p->fanout = map + IDX_HEADER_SIZE;
+    p->hashes = p->fanout + IDX_FANOUT_SIZE;
+    p->offsets = p->hashes + (size_t)count * HASH_SIZE;
+    return p;
+}
+
+/* Caller holds packs_lock */
+static void pack_add(const char *idx_path) {
+    for (packed_file_t *p = packs; p; p = p->next) {
+        if (strncmp(p->pack_path, idx_path, strlen(idx_path) - 4) == 0) return;
+    }
+
+    packed_file_t *p = pack_open(idx_path);
+    if (!p) return;
+    p->next = packs;
+    packs = p;
+}
+
+/* Caller holds packs_lock */
+static void packs_load(void) {
+    if (packs_loaded) return;
+    packs_loaded = 1;
+
+    struct stat st;
+    if (stat(FIT_PACK_DIR, &st) == 0) packs_mtime = st.st_mtim;
+
+    DIR *d = opendir(FIT_PACK_DIR);
+    if (!d) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(d))) {
+        size_t len = strlen(entry->d_name);
+        if (len < 5 || strncmp(entry->d_name, "pack-", 5) != 0) continue;
+        if (strcmp(entry->d_name + len - 4, ".idx") != 0) continue;
+
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", FIT_PACK_DIR, entry->d_name);
+        pack_add(path);
+    }
+    closedir(d);
+}
+
+/* Caller holds packs_lock. Picks up packs written by another process (e.g.
+ * a repack while the daemon runs); returns whether any were found */
+static int packs_reload(void) {
+    struct stat st;
+    if (stat(FIT_PACK_DIR, &st) < 0 ||
+        (st.st_mtim.tv_sec == packs_mtime.tv_sec && st.st_mtim.tv_nsec == packs_mtime.tv_nsec)) {
+        return 0;
+    }
+    packed_file_t *first = packs;
+    packs_loaded = 0;
+    packs_load();
+    return packs != first;
+}
+
+static int pack_lookup(const packed_file_t *p, const hash_t *hash, uint64_t *offset_out) {
+    uint8_t first = hash->hash[0];
+    uint32_t lo = first ? get_be32(p->fanout + (first - 1) * 4) : 0;
+    uint32_t hi = get_be32(p->fanout + first * 4);
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(p->hashes + (size_t)mid * HASH_SIZE, hash->hash, HASH_SIZE);
+        if (cmp == 0) {
+            *offset_out = get_be64(p->offsets + (size_t)mid * 8);
+            return 0;
+        }
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return -1;
+}
+
+/* Caller holds packs_lock */
+static int pack_search(const hash_t *hash, packed_file_t **pack_out, uint64_t *offset_out) {
+    for (packed_file_t *p = packs; p; p = p->next) {
+        if (pack_lookup(p, hash, offset_out) == 0) {
+            *pack_out = p;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int pack_find(const hash_t *hash, packed_file_t **pack_out, uint64_t *offset_out) {
+    pthread_mutex_lock(&packs_lock);
+    packs_load();
+    int ret = pack_search(hash, pack_out, offset_out);
+    if (ret < 0 && packs_reload()) ret = pack_search(hash, pack_out, offset_out);
+    pthread_mutex_unlock(&packs_lock);
+    return ret;
+}
+
+/* Open a stored pack holding exactly these objects and starting with the
+ * first of them (the tip, for clients that take it from the pack), so it
+ * can be sent as is. Returns a file descriptor, or -1 if there is none. */
+int pack_open_matching(const hash_t *objects, size_t count, hash_t *pack_hash, uint64_t *size) {
+    if (count == 0) return -1;
+
+    pthread_mutex_lock(&packs_lock);
+    packs_load();
+    packs_reload();
+
+    int fd = -1;
+    for (packed_file_t *p = packs; p && fd < 0; p = p->next) {
+        if (p->count != count) continue;
+
+        /* Objects are unique in both, so equal counts and containment
+         * mean equal sets */
+        uint64_t offset, first_offset = UINT64_MAX;
+        size_t i;
+        for (i = 0; i < count; i++) {
+            if (pack_lookup(p, &objects[i], &offset) < 0) break;
+            if (i == 0) first_offset = offset;
+        }
+        if (i < count || first_offset != PACK_HEADER_SIZE) continue;
+
+        struct stat st;
+        fd = open(p->pack_path, O_RDONLY);
+        if (fd >= 0 && fstat(fd, &st) < 0) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd >= 0) {
+            memcpy(pack_hash->hash, p->idx_map + p->idx_size - HASH_SIZE, HASH_SIZE);
+            *size = st.st_size;
+        }
+    }
+
+    pthread_mutex_unlock(&packs_lock);
+    return fd;
+}
+
+int pack_has_object(const hash_t *hash) {
+    packed_file_t *p;
+    uint64_t offset;
+    return pack_find(hash, &p, &offset) == 0;
+}
+
+/* Read the [TYPE:4][SIZE:4][HASH:32][COMP_SIZE:4] header of an entry */
+static int read_entry_header(const packed_file_t *p, uint64_t offset, const hash_t *hash,
+                             uint32_t *type, uint32_t *size, uint32_t *comp_size) {
+    unsigned char header[PACK_ENTRY_HEADER_SIZE];
+    if (pread(p->pack_fd, header, sizeof(header), offset) != (ssize_t)sizeof(header)) {
+        return -1;
+    }
+
+    *type = get_be32(header);
+    *size = get_be32(header + 4);
+    *comp_size = get_be32(header + 8 + HASH_SIZE);
+    if (memcmp(header + 8, hash->hash, HASH_SIZE) != 0) {
+        fprintf(stderr, "Error: Pack index points at the wrong object in %s\n", p->pack_path);
+        return -1;
+    }
+    return 0;
+}
+
+int pack_object_info(const hash_t *hash, obj_type *type_out, size_t *size_out) {
+    packed_file_t *p;
+    uint64_t offset;
+    uint32_t type, size, comp_size;
+    if (pack_find(hash, &p, &offset) < 0 ||
+        read_entry_header(p, offset, hash, &type, &size, &comp_size) < 0) {
+        return -1;
+    }
+    *type_out = type;
+    *size_out = size;
+    return 0;
+}
+
+int pack_read_object(const hash_t *hash, object_t *obj) {
+    packed_file_t *p;
+    uint64_t offset;
+    uint32_t type, size, comp_size;
+    if (pack_find(hash, &p, &offset) < 0 ||
+        read_entry_header(p, offset, hash, &type, &size, &comp_size) < 0) {
+        return -1;
+    }
+
+    unsigned char *compressed = malloc(comp_size);
+    if (!compressed) return -1;
+
+    if (pread(p->pack_fd, compressed, comp_size, offset + PACK_ENTRY_HEADER_SIZE) != (ssize_t)comp_size) {
+        free(compressed);
+        return -1;
+    }
+
+    uLongf uncompressed_size = size;
+    char *data = malloc(size ? size : 1);
+    if (!data) {
+        free(compressed);
+        return -1;
+    }
+
+    int ret = uncompress((unsigned char*)data, &uncompressed_size, compressed, comp_size);
+    free(compressed);
+    if (ret != Z_OK || uncompressed_size != size) {
+        free(data);
+        return -1;
+    }
+
+    obj->data = data;
+    obj->size = size;
+    obj->type = type;
+    return 0;
+}
+
+static int compare_idx_entries(const void *a, const void *b) {
+    return memcmp(((const idx_entry_t*)a)->hash.hash, ((const idx_entry_t*)b)->hash.hash, HASH_SIZE);
+}
+
+static int write_index(const char *path, const idx_entry_t *entries, uint32_t count, const hash_t *pack_hash) {
+    FILE *f = fopen(path, "wb");
+    if (!f) return -1;
+
+    unsigned char header[IDX_HEADER_SIZE];
+    memcpy(header, IDX_SIGNATURE, 4);
+    uint32_t version = htonl(IDX_VERSION);
+    uint32_t num = htonl(count);
+    memcpy(header + 4, &version, 4);
+    memcpy(header + 8, &num, 4);
+    int ok = fwrite(header, sizeof(header), 1, f) == 1;
+
+    uint32_t fanout[256] = {0};
+    for (uint32_t i = 0; i < count; i++) {
+        fanout[entries[i].hash.hash[0]]++;
+    }
+    uint32_t running = 0;
+    for (int i = 0; i < 256; i++) {
+        running += fanout[i];
+        fanout[i] = htonl(running);
+    }
+    ok = ok && fwrite(fanout, sizeof(fanout), 1, f) == 1;
+
+    for (uint32_t i = 0; ok && i < count; i++) {
+        ok = fwrite(entries[i].hash.hash, HASH_SIZE, 1, f) == 1;
+    }
+    for (uint32_t i = 0; ok && i < count; i++) {
+        unsigned char offset[8];
+        put_be64(offset, entries[i].offset);
+        ok = fwrite(offset, sizeof(offset), 1, f) == 1;
+    }
+    ok = ok && fwrite(pack_hash->hash, HASH_SIZE, 1, f) == 1;
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+
+    if (fclose(f) != 0) ok = 0;
+    return ok ? 0 : -1;
+}
+
+/* Copy one compressed object from the stream into the pack, inflating it on
+ * the fly so its hash can be checked without buffering the whole object. */
+static int index_entry_data(pack_read_fn read_fn, void *ctx, FILE *out, hash_ctx_t *pack_ctx,
+                            unsigned char *in, unsigned char *buf,
+                            uint32_t type, uint32_t size, uint32_t comp_size, const hash_t *expected) {
+    char header[64];
+    int header_len = object_header(type, size, header, sizeof(header));
+    if (header_len < 0) return -1;
+
+    hash_ctx_t obj_ctx;
+    if (hash_init(&obj_ctx) < 0) return -1;
+    hash_update(&obj_ctx, header, header_len);
+
+    z_stream zs = {0};
+    if (inflateInit(&zs) != Z_OK) {
+        hash_abort(&obj_ctx);
+        return -1;
+    }
+
+    int zret = Z_OK;
+    uint32_t remaining = comp_size;
+    while (remaining > 0) {
+        size_t n = remaining < STREAM_CHUNK ? remaining : STREAM_CHUNK;
+        if (read_full(read_fn, ctx, in, n) < 0 || fwrite(in, 1, n, out) != n) {
+            zret = Z_STREAM_ERROR;
+            break;
+        }
+        hash_update(pack_ctx, in, n);
+        remaining -= n;
+
+        if (zret == Z_STREAM_END) {
+            /* Trailing bytes after the end of the deflate stream */
+            zret = Z_DATA_ERROR;
+            break;
+        }
+
+        zs.next_in = in;
+        zs.avail_in = n;
+        do {
+            zs.next_out = buf;
+            zs.avail_out = STREAM_CHUNK;
+            zret = inflate(&zs, Z_NO_FLUSH);
+            if (zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR) break;
+            size_t have = STREAM_CHUNK - zs.avail_out;
+            if (zs.total_out > size) {
+                zret = Z_DATA_ERROR;
+                break;
+            }
+            hash_update(&obj_ctx, buf, have);
+        } while (zs.avail_out == 0 && zret != Z_STREAM_END);
+
+        if (zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR) break;
+        if (zret == Z_STREAM_END && zs.avail_in > 0) {
+            zret = Z_DATA_ERROR;
+            break;
+        }
+    }
+
+    int complete = zret == Z_STREAM_END && zs.total_out == size;
+    inflateEnd(&zs);
+
+    if (!complete) {
+        hash_abort(&obj_ctx);
+        fprintf(stderr, "Error: Corrupt or truncated object data in pack stream\n");
+        return -1;
+    }
+
+    hash_t actual;
+    hash_final(&obj_ctx, &actual);
+    if (!hash_equal(&actual, expected)) {
+        char hex[HASH_HEX_SIZE + 1];
+        hash_to_hex(expected, hex);
+        fprintf(stderr, "Error: Object %s does not match its advertised hash\n", hex);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Index a pack stream into the pack directory. If the stream breaks off and
+ * partial_path is set, the bytes written so far (a prefix of the stream) are
+ * moved there, so an interrupted transfer can continue without having
+ * spooled anything while it ran. */
+int pack_index_partial(pack_read_fn read_fn, void *ctx, const char *partial_path,
+                       pack_index_result_t *result) {
+    memset(result, 0, sizeof(*result));
+
+    unsigned char header[PACK_HEADER_SIZE];
+    if (read_full(read_fn, ctx, header, sizeof(header)) < 0) {
+        fprintf(stderr, "Error: Failed to read pack header\n");
+        return -1;
+    }
+    if (memcmp(header, PACK_SIGNATURE, 4) != 0 || get_be32(header + 4) != PACK_VERSION) {
+        fprintf(stderr, "Error: Not a supported pack stream\n");
+        return -1;
+    }
+    uint32_t num_objects = get_be32(header + 8);
+
+    if (mkdirp(FIT_PACK_DIR) != 0) {
+        fprintf(stderr, "Error: Failed to create pack directory\n");
+        return -1;
+    }
+
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/tmp_pack_XXXXXX", FIT_PACK_DIR);
+    int tmp_fd = mkstemp(tmp_path);
+    if (tmp_fd < 0) {
+        perror("Failed to create temporary pack");
+        return -1;
+    }
+    fchmod(tmp_fd, 0444);
+    FILE *out = fdopen(tmp_fd, "wb");
+    if (!out) {
+        close(tmp_fd);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    hash_ctx_t pack_ctx;
+    if (hash_init(&pack_ctx) < 0) {
+        fclose(out);
+        unlink(tmp_path);
+        return -1;
+    }
+    hash_update(&pack_ctx, header, sizeof(header));
+
+    idx_entry_t *entries = NULL;
+    size_t capacity = 0;
+    uint64_t offset = sizeof(header);
+    unsigned char *in = malloc(STREAM_CHUNK);
+    unsigned char *buf = malloc(STREAM_CHUNK);
+    int ok = in && buf && fwrite(header, sizeof(header), 1, out) == 1;
+
+    for (uint32_t i = 0; ok && i < num_objects; i++) {
+        unsigned char entry[PACK_ENTRY_HEADER_SIZE];
+        if (read_full(read_fn, ctx, entry, sizeof(entry)) < 0) {
+            fprintf(stderr, "Error: Pack stream truncated at object %u of %u\n", i, num_objects);
+            ok = 0;
+            break;
+        }
+
+        uint32_t type = get_be32(entry);
+        uint32_t size = get_be32(entry + 4);
+        uint32_t comp_size = get_be32(entry + 8 + HASH_SIZE);
+        hash_t hash;
+        memcpy(hash.hash, entry + 8, HASH_SIZE);
+
+        if (type < OBJ_BLOB || type > OBJ_COMMIT || comp_size == 0) {
+            fprintf(stderr, "Error: Invalid object entry in pack stream\n");
+            ok = 0;
+            break;
+        }
+
+        if (i >= capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            idx_entry_t *grown = realloc(entries, capacity * sizeof(idx_entry_t));
+            if (!grown) {
+                ok = 0;
+                break;
+            }
+            entries = grown;
+        }
+
+        hash_update(&pack_ctx, entry, sizeof(entry));
+        if (fwrite(entry, sizeof(entry), 1, out) != 1 ||
+            index_entry_data(read_fn, ctx, out, &pack_ctx, in, buf, type, size, comp_size, &hash) < 0) {
+            ok = 0;
+            break;
+        }
+
+        entries[i].hash = hash;
+        entries[i].offset = offset;
+        offset += sizeof(entry) + comp_size;
+
+        if (i == 0 && type == OBJ_COMMIT) {
+            result->first_commit = hash;
+            result->has_first_commit = 1;
+        }
+    }
+
+    free(in);
+    free(buf);
+    ok = ok && fflush(out) == 0 && fsync(fileno(out)) == 0;
+    if (fclose(out) != 0) ok = 0;
+
+    if (!ok) {
+        hash_abort(&pack_ctx);
+        free(entries);
+        if (!partial_path || rename(tmp_path, partial_path) < 0) unlink(tmp_path);
+        return -1;
+    }
+
+    hash_final(&pack_ctx, &result->pack_hash);
+    result->num_objects = num_objects;
+    result->bytes = offset;
+
+    if (num_objects == 0) {
+        free(entries);
+        unlink(tmp_path);
+        return 0;
+    }
+
+    qsort(entries, num_objects, sizeof(idx_entry_t), compare_idx_entries);
+
+    char hex[HASH_HEX_SIZE + 1];
+    hash_to_hex(&result->pack_hash, hex);
+
+    char pack_path[512], idx_path[512], tmp_idx_path[520];
+    snprintf(pack_path, sizeof(pack_path), "%s/pack-%s.pack", FIT_PACK_DIR, hex);
+    snprintf(idx_path, sizeof(idx_path), "%s/pack-%s.idx", FIT_PACK_DIR, hex);
+    snprintf(tmp_idx_path, sizeof(tmp_idx_path), "%s.tmp", tmp_path);
+
+    /* The pack goes in place first; an .idx only appears once it is complete */
+    if (write_index(tmp_idx_path, entries, num_objects, &result->pack_hash) < 0 ||
+        rename(tmp_path, pack_path) < 0 ||
+        rename(tmp_idx_path, idx_path) < 0) {
+        perror("Failed to store pack");
+        free(entries);
+        unlink(tmp_path);
+        unlink(tmp_idx_path);
+        return -1;
+    }
+    free(entries);
+
+    int dir_fd = open(FIT_PACK_DIR, O_RDONLY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    pthread_mutex_lock(&packs_lock);
+    if (packs_loaded) pack_add(idx_path);
+    pthread_mutex_unlock(&packs_lock);
+
+    return 0;
+}
+
+int pack_index_stream(pack_read_fn read_fn, void *ctx, pack_index_result_t *result) {
+    return pack_index_partial(read_fn, ctx, NULL, result);
+}
@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "fit.h"
+
+/*
+ * Partial clones. A clone made with --filter leaves out some blobs and
+ * records in .fit/promisor the remote that promised to supply them:
+ *
+ *   remote = <host>
+ *   filter = blob:none | blob:limit=<bytes>
+ *
+ * When object_read() misses, the object is fetched from that remote. Hashes
+ * the remote could not supply are remembered, so a walk that runs past the
+ * end of local history asks about each missing object only once. Commands
+ * that know up front which blobs they will read (checkout, diff) prefetch
+ * them in one batch, split over a few parallel connections when large.
+ */
+
+#define FIT_PROMISOR_FILE ".fit/promisor"
+#define PROMISOR_PORT 9418
+#define PROMISOR_MAX_STREAMS 4
+#define PROMISOR_STREAM_MIN 1024  /* Objects worth a connection of their own */
+
+typedef struct {
+    const hash_t *hashes;
+    size_t count;
+} promisor_slice_t;
+
+static pthread_mutex_t promisor_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int promisor_busy;  // Set while this thread is fetching
+static int promisor_loaded;
+static int promisor_partial;
+static char promisor_host[256];
+static hash_set_t promisor_missing;
+
+int filter_parse(const char *spec, object_filter_t *filter) {
+    filter->type = FILTER_NONE;
+    filter->limit = 0;
+    if (strcmp(spec, "blob:none") == 0) {
+        filter->type = FILTER_BLOB_NONE;
+        return 0;
+    }
+
+    if (strncmp(spec, "blob:limit=", 11) == 0) {
+        char *end;
+        unsigned long long limit = strtoull(spec + 11, &end, 10);
+        if (end == spec + 11) return -1;
+        int shift = 0;
+        switch (*end) {
+        case 'k': case 'K': shift = 10; break;
+        case 'm': case 'M': shift = 20; break;
+        case 'g': case 'G': shift = 30; break;
+        }
+        if (shift) end++;
+        if (*end) return -1;
+        limit <<= shift;
+        filter->type = FILTER_BLOB_LIMIT;
+        filter->limit = limit;
+        return 0;
+    }
+    return -1;
+}
+
+void filter_format(const object_filter_t *filter, char *buf, size_t size) {
+    switch (filter->type) {
+    case FILTER_BLOB_NONE:
+        snprintf(buf, size, "blob:none");
+        break;
+    case FILTER_BLOB_LIMIT:
+        snprintf(buf, size, "blob:limit=%llu", (unsigned long long)filter->limit);
+        break;
+    default:
+        snprintf(buf, size, "none");
+    }
+}
+
+/* Whether the filter leaves this object out of a pack */
+int filter_omits(const object_filter_t *filter, const hash_t *hash) {
+    if (!filter || filter->type == FILTER_NONE) return 0;
+
+    obj_type type;
+    size_t size;
+    if (object_info(hash, &type, &size) < 0 || type != OBJ_BLOB) return 0;
+    return filter->type == FILTER_BLOB_NONE || size > filter->limit;
+}
+
+int promisor_write(const char *host, const object_filter_t *filter) {
+    char spec[64];
+    filter_format(filter, spec, sizeof(spec));
+
+    FILE *f = fopen(FIT_PROMISOR_FILE, "w");
+    if (!f) {
+        fprintf(stderr, "Failed to create promisor file\n");
+        return -1;
+    }
+    fprintf(f, "remote = %s\nfilter = %s\n", host, spec);
+    if (fclose(f) != 0) return -1;
+
+    pthread_mutex_lock(&promisor_lock);
+    promisor_loaded = 0;
+    pthread_mutex_unlock(&promisor_lock);
+    return 0;
+}
+
+/* Returns 1 for a partial clone (filling in host and filter), else 0 */
+int promisor_read(char *host, size_t host_size, object_filter_t *filter) {
+    FILE *f = fopen(FIT_PROMISOR_FILE, "r");
+    if (!f) return 0;
+
+    char line[512], value[256];
+    int have_host = 0;
+    if (filter) filter->type = FILTER_NONE;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "remote = %255s", value) == 1) {
+            snprintf(host, host_size, "%s", value);
+            have_host = 1;
+        } else if (filter && sscanf(line, "filter = %255s", value) == 1 &&
+                   filter_parse(value, filter) < 0) {
+            fprintf(stderr, "Warning: Unknown filter '%s' in %s\n", value, FIT_PROMISOR_FILE);
+        }
+    }
+    fclose(f);
+    return have_host;
+}
+
+/* Caller holds promisor_lock */
+static void promisor_load(void) {
+    if (promisor_loaded) return;
+    promisor_partial = promisor_read(promisor_host, sizeof(promisor_host), NULL);
+    if (!promisor_missing.slots) hash_set_init(&promisor_missing);
+    promisor_loaded = 1;
+}
+
+int promisor_enabled(void) {
+    pthread_mutex_lock(&promisor_lock);
+    promisor_load();
+    int partial = promisor_partial;
+    pthread_mutex_unlock(&promisor_lock);
+    return partial;
+}
+
+static void *fetch_slice(void *arg) {
+    promisor_slice_t *slice = arg;
+    promisor_busy = 1;
+    net_fetch_objects(promisor_host, PROMISOR_PORT, slice->hashes, slice->count);
+    return NULL;
+}
+
+/* Fetch over up to PROMISOR_MAX_STREAMS connections; the server packs each
+ * slice in its own worker, so a large batch is not bound by one of them */
+static void fetch_parallel(const hash_t *hashes, size_t count) {
+    size_t streams = (count + PROMISOR_STREAM_MIN - 1) / PROMISOR_STREAM_MIN;
+    if (streams > PROMISOR_MAX_STREAMS) streams = PROMISOR_MAX_STREAMS;
+    if (streams < 1) streams = 1;
+
+    promisor_slice_t slices[PROMISOR_MAX_STREAMS];
+    pthread_t threads[PROMISOR_MAX_STREAMS];
+    int started[PROMISOR_MAX_STREAMS] = {0};
+    size_t per_stream = (count + streams - 1) / streams;
+    for (size_t i = 0; i < streams; i++) {
+        size_t start = i * per_stream;
+        slices[i].hashes = hashes + start;
+        slices[i].count = start + per_stream > count ? count - start : per_stream;
+        if (i > 0) started[i] = pthread_create(&threads[i], NULL, fetch_slice, &slices[i]) == 0;
+    }
+
+    // The calling thread takes the first slice, and any that found no thread
+    fetch_slice(&slices[0]);
+    for (size_t i = 1; i < streams; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        else fetch_slice(&slices[i]);
+    }
+}
+
+int promisor_fetch(const hash_t *hashes, size_t count) {
+    if (promisor_busy) return -1;  // Never recurse from inside a fetch
+
+    pthread_mutex_lock(&promisor_lock);
+    promisor_load();
+    if (!promisor_partial) {
+        pthread_mutex_unlock(&promisor_lock);
+        return -1;
+    }
+
+    // Only ask for what is still missing and not already refused, once each
+    hash_t *wanted = malloc((count ? count : 1) * sizeof(hash_t));
+    size_t wanted_count = 0;
+    int ret = 0;
+    hash_set_t seen;
+    hash_set_init(&seen);
+    for (size_t i = 0; wanted && i < count; i++) {
+        if (hash_set_contains(&promisor_missing, &hashes[i])) {
+            ret = -1;
+        } else if (hash_set_add(&seen, &hashes[i]) > 0 && !object_exists(&hashes[i])) {
+            wanted[wanted_count++] = hashes[i];
+        }
+    }
+    hash_set_free(&seen);
+    if (!wanted) ret = -1;
+
+    if (wanted_count > 0) {
+        fetch_parallel(wanted, wanted_count);
+        promisor_busy = 0;
+
+        for (size_t i = 0; i < wanted_count; i++) {
+            if (object_exists(&wanted[i])) continue;
+            hash_set_add(&promisor_missing, &wanted[i]);
+            ret = -1;
+        }
+    }
+
+    pthread_mutex_unlock(&promisor_lock);
+    free(wanted);
+    return ret;
+}
+
+/* Fetch, in one batch, whichever of these objects a partial clone lacks */
+int promisor_prefetch(const hash_t *hashes, size_t count) {
+    if (count == 0 || !promisor_enabled()) return 0;
+    return promisor_fetch(hashes, count);
+}
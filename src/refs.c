@@ -2,9 +2,245 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "fit.h"
 
-int ref_read(const char *name, hash_t *hash) {
+/*
+ * Refs live in two places: loose files under .fit/refs/<name>, and
+ * .fit/packed-refs, one "<hex> <name>" line per ref sorted by name. A loose
+ * ref overrides a packed one of the same name. Lookups binary-search the
+ * mapped packed file, and listing a prefix reads only its range, so a
+ * repository with many refs does not need one file (or a directory scan)
+ * per ref once they are packed.
+ *
+ * Updates go through transactions: every ref is locked by creating
+ * <path>.lock exclusively, old values are checked under the lock, the new
+ * values are written and fsynced into the lock files, and only then renamed
+ * into place. Deleting a packed ref rewrites packed-refs the same way.
+ *
+ * `fit pack-refs --reftable` moves a repository over to reftable storage
+ * (reftable.c), which then replaces packed-refs: transactions append a table
+ * under the stack's single lock instead of writing loose files, and loose
+ * files are only read as an overlay (tags that carry a message).
+ */
+
+#define FIT_PACKED_REFS_FILE ".fit/packed-refs"
+#define PACKED_REFS_HEADER "# pack-refs sorted\n"
+#define LOCK_SUFFIX ".lock"
+
+typedef struct {
+    char *name;
+    hash_t hash;
+} ref_item_t;
+
+typedef struct {
+    ref_item_t *items;
+    size_t count;
+    size_t capacity;
+} ref_list_t;
+
+typedef struct {
+    char *name;
+    hash_t old_hash;
+    hash_t new_hash;            // Null to delete
+    int check_old;
+    int locked;
+} ref_update_t;
+
+struct ref_transaction {
+    ref_update_t *updates;
+    size_t count;
+    size_t capacity;
+};
+
+typedef struct {
+    const char *data;
+    size_t size;
+} packed_refs_t;
+
+static int ref_list_add(ref_list_t *list, const char *name, size_t len, const hash_t *hash) {
+    if (list->count >= list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        ref_item_t *items = realloc(list->items, capacity * sizeof(ref_item_t));
+        if (!items) return -1;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    if (!(list->items[list->count].name = strndup(name, len))) return -1;
+    list->items[list->count++].hash = *hash;
+    return 0;
+}
+
+static void ref_list_free(ref_list_t *list) {
+    for (size_t i = 0; i < list->count; i++) free(list->items[i].name);
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+/* Packed refs */
+
+static int packed_open(packed_refs_t *packed) {
+    packed->data = NULL;
+    packed->size = 0;
+
+    int fd = open(FIT_PACKED_REFS_FILE, O_RDONLY);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+
+    struct stat st;
+    int ret = 0;
+    if (fstat(fd, &st) < 0) {
+        ret = -1;
+    } else if (st.st_size > 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            ret = -1;
+        } else {
+            packed->data = data;
+            packed->size = st.st_size;
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+static void packed_close(packed_refs_t *packed) {
+    if (packed->data) munmap((void *)packed->data, packed->size);
+    packed->data = NULL;
+}
+
+/* Parse the line starting at off into name and hash; returns the next line */
+static size_t packed_line(const packed_refs_t *packed, size_t off, const char **name,
+                          size_t *name_len, hash_t *hash) {
+    const char *line = packed->data + off;
+    const char *end = memchr(line, '\n', packed->size - off);
+    size_t len = end ? (size_t)(end - line) : packed->size - off;
+
+    *name = NULL;
+    if (len > HASH_HEX_SIZE + 1 && line[0] != '#' && line[HASH_HEX_SIZE] == ' ') {
+        char hex[HASH_HEX_SIZE + 1];
+        memcpy(hex, line, HASH_HEX_SIZE);
+        hex[HASH_HEX_SIZE] = '\0';
+        if (hex_to_hash(hex, hash) == 0) {
+            *name = line + HASH_HEX_SIZE + 1;
+            *name_len = len - HASH_HEX_SIZE - 1;
+        }
+    }
+    return off + len + (end ? 1 : 0);
+}
+
+/* Compare a line's name against key, looking at no more than key_len bytes
+ * of the name when prefix is set */
+static int compare_name(const char *name, size_t name_len, const char *key, size_t key_len,
+                        int prefix) {
+    size_t n = name_len < key_len ? name_len : key_len;
+    int cmp = memcmp(name, key, n);
+    if (cmp != 0) return cmp;
+    if (name_len < key_len) return -1;
+    return prefix || name_len == key_len ? 0 : 1;
+}
+
+/* Offset of the first line whose name is not less than key */
+static size_t packed_lower_bound(const packed_refs_t *packed, const char *key, size_t key_len,
+                                 int prefix) {
+    size_t lo = 0, hi = packed->size;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        while (mid > lo && packed->data[mid - 1] != '\n') mid--;
+
+        const char *name;
+        size_t name_len;
+        hash_t hash;
+        size_t next = packed_line(packed, mid, &name, &name_len, &hash);
+        if (!name || compare_name(name, name_len, key, key_len, prefix) < 0) {
+            lo = next;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int packed_lookup(const packed_refs_t *packed, const char *key, hash_t *hash) {
+    size_t key_len = strlen(key);
+    size_t off = packed_lower_bound(packed, key, key_len, 0);
+    if (off >= packed->size) return -1;
+
+    const char *name;
+    size_t name_len;
+    packed_line(packed, off, &name, &name_len, hash);
+    return name && compare_name(name, name_len, key, key_len, 0) == 0 ? 0 : -1;
+}
+
+static int packed_read(const char *name, hash_t *hash) {
+    packed_refs_t packed;
+    if (packed_open(&packed) < 0) return -1;
+    int ret = packed_lookup(&packed, name, hash);
+    packed_close(&packed);
+    return ret;
+}
+
+/* Add the packed refs whose names start with prefix */
+static int packed_collect(const char *prefix, ref_list_t *list) {
+    packed_refs_t packed;
+    if (packed_open(&packed) < 0) return -1;
+
+    size_t prefix_len = strlen(prefix);
+    int ret = 0;
+    size_t off = packed_lower_bound(&packed, prefix, prefix_len, 1);
+    while (ret == 0 && off < packed.size) {
+        const char *name;
+        size_t name_len;
+        hash_t hash;
+        off = packed_line(&packed, off, &name, &name_len, &hash);
+        if (!name) continue;
+        if (compare_name(name, name_len, prefix, prefix_len, 1) != 0) break;
+        if (prefix_len && name_len > prefix_len && name[prefix_len] != '/') continue;
+        ret = ref_list_add(list, name, name_len, &hash);
+    }
+    packed_close(&packed);
+    return ret;
+}
+
+/* Write refs (sorted) as the new packed-refs through its lock file, which
+ * this releases either way */
+static int packed_write(const ref_list_t *refs) {
+    const char *lock_path = FIT_PACKED_REFS_FILE LOCK_SUFFIX;
+    FILE *f = fopen(lock_path, "w");
+    if (!f) return -1;
+
+    int ok = fputs(PACKED_REFS_HEADER, f) >= 0;
+    for (size_t i = 0; ok && i < refs->count; i++) {
+        char hex[HASH_HEX_SIZE + 1];
+        hash_to_hex(&refs->items[i].hash, hex);
+        ok = fprintf(f, "%s %s\n", hex, refs->items[i].name) > 0;
+    }
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(lock_path, FIT_PACKED_REFS_FILE) < 0) {
+        unlink(lock_path);
+        return -1;
+    }
+    return 0;
+}
+
+static int lock_packed_refs(void) {
+    int fd = open(FIT_PACKED_REFS_FILE LOCK_SUFFIX, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to lock %s: %s\n", FIT_PACKED_REFS_FILE, strerror(errno));
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Loose refs */
+
+static int loose_read(const char *name, hash_t *hash) {
     char path[512];
     snprintf(path, sizeof(path), "%s/%s", FIT_REFS_DIR, name);
     
@@ -21,27 +257,19 @@ int ref_read(const char *name, hash_t *hash) {
     return hex_to_hash(hex, hash);
 }
 
+int ref_read(const char *name, hash_t *hash) {
+    if (loose_read(name, hash) == 0) return 0;
+    if (reftable_enabled()) return reftable_read(name, hash);
+    return packed_read(name, hash);
+}
+
 int ref_write(const char *name, const hash_t *hash) {
-    char path[512];
-    snprintf(path, sizeof(path), "%s/%s", FIT_REFS_DIR, name);
-    
-    char dir[512];
-    strncpy(dir, path, sizeof(dir));
-    char *last_slash = strrchr(dir, '/');
-    if (last_slash) {
-        *last_slash = '\0';
-        mkdirp(dir);
-    }
-    
-    FILE *f = fopen(path, "w");
-    if (!f) return -1;
-    
-    char hex[HASH_HEX_SIZE + 1];
-    hash_to_hex(hash, hex);
-    fprintf(f, "%s\n", hex);
-    
-    fclose(f);
-    return 0;
+    ref_transaction_t *tx = ref_transaction_begin();
+    if (!tx) return -1;
+    int ret = ref_transaction_update(tx, name, NULL, hash);
+    if (ret == 0) ret = ref_transaction_commit(tx);
+    ref_transaction_free(tx);
+    return ret;
 }
 
 char* ref_current_branch(void) {
@@ -77,22 +305,8 @@ int ref_resolve_head(hash_t *hash) {
     fclose(f);
     line[strcspn(line, "\n")] = 0;
     
-    if (strncmp(line, "ref: ", 5) == 0) {
-        char ref_path[512];
-        snprintf(ref_path, sizeof(ref_path), "%s/%s", FIT_DIR, line + 5);
-        
-        f = fopen(ref_path, "r");
-        if (!f) return -1;
-        
-        char hex[HASH_HEX_SIZE + 1];
-        if (!fgets(hex, sizeof(hex), f)) {
-            fclose(f);
-            return -1;
-        }
-        fclose(f);
-        
-        hex[strcspn(hex, "\n")] = 0;
-        return hex_to_hash(hex, hash);
+    if (strncmp(line, "ref: refs/", 10) == 0) {
+        return ref_read(line + 10, hash);
     }
     
     return hex_to_hash(line, hash);
@@ -119,11 +333,464 @@ int ref_update_head(const hash_t *hash) {
 }
 
 int ref_delete(const char *name) {
+    hash_t current;
+    if (ref_read(name, &current) < 0) return -1;
+
+    hash_t null_hash = {0};
+    ref_transaction_t *tx = ref_transaction_begin();
+    if (!tx) return -1;
+    int ret = ref_transaction_update(tx, name, NULL, &null_hash);
+    if (ret == 0) ret = ref_transaction_commit(tx);
+    ref_transaction_free(tx);
+    return ret;
+}
+
+/* Transactions */
+
+ref_transaction_t *ref_transaction_begin(void) {
+    return calloc(1, sizeof(ref_transaction_t));
+}
+
+/* Queue setting name to new_hash (a null hash deletes it). With old_hash,
+ * the update only happens if the ref still has that value (null: absent). */
+int ref_transaction_update(ref_transaction_t *tx, const char *name, const hash_t *old_hash,
+                           const hash_t *new_hash) {
+    size_t len = strlen(name);
+    if (len == 0 || name[0] == '/' || strstr(name, "..") ||
+        (len >= strlen(LOCK_SUFFIX) && strcmp(name + len - strlen(LOCK_SUFFIX), LOCK_SUFFIX) == 0)) {
+        fprintf(stderr, "Invalid ref name '%s'\n", name);
+        return -1;
+    }
+
+    if (tx->count >= tx->capacity) {
+        size_t capacity = tx->capacity ? tx->capacity * 2 : 8;
+        ref_update_t *updates = realloc(tx->updates, capacity * sizeof(ref_update_t));
+        if (!updates) return -1;
+        tx->updates = updates;
+        tx->capacity = capacity;
+    }
+
+    ref_update_t *update = &tx->updates[tx->count];
+    memset(update, 0, sizeof(*update));
+    if (!(update->name = strdup(name))) return -1;
+    update->new_hash = *new_hash;
+    if (old_hash) {
+        update->old_hash = *old_hash;
+        update->check_old = 1;
+    }
+    tx->count++;
+    return 0;
+}
+
+static void ref_path(const char *name, const char *suffix, char *path, size_t size) {
+    snprintf(path, size, "%s/%s%s", FIT_REFS_DIR, name, suffix);
+}
+
+static int lock_ref(ref_update_t *update) {
     char path[512];
-    snprintf(path, sizeof(path), "%s/%s", FIT_REFS_DIR, name);
+    ref_path(update->name, LOCK_SUFFIX, path, sizeof(path));
+
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    mkdirp(path);
+    *slash = '/';
 
-    if (remove(path) < 0) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to lock ref '%s': %s\n", update->name, strerror(errno));
+        return -1;
+    }
+    update->locked = 1;
+
+    int ok = 1;
+    if (!hash_is_null(&update->new_hash)) {
+        char line[HASH_HEX_SIZE + 2];
+        hash_to_hex(&update->new_hash, line);
+        line[HASH_HEX_SIZE] = '\n';
+        ok = write(fd, line, sizeof(line) - 1) == (ssize_t)(sizeof(line) - 1) && fsync(fd) == 0;
+    }
+    if (close(fd) != 0 || !ok) {
+        fprintf(stderr, "Failed to write ref '%s'\n", update->name);
         return -1;
     }
     return 0;
 }
+
+static void unlock_refs(ref_transaction_t *tx) {
+    for (size_t i = 0; i < tx->count; i++) {
+        if (!tx->updates[i].locked) continue;
+        char path[512];
+        ref_path(tx->updates[i].name, LOCK_SUFFIX, path, sizeof(path));
+        unlink(path);
+        tx->updates[i].locked = 0;
+    }
+}
+
+static int compare_updates(const void *a, const void *b) {
+    return strcmp(((const ref_update_t *)a)->name, ((const ref_update_t *)b)->name);
+}
+
+/* Drop deleted refs from packed-refs; the caller holds its lock, which
+ * this releases */
+static int packed_remove(ref_transaction_t *tx) {
+    ref_list_t packed = {0};
+    if (packed_collect("", &packed) < 0) {
+        ref_list_free(&packed);
+        unlink(FIT_PACKED_REFS_FILE LOCK_SUFFIX);
+        return -1;
+    }
+
+    size_t kept = 0;
+    int changed = 0;
+    for (size_t i = 0; i < packed.count; i++) {
+        ref_update_t key = { .name = packed.items[i].name };
+        ref_update_t *update = bsearch(&key, tx->updates, tx->count, sizeof(ref_update_t),
+                                       compare_updates);
+        if (update && hash_is_null(&update->new_hash)) {
+            free(packed.items[i].name);
+            changed = 1;
+        } else {
+            packed.items[kept++] = packed.items[i];
+        }
+    }
+    packed.count = kept;
+
+    int ret = 0;
+    if (changed) {
+        ret = packed_write(&packed);
+    } else {
+        unlink(FIT_PACKED_REFS_FILE LOCK_SUFFIX);
+    }
+    ref_list_free(&packed);
+    return ret;
+}
+
+/* Write the updates as one reftable; the stack lock covers every ref */
+static int reftable_commit(ref_transaction_t *tx) {
+    if (reftable_lock() < 0) return -1;
+
+    ref_change_t *changes = calloc(tx->count ? tx->count : 1, sizeof(ref_change_t));
+    if (!changes) {
+        reftable_unlock();
+        return -1;
+    }
+    for (size_t i = 0; i < tx->count; i++) {
+        ref_update_t *update = &tx->updates[i];
+        changes[i].name = update->name;
+        changes[i].new_hash = update->new_hash;
+        ref_read(update->name, &changes[i].old_hash);
+        if (update->check_old && !hash_equal(&changes[i].old_hash, &update->old_hash)) {
+            fprintf(stderr, "Ref '%s' changed concurrently\n", update->name);
+            reftable_unlock();
+            free(changes);
+            return -1;
+        }
+    }
+    int ret = reftable_write(changes, tx->count);
+    free(changes);
+
+    // A loose file would still override the new value
+    for (size_t i = 0; ret == 0 && i < tx->count; i++) {
+        char path[512];
+        ref_path(tx->updates[i].name, "", path, sizeof(path));
+        if (unlink(path) < 0 && errno != ENOENT) ret = -1;
+    }
+    return ret;
+}
+
+/* Apply every queued update, or none if a lock or old value check fails */
+int ref_transaction_commit(ref_transaction_t *tx) {
+    qsort(tx->updates, tx->count, sizeof(ref_update_t), compare_updates);
+    for (size_t i = 1; i < tx->count; i++) {
+        if (strcmp(tx->updates[i - 1].name, tx->updates[i].name) == 0) {
+            fprintf(stderr, "Ref '%s' updated twice in one transaction\n", tx->updates[i].name);
+            return -1;
+        }
+    }
+    if (reftable_enabled()) return reftable_commit(tx);
+
+    int deletes = 0;
+    for (size_t i = 0; i < tx->count; i++) {
+        ref_update_t *update = &tx->updates[i];
+        if (lock_ref(update) < 0) goto fail;
+
+        if (update->check_old) {
+            hash_t current = {0};
+            ref_read(update->name, &current);
+            if (!hash_equal(&current, &update->old_hash)) {
+                fprintf(stderr, "Ref '%s' changed concurrently\n", update->name);
+                goto fail;
+            }
+        }
+        if (hash_is_null(&update->new_hash)) deletes = 1;
+    }
+
+    // A packed value must go before the loose file, or it would show again
+    if (deletes) {
+        if (lock_packed_refs() < 0) goto fail;
+        if (packed_remove(tx) < 0) {
+            fprintf(stderr, "Failed to rewrite %s\n", FIT_PACKED_REFS_FILE);
+            goto fail;
+        }
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < tx->count; i++) {
+        ref_update_t *update = &tx->updates[i];
+        char path[512], lock_path[512];
+        ref_path(update->name, "", path, sizeof(path));
+        ref_path(update->name, LOCK_SUFFIX, lock_path, sizeof(lock_path));
+
+        if (hash_is_null(&update->new_hash)) {
+            if (unlink(path) < 0 && errno != ENOENT) ret = -1;
+            unlink(lock_path);
+        } else if (rename(lock_path, path) < 0) {
+            fprintf(stderr, "Failed to update ref '%s': %s\n", update->name, strerror(errno));
+            unlink(lock_path);
+            ret = -1;
+        }
+        update->locked = 0;
+    }
+    return ret;
+
+fail:
+    unlock_refs(tx);
+    return -1;
+}
+
+void ref_transaction_free(ref_transaction_t *tx) {
+    if (!tx) return;
+    unlock_refs(tx);
+    for (size_t i = 0; i < tx->count; i++) free(tx->updates[i].name);
+    free(tx->updates);
+    free(tx);
+}
+
+/* Listing */
+
+static int is_lock_file(const char *name) {
+    size_t len = strlen(name), suffix = strlen(LOCK_SUFFIX);
+    return len > suffix && strcmp(name + len - suffix, LOCK_SUFFIX) == 0;
+}
+
+static int collect_refs(const char *name, ref_list_t *list) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", FIT_REFS_DIR, name);
+
+    DIR *d = opendir(path);
+    if (!d) return 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(d))) {
+        if (entry->d_name[0] == '.' || is_lock_file(entry->d_name)) continue;
+
+        char child[512];
+        snprintf(child, sizeof(child), "%s%s%s", name, name[0] ? "/" : "", entry->d_name);
+
+        char child_path[1024];
+        snprintf(child_path, sizeof(child_path), "%s/%s", FIT_REFS_DIR, child);
+        struct stat st;
+        if (stat(child_path, &st) < 0) continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            collect_refs(child, list);
+            continue;
+        }
+
+        hash_t hash;
+        if (loose_read(child, &hash) < 0) continue;
+
+        if (ref_list_add(list, child, strlen(child), &hash) < 0) {
+            closedir(d);
+            return -1;
+        }
+    }
+
+    closedir(d);
+    return 0;
+}
+
+static int compare_refs(const void *a, const void *b) {
+    return strcmp(((const ref_item_t*)a)->name, ((const ref_item_t*)b)->name);
+}
+
+static int add_table_ref(const char *name, const hash_t *hash, void *data) {
+    return ref_list_add(data, name, strlen(name), hash);
+}
+
+/* Loose and packed (or reftable) refs under prefix, sorted, loose values
+ * winning */
+static int collect_all(const char *prefix, ref_list_t *list) {
+    ref_list_t loose = {0}, packed = {0};
+    int ret = collect_refs(prefix, &loose);
+    if (ret == 0) {
+        ret = reftable_enabled() ? reftable_for_each(prefix, add_table_ref, &packed)
+                                 : packed_collect(prefix, &packed);
+    }
+    if (ret < 0) {
+        ref_list_free(&loose);
+        ref_list_free(&packed);
+        return -1;
+    }
+    qsort(loose.items, loose.count, sizeof(ref_item_t), compare_refs);
+
+    // Both are sorted: merge them, taking ownership of the names
+    size_t i = 0, j = 0;
+    while (ret == 0 && (i < loose.count || j < packed.count)) {
+        int cmp = i == loose.count ? 1 : j == packed.count ? -1
+                : strcmp(loose.items[i].name, packed.items[j].name);
+        ref_item_t *item = cmp <= 0 ? &loose.items[i++] : &packed.items[j++];
+        if (cmp == 0) free(packed.items[j++].name);
+
+        if (list->count >= list->capacity) {
+            size_t capacity = list->capacity ? list->capacity * 2 : 64;
+            ref_item_t *items = realloc(list->items, capacity * sizeof(ref_item_t));
+            if (!items) {
+                free(item->name);
+                ret = -1;
+                break;
+            }
+            list->items = items;
+            list->capacity = capacity;
+        }
+        list->items[list->count++] = *item;
+    }
+    for (; i < loose.count; i++) free(loose.items[i].name);
+    for (; j < packed.count; j++) free(packed.items[j].name);
+    free(loose.items);
+    free(packed.items);
+    return ret;
+}
+
+/* Call fn for every ref under refs/<prefix> (e.g. "heads"), sorted by name.
+ * Returns the number of refs visited or -1 on error. */
+int ref_for_each(const char *prefix, ref_each_fn fn, void *data) {
+    ref_list_t list = {0};
+    int ret = collect_all(prefix ? prefix : "", &list);
+
+    if (ret == 0) {
+        for (size_t i = 0; i < list.count; i++) {
+            ret++;
+            if (fn(list.items[i].name, &list.items[i].hash, data) != 0) break;
+        }
+    }
+
+    ref_list_free(&list);
+    return ret;
+}
+
+/* Whether a loose ref file holds just the hash (tags may carry a message) */
+static int loose_is_plain(const char *name) {
+    char path[512];
+    ref_path(name, "", path, sizeof(path));
+    struct stat st;
+    return stat(path, &st) == 0 && st.st_size == HASH_HEX_SIZE + 1;
+}
+
+/* Remove the plain loose refs that still hold the value they were packed
+ * with, each under its lock; returns how many went */
+static size_t prune_loose(const ref_list_t *loose) {
+    size_t pruned = 0;
+    for (size_t i = 0; i < loose->count; i++) {
+        ref_update_t update = { .name = loose->items[i].name };
+        if (!loose_is_plain(update.name)) continue;
+        if (lock_ref(&update) < 0) continue;
+
+        char path[512], lock_path[512];
+        ref_path(update.name, "", path, sizeof(path));
+        ref_path(update.name, LOCK_SUFFIX, lock_path, sizeof(lock_path));
+        hash_t current;
+        if (loose_read(update.name, &current) == 0 && hash_equal(&current, &loose->items[i].hash) &&
+            unlink(path) == 0) {
+            pruned++;
+        }
+        unlink(lock_path);
+    }
+    return pruned;
+}
+
+/* Write refs (plain loose refs, or with all set every ref) into a new
+ * reftable, then prune the loose files */
+static int reftable_pack(int all) {
+    if (reftable_lock() < 0) return -1;
+
+    ref_list_t refs = {0}, loose = {0};
+    int ret = collect_refs("", &loose);
+    if (ret == 0) ret = all ? collect_all("", &refs) : collect_refs("", &refs);
+
+    ref_change_t *changes = calloc(refs.count ? refs.count : 1, sizeof(ref_change_t));
+    size_t count = 0;
+    for (size_t i = 0; ret == 0 && changes && i < refs.count; i++) {
+        if (!loose_is_plain(refs.items[i].name)) {
+            hash_t hash;
+            if (loose_read(refs.items[i].name, &hash) == 0) continue;  // Tags with a message
+        }
+        ref_change_t *change = &changes[count++];
+        change->name = refs.items[i].name;
+        change->new_hash = refs.items[i].hash;
+        if (!all) reftable_read(change->name, &change->old_hash);
+    }
+    if (!changes) ret = -1;
+
+    if (ret < 0 || (count == 0 && !all)) {
+        reftable_unlock();
+    } else if ((ret = reftable_write(changes, count)) < 0) {
+        fprintf(stderr, "Failed to write reftable\n");
+    }
+    free(changes);
+
+    if (ret == 0 && all) {
+        // The new stack holds every packed ref; packed-refs would only mislead
+        if (lock_packed_refs() == 0) {
+            unlink(FIT_PACKED_REFS_FILE);
+            unlink(FIT_PACKED_REFS_FILE LOCK_SUFFIX);
+        }
+    }
+    if (ret == 0) ret = reftable_compact(1);
+    if (ret == 0) printf("Packed %zu refs into reftable\n", prune_loose(&loose));
+    ref_list_free(&refs);
+    ref_list_free(&loose);
+    return ret;
+}
+
+/* Convert to reftable storage, carrying over every ref */
+int ref_convert_reftable(void) {
+    if (reftable_enabled()) return reftable_pack(0);
+    return reftable_pack(1);
+}
+
+/* Move every plain loose ref into packed-refs (or the reftable). Each loose
+ * file is removed under its lock, and only if it still holds the value that
+ * was packed. */
+int ref_pack(void) {
+    if (reftable_enabled()) return reftable_pack(0);
+    if (lock_packed_refs() < 0) return -1;
+
+    ref_list_t all = {0}, loose = {0};
+    int ret = collect_all("", &all);
+    if (ret == 0) ret = collect_refs("", &loose);
+
+    // Refs with extra content stay loose only
+    size_t kept = 0;
+    for (size_t i = 0; ret == 0 && i < all.count; i++) {
+        hash_t packed_hash;
+        if (!loose_is_plain(all.items[i].name) && loose_read(all.items[i].name, &packed_hash) == 0) {
+            free(all.items[i].name);
+        } else {
+            all.items[kept++] = all.items[i];
+        }
+    }
+    all.count = kept;
+
+    if (ret < 0) {
+        unlink(FIT_PACKED_REFS_FILE LOCK_SUFFIX);
+    } else if (packed_write(&all) < 0) {
+        fprintf(stderr, "Failed to write %s\n", FIT_PACKED_REFS_FILE);
+        ret = -1;
+    }
+
+    if (ret == 0) printf("Packed %zu refs\n", prune_loose(&loose));
+    ref_list_free(&all);
+    ref_list_free(&loose);
+    return ret;
+}
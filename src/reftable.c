@@ -0,0 +1,925 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fit.h"
+
+/*
+ * Reftable ref storage, for repositories with very many refs. Refs live in
+ * a stack of immutable tables listed, oldest first, in .fit/reftable/
+ * tables.list. A transaction writes one new table holding just its changes
+ * and appends it to the list; a ref's value is the one in the newest table
+ * that mentions it, and a deletion is stored as a tombstone. Small tables
+ * are merged into their larger neighbours as the stack grows, keeping it
+ * logarithmic in the number of transactions.
+ *
+ * A table is
+ *
+ *   header  "FRT1" [VERSION:4] [BLOCK_SIZE:4] [MIN_INDEX:8] [MAX_INDEX:8]
+ *   ref blocks, sorted by name
+ *   index block: last name of each ref block and its offset
+ *   log blocks: one record per update, newest first for each name
+ *   footer  [INDEX_OFFSET:8] [LOG_OFFSET:8] [REF_COUNT:8] "FRT1"
+ *
+ * and a block is [TYPE:1] [LEN:4], records, then [OFFSET:4] per restart
+ * point and [RESTARTS:2]. Records store only the suffix of their key that
+ * differs from the previous record, except at restart points (every 16th
+ * record) where the key is written in full. A lookup binary-searches the
+ * index block's restart points, then one ref block's, and scans at most 16
+ * records; prefix iteration starts the same way and reads only the blocks
+ * it covers. Tables are mapped, so neither touches the rest of the file.
+ */
+
+#define FIT_REFTABLE_DIR ".fit/reftable"
+#define FIT_REFTABLE_LIST ".fit/reftable/tables.list"
+#define REFTABLE_LOCK FIT_REFTABLE_LIST ".lock"
+#define REFTABLE_MAGIC "FRT1"
+#define REFTABLE_VERSION 1
+#define REFTABLE_HEADER_SIZE 28
+#define REFTABLE_FOOTER_SIZE 28
+#define REFTABLE_BLOCK_SIZE 4096
+#define REFTABLE_RESTART_INTERVAL 16
+#define REFTABLE_MAX_KEY 1024
+#define REFTABLE_OPEN_ATTEMPTS 5
+
+#define BLOCK_REF 'r'
+#define BLOCK_INDEX 'i'
+#define BLOCK_LOG 'g'
+#define BLOCK_HEADER_SIZE 5
+
+// Record value types
+#define VALUE_DELETION 0
+#define VALUE_HASH 1
+#define VALUE_INDEX 2
+#define VALUE_LOG 3
+
+typedef struct {
+    char *path;
+    const unsigned char *data;
+    size_t size;
+    uint64_t min_index, max_index;
+    uint64_t index_offset, log_offset;
+} table_t;
+
+typedef struct {
+    table_t *tables;
+    size_t count;
+} table_stack_t;
+
+// A record in memory: a ref (hash or tombstone) or a log entry
+typedef struct {
+    unsigned char *key;
+    size_t key_len;
+    int type;
+    uint64_t update_index;
+    hash_t hash;                // Ref value, or the log's new value
+    hash_t old_hash;            // Log only
+    uint64_t time;              // Log only
+    uint64_t offset;            // Index only: the block this key ends
+    size_t rank;                // Position of the source table in the stack
+} record_t;
+
+typedef struct {
+    record_t *items;
+    size_t count;
+    size_t capacity;
+} record_list_t;
+
+// Position in a block while decoding records
+typedef struct {
+    const table_t *table;
+    size_t block;               // Offset of the block
+    size_t end;                 // End of its records
+    size_t pos;
+    unsigned char key[REFTABLE_MAX_KEY];
+    size_t key_len;
+    int type;
+    uint64_t update_index;
+    const unsigned char *value;
+} cursor_t;
+
+/* Encoding helpers */
+
+static size_t put_varint(unsigned char *p, uint64_t v) {
+    size_t n = 0;
+    do {
+        p[n] = v & 0x7f;
+        v >>= 7;
+        if (v) p[n] |= 0x80;
+        n++;
+    } while (v);
+    return n;
+}
+
+/* Returns bytes read, 0 if the varint runs past end */
+static size_t get_varint(const unsigned char *p, const unsigned char *end, uint64_t *v) {
+    *v = 0;
+    for (size_t n = 0; p + n < end && n < 10; n++) {
+        *v |= (uint64_t)(p[n] & 0x7f) << (7 * n);
+        if (!(p[n] & 0x80)) return n + 1;
+    }
+    return 0;
+}
+
+static int compare_keys(const unsigned char *a, size_t a_len, const unsigned char *b, size_t b_len) {
+    int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (cmp != 0) return cmp;
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+/* Log keys sort by name, then newest update first */
+static size_t log_key(const char *name, uint64_t update_index, unsigned char *key) {
+    size_t len = strlen(name);
+    memcpy(key, name, len);
+    key[len] = '\0';
+    put_be(key + len + 1, ~update_index, 8);
+    return len + 9;
+}
+
+/* Reading */
+
+static int table_open(const char *name, table_t *table) {
+    memset(table, 0, sizeof(*table));
+    if (asprintf(&table->path, "%s/%s", FIT_REFTABLE_DIR, name) < 0) {
+        table->path = NULL;
+        return -1;
+    }
+
+    int fd = open(table->path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < REFTABLE_HEADER_SIZE + REFTABLE_FOOTER_SIZE) {
+        close(fd);
+        return -1;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+    table->data = data;
+    table->size = st.st_size;
+
+    const unsigned char *footer = table->data + table->size - REFTABLE_FOOTER_SIZE;
+    if (memcmp(table->data, REFTABLE_MAGIC, 4) != 0 || memcmp(footer + 24, REFTABLE_MAGIC, 4) != 0 ||
+        get_be(table->data + 4, 4) != REFTABLE_VERSION) {
+        fprintf(stderr, "Corrupt reftable %s\n", table->path);
+        return -1;
+    }
+    table->min_index = get_be(table->data + 12, 8);
+    table->max_index = get_be(table->data + 20, 8);
+    table->index_offset = get_be(footer, 8);
+    table->log_offset = get_be(footer + 8, 8);
+    if (table->index_offset < REFTABLE_HEADER_SIZE || table->log_offset < table->index_offset ||
+        table->log_offset > table->size - REFTABLE_FOOTER_SIZE) {
+        fprintf(stderr, "Corrupt reftable %s\n", table->path);
+        return -1;
+    }
+    return 0;
+}
+
+static void table_close(table_t *table) {
+    if (table->data) munmap((void *)table->data, table->size);
+    free(table->path);
+    memset(table, 0, sizeof(*table));
+}
+
+static void stack_close(table_stack_t *stack) {
+    for (size_t i = 0; i < stack->count; i++) table_close(&stack->tables[i]);
+    free(stack->tables);
+    stack->tables = NULL;
+    stack->count = 0;
+}
+
+/* Read tables.list and map every table. A compaction may delete tables
+ * between reading the list and opening them, so retry with a fresh list. */
+static int stack_open(table_stack_t *stack) {
+    stack->tables = NULL;
+    stack->count = 0;
+
+    for (int attempt = 0; attempt < REFTABLE_OPEN_ATTEMPTS; attempt++) {
+        FILE *f = fopen(FIT_REFTABLE_LIST, "r");
+        if (!f) return -1;
+
+        size_t capacity = 0;
+        int ok = 1;
+        char line[256];
+        while (ok && fgets(line, sizeof(line), f)) {
+            line[strcspn(line, "\n")] = '\0';
+            if (!line[0]) continue;
+            if (stack->count == capacity) {
+                capacity = capacity ? capacity * 2 : 8;
+                table_t *tables = realloc(stack->tables, capacity * sizeof(table_t));
+                if (!tables) {
+                    ok = 0;
+                    break;
+                }
+                stack->tables = tables;
+            }
+            ok = table_open(line, &stack->tables[stack->count]) == 0;
+            stack->count++;
+        }
+        fclose(f);
+        if (ok) return 0;
+        stack_close(stack);
+    }
+    fprintf(stderr, "Failed to open reftable stack\n");
+    return -1;
+}
+
+/* Start decoding the block at offset; returns -1 if it is not a valid block
+ * of the given type */
+static int cursor_init(cursor_t *c, const table_t *table, size_t offset, int type) {
+    memset(c, 0, sizeof(*c));
+    c->table = table;
+    if (offset + BLOCK_HEADER_SIZE + 2 > table->size || table->data[offset] != type) return -1;
+
+    size_t len = get_be(table->data + offset + 1, 4);
+    if (len < BLOCK_HEADER_SIZE + 2 || offset + len > table->size) return -1;
+    const unsigned char *block = table->data + offset;
+    size_t restarts = get_be(block + len - 2, 2);
+    if (BLOCK_HEADER_SIZE + restarts * 4 + 2 > len) return -1;
+
+    c->block = offset;
+    c->end = offset + len - 2 - restarts * 4;
+    c->pos = offset + BLOCK_HEADER_SIZE;
+    return 0;
+}
+
+static size_t block_len(const cursor_t *c) {
+    return get_be(c->table->data + c->block + 1, 4);
+}
+
+static size_t restart_count(const cursor_t *c) {
+    return get_be(c->table->data + c->block + block_len(c) - 2, 2);
+}
+
+static size_t restart_offset(const cursor_t *c, size_t i) {
+    return c->block + get_be(c->table->data + c->end + i * 4, 4);
+}
+
+/* Decode the record at c->pos; returns 1 on success, 0 at the end of the
+ * block, -1 if it is malformed */
+static int cursor_next(cursor_t *c) {
+    if (c->pos >= c->end) return 0;
+    const unsigned char *p = c->table->data + c->pos;
+    const unsigned char *end = c->table->data + c->end;
+
+    uint64_t prefix, suffix_type, index;
+    size_t n;
+    if (!(n = get_varint(p, end, &prefix))) return -1;
+    p += n;
+    if (!(n = get_varint(p, end, &suffix_type))) return -1;
+    p += n;
+    uint64_t suffix = suffix_type >> 3;
+    if (prefix > c->key_len || prefix + suffix > REFTABLE_MAX_KEY || p + suffix > end) return -1;
+    memcpy(c->key + prefix, p, suffix);
+    c->key_len = prefix + suffix;
+    p += suffix;
+    c->type = suffix_type & 7;
+
+    if (!(n = get_varint(p, end, &index))) return -1;
+    p += n;
+    c->update_index = c->table->min_index + index;
+    c->value = p;
+
+    switch (c->type) {
+    case VALUE_DELETION:
+        break;
+    case VALUE_HASH:
+        p += HASH_SIZE;
+        break;
+    case VALUE_INDEX:
+        if (!(n = get_varint(p, end, &index))) return -1;
+        p += n;
+        break;
+    case VALUE_LOG:
+        p += 2 * HASH_SIZE;
+        if (p > end || !(n = get_varint(p, end, &index))) return -1;
+        p += n;
+        break;
+    default:
+        return -1;
+    }
+    if (p > end) return -1;
+    c->pos = p - c->table->data;
+    return 1;
+}
+
+/* Decode records up to the first whose key is not less than key, leaving
+ * it current; returns 1 if there is one in this block, 0 if not, -1 on
+ * corruption */
+static int cursor_seek(cursor_t *c, const unsigned char *key, size_t key_len) {
+    // Restart points hold full keys: find the last one not greater than key
+    size_t lo = 0, hi = restart_count(c);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        c->pos = restart_offset(c, mid);
+        c->key_len = 0;
+        if (cursor_next(c) <= 0) return -1;
+        if (compare_keys(c->key, c->key_len, key, key_len) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    c->pos = lo > 0 ? restart_offset(c, lo - 1) : c->block + BLOCK_HEADER_SIZE;
+    c->key_len = 0;
+
+    int ret;
+    while ((ret = cursor_next(c)) == 1) {
+        if (compare_keys(c->key, c->key_len, key, key_len) >= 0) return 1;
+    }
+    return ret;
+}
+
+/* End of the section a block of this type belongs to */
+static size_t section_end(const table_t *table, int type) {
+    if (type == BLOCK_REF) return table->index_offset;
+    return table->size - REFTABLE_FOOTER_SIZE;
+}
+
+/* Like cursor_next, but carries on into the section's next block */
+static int cursor_advance(cursor_t *c, int type) {
+    int ret = cursor_next(c);
+    if (ret != 0) return ret;
+
+    size_t next = c->block + block_len(c);
+    if (next >= section_end(c->table, type)) return 0;
+    const table_t *table = c->table;
+    if (cursor_init(c, table, next, type) < 0) return -1;
+    return cursor_next(c);
+}
+
+/* Leave c on the first ref record not less than key; 1 if found, 0 past
+ * the end of the table, -1 on corruption */
+static int table_seek(const table_t *table, const unsigned char *key, size_t key_len, cursor_t *c) {
+    if (table->index_offset == REFTABLE_HEADER_SIZE) return 0;  // No refs
+
+    // The index maps the last key of each ref block to the block
+    if (cursor_init(c, table, table->index_offset, BLOCK_INDEX) < 0) return -1;
+    int ret = cursor_seek(c, key, key_len);
+    if (ret <= 0) return ret;
+
+    uint64_t offset;
+    const unsigned char *end = table->data + c->end;
+    if (!get_varint(c->value, end, &offset)) return -1;
+    if (cursor_init(c, table, offset, BLOCK_REF) < 0) return -1;
+    return cursor_seek(c, key, key_len);
+}
+
+static void report_corrupt(const table_t *table) {
+    fprintf(stderr, "Corrupt reftable %s\n", table->path);
+}
+
+int reftable_enabled(void) {
+    return access(FIT_REFTABLE_LIST, F_OK) == 0;
+}
+
+int reftable_read(const char *name, hash_t *hash) {
+    table_stack_t stack;
+    if (stack_open(&stack) < 0) return -1;
+
+    size_t len = strlen(name);
+    int ret = -1;
+    for (size_t i = stack.count; i-- > 0;) {
+        cursor_t c;
+        int found = table_seek(&stack.tables[i], (const unsigned char *)name, len, &c);
+        if (found < 0) {
+            report_corrupt(&stack.tables[i]);
+            break;
+        }
+        if (found == 0 || compare_keys(c.key, c.key_len, (const unsigned char *)name, len) != 0) {
+            continue;
+        }
+        // The newest table that mentions the ref decides, even if it deleted it
+        if (c.type == VALUE_HASH) {
+            memcpy(hash->hash, c.value, HASH_SIZE);
+            ret = 0;
+        }
+        break;
+    }
+    stack_close(&stack);
+    return ret;
+}
+
+/* In-memory records */
+
+static int record_add(record_list_t *list, const unsigned char *key, size_t key_len,
+                      const record_t *fields) {
+    if (list->count >= list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 256;
+        record_t *items = realloc(list->items, capacity * sizeof(record_t));
+        if (!items) return -1;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    record_t *r = &list->items[list->count];
+    *r = *fields;
+    if (!(r->key = malloc(key_len + 1))) return -1;
+    memcpy(r->key, key, key_len);
+    r->key[key_len] = '\0';
+    r->key_len = key_len;
+    list->count++;
+    return 0;
+}
+
+static void record_list_free(record_list_t *list) {
+    for (size_t i = 0; i < list->count; i++) free(list->items[i].key);
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+/* Name order, and for the same name the newest table first */
+static int compare_records(const void *a, const void *b) {
+    const record_t *x = a, *y = b;
+    int cmp = compare_keys(x->key, x->key_len, y->key, y->key_len);
+    if (cmp != 0) return cmp;
+    return x->rank < y->rank ? 1 : x->rank > y->rank ? -1 : 0;
+}
+
+static int cursor_record(const cursor_t *c, size_t rank, record_list_t *list) {
+    record_t r = { .type = c->type, .update_index = c->update_index, .rank = rank };
+    if (c->type == VALUE_HASH) {
+        memcpy(r.hash.hash, c->value, HASH_SIZE);
+    } else if (c->type == VALUE_LOG) {
+        memcpy(r.old_hash.hash, c->value, HASH_SIZE);
+        memcpy(r.hash.hash, c->value + HASH_SIZE, HASH_SIZE);
+        get_varint(c->value + 2 * HASH_SIZE, c->table->data + c->end, &r.time);
+    }
+    return record_add(list, c->key, c->key_len, &r);
+}
+
+/* Keep only the newest record for each name; a dropped deletion still
+ * hides the older records behind it */
+static void records_newest(record_list_t *list, int drop_deletions) {
+    qsort(list->items, list->count, sizeof(record_t), compare_records);
+
+    size_t kept = 0, prev_len = 0;
+    unsigned char *prev_key = NULL;
+    int prev_dropped = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        record_t r = list->items[i];
+        int shadowed = prev_key && compare_keys(prev_key, prev_len, r.key, r.key_len) == 0;
+        int keep = !shadowed && !(drop_deletions && r.type == VALUE_DELETION);
+
+        if (prev_dropped) free(prev_key);
+        prev_key = r.key;
+        prev_len = r.key_len;
+        prev_dropped = !keep;
+        if (keep) list->items[kept++] = r;
+    }
+    if (prev_dropped) free(prev_key);
+    list->count = kept;
+}
+
+/* Add every record of one section of a table */
+static int table_scan(const table_t *table, int type, size_t rank, record_list_t *list) {
+    size_t start = type == BLOCK_REF ? REFTABLE_HEADER_SIZE : table->log_offset;
+    if (start >= section_end(table, type)) return 0;
+
+    cursor_t c;
+    if (cursor_init(&c, table, start, type) < 0) return -1;
+    int ret;
+    while ((ret = cursor_advance(&c, type)) == 1) {
+        if (cursor_record(&c, rank, list) < 0) return -1;
+    }
+    return ret;
+}
+
+/* Call fn for every ref under prefix (e.g. "heads"), sorted by name */
+int reftable_for_each(const char *prefix, ref_each_fn fn, void *data) {
+    table_stack_t stack;
+    if (stack_open(&stack) < 0) return -1;
+
+    record_list_t list = {0};
+    size_t prefix_len = strlen(prefix);
+    int ret = 0;
+    for (size_t i = 0; ret == 0 && i < stack.count; i++) {
+        cursor_t c;
+        int found = table_seek(&stack.tables[i], (const unsigned char *)prefix, prefix_len, &c);
+        while (found == 1 && c.key_len >= prefix_len && memcmp(c.key, prefix, prefix_len) == 0) {
+            if (cursor_record(&c, i, &list) < 0) {
+                ret = -1;
+                break;
+            }
+            found = cursor_advance(&c, BLOCK_REF);
+        }
+        if (found < 0) {
+            report_corrupt(&stack.tables[i]);
+            ret = -1;
+        }
+    }
+    stack_close(&stack);
+
+    if (ret == 0) {
+        records_newest(&list, 1);
+        for (size_t i = 0; i < list.count; i++) {
+            const record_t *r = &list.items[i];
+            if (prefix_len && r->key_len > prefix_len && r->key[prefix_len] != '/') continue;
+            if (fn((const char *)r->key, &r->hash, data) != 0) break;
+        }
+    }
+    record_list_free(&list);
+    return ret;
+}
+
+/* Call fn for the logged updates of name (all refs if NULL), by name and
+ * newest first */
+int reftable_log_for_each(const char *name, ref_log_fn fn, void *data) {
+    table_stack_t stack;
+    if (stack_open(&stack) < 0) return -1;
+
+    record_list_t list = {0};
+    int ret = 0;
+    for (size_t i = 0; ret == 0 && i < stack.count; i++) {
+        if (table_scan(&stack.tables[i], BLOCK_LOG, i, &list) < 0) {
+            report_corrupt(&stack.tables[i]);
+            ret = -1;
+        }
+    }
+    stack_close(&stack);
+
+    if (ret == 0) {
+        qsort(list.items, list.count, sizeof(record_t), compare_records);
+        for (size_t i = 0; i < list.count; i++) {
+            const record_t *r = &list.items[i];
+            const char *ref = (const char *)r->key;  // The name ends at the key's NUL
+            if (name && strcmp(ref, name) != 0) continue;
+            if (fn(ref, r->update_index, &r->old_hash, &r->hash, (time_t)r->time, data) != 0) break;
+        }
+    }
+    record_list_free(&list);
+    return ret;
+}
+
+/* Writing */
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t capacity;
+} buffer_t;
+
+static int buffer_append(buffer_t *b, const void *p, size_t n) {
+    if (b->len + n > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : 64 * 1024;
+        while (capacity < b->len + n) capacity *= 2;
+        unsigned char *data = realloc(b->data, capacity);
+        if (!data) return -1;
+        b->data = data;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+    return 0;
+}
+
+typedef struct {
+    buffer_t *out;
+    int type;
+    size_t limit;               // Block size; 0 for one block of any size
+    uint64_t min_index;
+    size_t start;               // Offset of the open block in out
+    int open;
+    uint32_t *restarts;
+    size_t restart_count;
+    size_t restart_capacity;
+    size_t records;
+    unsigned char last_key[REFTABLE_MAX_KEY];
+    size_t last_len;
+    record_list_t *index;       // Collects (last key, offset) per block
+} block_writer_t;
+
+static int block_begin(block_writer_t *w) {
+    unsigned char header[BLOCK_HEADER_SIZE] = { w->type };
+    w->start = w->out->len;
+    w->open = 1;
+    w->restart_count = 0;
+    w->records = 0;
+    w->last_len = 0;
+    return buffer_append(w->out, header, sizeof(header));
+}
+
+static int block_finish(block_writer_t *w) {
+    if (!w->open) return 0;
+    w->open = 0;
+    for (size_t i = 0; i < w->restart_count; i++) {
+        unsigned char offset[4];
+        put_be(offset, w->restarts[i], 4);
+        if (buffer_append(w->out, offset, 4) < 0) return -1;
+    }
+    unsigned char count[2];
+    put_be(count, w->restart_count, 2);
+    if (buffer_append(w->out, count, 2) < 0) return -1;
+    put_be(w->out->data + w->start + 1, w->out->len - w->start, 4);
+
+    if (w->index) {
+        record_t r = { .type = VALUE_INDEX, .offset = w->start };
+        if (record_add(w->index, w->last_key, w->last_len, &r) < 0) return -1;
+    }
+    return 0;
+}
+
+static size_t encode_record(block_writer_t *w, const record_t *r, int restart, unsigned char *buf) {
+    size_t prefix = 0;
+    if (!restart) {
+        while (prefix < w->last_len && prefix < r->key_len && w->last_key[prefix] == r->key[prefix]) {
+            prefix++;
+        }
+    }
+    size_t suffix = r->key_len - prefix;
+    size_t n = put_varint(buf, prefix);
+    n += put_varint(buf + n, (uint64_t)suffix << 3 | r->type);
+    memcpy(buf + n, r->key + prefix, suffix);
+    n += suffix;
+    n += put_varint(buf + n, r->update_index - w->min_index);
+
+    switch (r->type) {
+    case VALUE_HASH:
+        memcpy(buf + n, r->hash.hash, HASH_SIZE);
+        n += HASH_SIZE;
+        break;
+    case VALUE_INDEX:
+        n += put_varint(buf + n, r->offset);
+        break;
+    case VALUE_LOG:
+        memcpy(buf + n, r->old_hash.hash, HASH_SIZE);
+        memcpy(buf + n + HASH_SIZE, r->hash.hash, HASH_SIZE);
+        n += 2 * HASH_SIZE;
+        n += put_varint(buf + n, r->time);
+        break;
+    }
+    return n;
+}
+
+static int block_add(block_writer_t *w, const record_t *r) {
+    unsigned char buf[REFTABLE_MAX_KEY + 3 * 10 + 2 * HASH_SIZE + 10];
+    if (r->key_len > REFTABLE_MAX_KEY) return -1;
+    if (!w->open && block_begin(w) < 0) return -1;
+
+    int restart = w->records % REFTABLE_RESTART_INTERVAL == 0;
+    size_t n = encode_record(w, r, restart, buf);
+    size_t size = w->out->len - w->start + n + (w->restart_count + restart) * 4 + 2;
+    if (w->records > 0 && ((w->limit && size > w->limit) || (restart && w->restart_count == 0xffff))) {
+        if (block_finish(w) < 0 || block_begin(w) < 0) return -1;
+        restart = 1;
+        n = encode_record(w, r, restart, buf);
+    }
+
+    if (restart) {
+        if (w->restart_count == w->restart_capacity) {
+            size_t capacity = w->restart_capacity ? w->restart_capacity * 2 : 64;
+            uint32_t *restarts = realloc(w->restarts, capacity * sizeof(uint32_t));
+            if (!restarts) return -1;
+            w->restarts = restarts;
+            w->restart_capacity = capacity;
+        }
+        w->restarts[w->restart_count++] = w->out->len - w->start;
+    }
+    if (buffer_append(w->out, buf, n) < 0) return -1;
+    memcpy(w->last_key, r->key, r->key_len);
+    w->last_len = r->key_len;
+    w->records++;
+    return 0;
+}
+
+static int write_section(buffer_t *out, int type, size_t limit, uint64_t min_index,
+                         const record_list_t *records, record_list_t *index) {
+    block_writer_t w = { .out = out, .type = type, .limit = limit, .min_index = min_index,
+                         .index = index };
+    int ret = 0;
+    for (size_t i = 0; ret == 0 && i < records->count; i++) {
+        ret = block_add(&w, &records->items[i]);
+    }
+    if (ret == 0) ret = block_finish(&w);
+    free(w.restarts);
+    return ret;
+}
+
+/* Write refs and logs (each sorted) as a new table; name_out receives its
+ * file name */
+static int table_write(const record_list_t *refs, const record_list_t *logs, uint64_t min_index,
+                       uint64_t max_index, char *name_out, size_t name_size) {
+    buffer_t out = {0};
+    record_list_t index = {0};
+    unsigned char header[REFTABLE_HEADER_SIZE], footer[REFTABLE_FOOTER_SIZE];
+
+    memcpy(header, REFTABLE_MAGIC, 4);
+    put_be(header + 4, REFTABLE_VERSION, 4);
+    put_be(header + 8, REFTABLE_BLOCK_SIZE, 4);
+    put_be(header + 12, min_index, 8);
+    put_be(header + 20, max_index, 8);
+
+    int ret = buffer_append(&out, header, sizeof(header));
+    if (ret == 0) ret = write_section(&out, BLOCK_REF, REFTABLE_BLOCK_SIZE, min_index, refs, &index);
+    uint64_t index_offset = out.len;
+    if (ret == 0) ret = write_section(&out, BLOCK_INDEX, 0, min_index, &index, NULL);
+    uint64_t log_offset = out.len;
+    if (ret == 0) ret = write_section(&out, BLOCK_LOG, REFTABLE_BLOCK_SIZE, min_index, logs, NULL);
+    record_list_free(&index);
+
+    put_be(footer, index_offset, 8);
+    put_be(footer + 8, log_offset, 8);
+    put_be(footer + 16, refs->count, 8);
+    memcpy(footer + 24, REFTABLE_MAGIC, 4);
+    if (ret == 0) ret = buffer_append(&out, footer, sizeof(footer));
+
+    char path[512], tmp_path[520];
+    snprintf(name_out, name_size, "%016llx-%016llx.ref",
+             (unsigned long long)min_index, (unsigned long long)max_index);
+    snprintf(path, sizeof(path), "%s/%s", FIT_REFTABLE_DIR, name_out);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    if (ret == 0) {
+        FILE *f = fopen(tmp_path, "wb");
+        int ok = f && fwrite(out.data, 1, out.len, f) == out.len && fflush(f) == 0 &&
+                 fsync(fileno(f)) == 0;
+        if (f && fclose(f) != 0) ok = 0;
+        if (!ok || rename(tmp_path, path) < 0) {
+            unlink(tmp_path);
+            fprintf(stderr, "Failed to write reftable %s\n", path);
+            ret = -1;
+        }
+    }
+    free(out.data);
+    return ret;
+}
+
+/* Stack updates */
+
+static int lock_list(int quiet) {
+    if (mkdirp(FIT_REFTABLE_DIR) != 0) {
+        fprintf(stderr, "Failed to create %s\n", FIT_REFTABLE_DIR);
+        return -1;
+    }
+    int fd = open(REFTABLE_LOCK, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        if (!quiet) fprintf(stderr, "Unable to lock %s: %s\n", FIT_REFTABLE_LIST, strerror(errno));
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Callers hold the lock while they check old values and write */
+int reftable_lock(void) {
+    return lock_list(0);
+}
+
+void reftable_unlock(void) {
+    unlink(REFTABLE_LOCK);
+}
+
+static const char *table_name(const table_t *table) {
+    return strrchr(table->path, '/') + 1;
+}
+
+/* Replace tables.list with the first keep tables of stack plus added, by
+ * renaming the lock file over it; releases the lock either way */
+static int write_list(const table_stack_t *stack, size_t keep, const char *added) {
+    FILE *f = fopen(REFTABLE_LOCK, "w");
+    int ok = f != NULL;
+    for (size_t i = 0; ok && i < keep; i++) {
+        ok = fprintf(f, "%s\n", table_name(&stack->tables[i])) > 0;
+    }
+    if (ok) ok = fprintf(f, "%s\n", added) > 0;
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (f && fclose(f) != 0) ok = 0;
+    if (!ok || rename(REFTABLE_LOCK, FIT_REFTABLE_LIST) < 0) {
+        reftable_unlock();
+        fprintf(stderr, "Failed to update %s\n", FIT_REFTABLE_LIST);
+        return -1;
+    }
+    return 0;
+}
+
+/* Merge tables first..top into one table; the caller holds the lock, which
+ * this releases */
+static int compact_range(table_stack_t *stack, size_t first) {
+    record_list_t refs = {0}, logs = {0};
+    int ret = 0;
+    for (size_t i = first; ret == 0 && i < stack->count; i++) {
+        if (table_scan(&stack->tables[i], BLOCK_REF, i, &refs) < 0 ||
+            table_scan(&stack->tables[i], BLOCK_LOG, i, &logs) < 0) {
+            report_corrupt(&stack->tables[i]);
+            ret = -1;
+        }
+    }
+
+    // Deletions only need to hide older tables, and there are none below the base
+    char name[64];
+    if (ret == 0) {
+        records_newest(&refs, first == 0);
+        qsort(logs.items, logs.count, sizeof(record_t), compare_records);
+        ret = table_write(&refs, &logs, stack->tables[first].min_index,
+                          stack->tables[stack->count - 1].max_index, name, sizeof(name));
+    }
+    record_list_free(&refs);
+    record_list_free(&logs);
+    if (ret < 0) {
+        reftable_unlock();
+        return -1;
+    }
+    if (write_list(stack, first, name) < 0) return -1;
+
+    for (size_t i = first; i < stack->count; i++) {
+        if (strcmp(table_name(&stack->tables[i]), name) != 0) unlink(stack->tables[i].path);
+    }
+    return 0;
+}
+
+/* Merge tables so that each is more than twice the size of all above it,
+ * or (full) everything into one. Automatic compaction gives way to a
+ * concurrent writer. */
+int reftable_compact(int full) {
+    if (!reftable_enabled()) return 0;
+    if (lock_list(!full) < 0) return full ? -1 : 0;
+
+    table_stack_t stack;
+    if (stack_open(&stack) < 0) {
+        reftable_unlock();
+        return -1;
+    }
+
+    size_t first = 0;
+    if (!full && stack.count > 0) {
+        size_t above = stack.tables[stack.count - 1].size;
+        for (first = stack.count - 1; first > 0 && stack.tables[first - 1].size <= 2 * above; first--) {
+            above += stack.tables[first - 1].size;
+        }
+    }
+
+    int ret = 0;
+    if (stack.count - first >= 2 || (full && stack.count == 1)) {
+        ret = compact_range(&stack, first);
+    } else {
+        reftable_unlock();
+    }
+    stack_close(&stack);
+    return ret;
+}
+
+/* Append one table with these changes and their log records. The caller
+ * holds the lock (reftable_lock) and has checked old values; the lock is
+ * released either way. */
+int reftable_write(const ref_change_t *changes, size_t count) {
+    table_stack_t stack = {0};
+    if (reftable_enabled() && stack_open(&stack) < 0) {
+        reftable_unlock();
+        return -1;
+    }
+
+    uint64_t update_index = stack.count ? stack.tables[stack.count - 1].max_index + 1 : 1;
+    record_list_t refs = {0}, logs = {0};
+    int ret = 0;
+    for (size_t i = 0; ret == 0 && i < count; i++) {
+        const ref_change_t *change = &changes[i];
+        size_t len = strlen(change->name);
+        if (len + 9 > REFTABLE_MAX_KEY) {
+            fprintf(stderr, "Ref name too long: %s\n", change->name);
+            ret = -1;
+            break;
+        }
+
+        record_t ref = { .type = hash_is_null(&change->new_hash) ? VALUE_DELETION : VALUE_HASH,
+                         .update_index = update_index, .hash = change->new_hash };
+        record_t log = { .type = VALUE_LOG, .update_index = update_index,
+                         .hash = change->new_hash, .old_hash = change->old_hash,
+                         .time = (uint64_t)time(NULL) };
+        unsigned char key[REFTABLE_MAX_KEY];
+        size_t key_len = log_key(change->name, update_index, key);
+        ret = record_add(&refs, (const unsigned char *)change->name, len, &ref) < 0 ||
+              record_add(&logs, key, key_len, &log) < 0 ? -1 : 0;
+    }
+
+    char name[64];
+    if (ret == 0) {
+        qsort(refs.items, refs.count, sizeof(record_t), compare_records);
+        qsort(logs.items, logs.count, sizeof(record_t), compare_records);
+        // Readers binary-search the ref section, so each name appears once
+        for (size_t i = 1; ret == 0 && i < refs.count; i++) {
+            const record_t *prev = &refs.items[i - 1], *r = &refs.items[i];
+            if (compare_keys(prev->key, prev->key_len, r->key, r->key_len) == 0) {
+                fprintf(stderr, "Ref '%.*s' updated twice in one transaction\n", (int)r->key_len, r->key);
+                ret = -1;
+            }
+        }
+    }
+    if (ret == 0) {
+        ret = table_write(&refs, &logs, update_index, update_index, name, sizeof(name));
+    }
+    record_list_free(&refs);
+    record_list_free(&logs);
+
+    if (ret < 0) {
+        reftable_unlock();
+    } else {
+        ret = write_list(&stack, stack.count, name);
+    }
+    stack_close(&stack);
+
+    if (ret == 0) reftable_compact(0);
+    return ret;
+}
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "fit.h"
+
+/*
+ * fit repack: put every object reachable from a ref into one pack, write its
+ * reachability bitmaps, then delete the packs it replaces and the loose
+ * copies of what it contains. Unreachable loose objects are left for gc.
+ *
+ * Only packs that existed before the refs were read are replaced: a push or
+ * fetch that lands a pack during the repack keeps it, since its refs may
+ * already point into it.
+ */
+
+typedef struct {
+    hash_t *items;
+    size_t count;
+    size_t capacity;
+    hash_set_t seen;
+} tip_list_t;
+
+static int collect_tip(const char *name, const hash_t *hash, void *data) {
+    (void)name;
+    tip_list_t *tips = data;
+    if (hash_set_add(&tips->seen, hash) <= 0) return 0;
+
+    if (tips->count == tips->capacity) {
+        size_t capacity = tips->capacity ? tips->capacity * 2 : 64;
+        hash_t *items = realloc(tips->items, capacity * sizeof(hash_t));
+        if (!items) return 1;
+        tips->items = items;
+        tips->capacity = capacity;
+    }
+    tips->items[tips->count++] = *hash;
+    return 0;
+}
+
+static ssize_t read_pack_file(void *ctx, void *buf, size_t len) {
+    size_t n = fread(buf, 1, len, (FILE *)ctx);
+    return n == 0 && ferror((FILE *)ctx) ? -1 : (ssize_t)n;
+}
+
+typedef struct {
+    char (*names)[HASH_HEX_SIZE + 1];
+    size_t count;
+    size_t capacity;
+} pack_names_t;
+
+/* Record the hex names of the packs present now */
+static int list_packs(pack_names_t *packs) {
+    DIR *d = opendir(FIT_PACK_DIR);
+    if (!d) return 0;
+
+    int ret = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d))) {
+        const char *name = entry->d_name;
+        if (strncmp(name, "pack-", 5) != 0 || strlen(name) != 5 + HASH_HEX_SIZE + 5 ||
+            strcmp(name + 5 + HASH_HEX_SIZE, ".pack") != 0) {
+            continue;
+        }
+        if (packs->count == packs->capacity) {
+            size_t capacity = packs->capacity ? packs->capacity * 2 : 16;
+            void *names = realloc(packs->names, capacity * sizeof(*packs->names));
+            if (!names) {
+                ret = -1;
+                break;
+            }
+            packs->names = names;
+            packs->capacity = capacity;
+        }
+        memcpy(packs->names[packs->count], name + 5, HASH_HEX_SIZE);
+        packs->names[packs->count++][HASH_HEX_SIZE] = '\0';
+    }
+    closedir(d);
+    return ret;
+}
+
+/* Remove the files of the listed packs, except the pack named keep */
+static int remove_old_packs(const pack_names_t *packs, const char *keep) {
+    DIR *d = opendir(FIT_PACK_DIR);
+    if (!d) return 0;
+
+    int removed = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d))) {
+        const char *name = entry->d_name;
+        if (strncmp(name, "pack-", 5) != 0 || strncmp(name + 5, keep, HASH_HEX_SIZE) == 0) {
+            continue;
+        }
+        int listed = 0;
+        for (size_t i = 0; !listed && i < packs->count; i++) {
+            listed = strncmp(name + 5, packs->names[i], HASH_HEX_SIZE) == 0;
+        }
+        if (!listed) continue;
+
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", FIT_PACK_DIR, name);
+        if (unlink(path) == 0 && strstr(name, ".pack")) removed++;
+    }
+    closedir(d);
+    return removed;
+}
+
+int repack_run(void) {
+    // Before the refs, so every pack they can point into is known
+    pack_names_t packs = {0};
+    if (list_packs(&packs) < 0) {
+        fprintf(stderr, "Failed to list packs\n");
+        free(packs.names);
+        return -1;
+    }
+
+    tip_list_t tips = {0};
+    hash_set_init(&tips.seen);
+    ref_for_each("", collect_tip, &tips);
+    hash_t head;
+    if (ref_resolve_head(&head) == 0) collect_tip("HEAD", &head, &tips);  // May be detached
+    hash_set_free(&tips.seen);
+
+    if (tips.count == 0) {
+        printf("Nothing to repack\n");
+        free(tips.items);
+        free(packs.names);
+        return 0;
+    }
+
+    hash_t *objects = NULL;
+    size_t count = 0;
+    if (rev_list_objects(tips.items, tips.count, NULL, 0, &objects, &count) < 0) {
+        fprintf(stderr, "Failed to enumerate objects\n");
+        free(tips.items);
+        free(packs.names);
+        return -1;
+    }
+
+    /* A partial clone packs what it has; the rest stays with the remote */
+    char host[256];
+    if (promisor_read(host, sizeof(host), NULL)) {
+        size_t kept = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (object_exists(&objects[i])) objects[kept++] = objects[i];
+        }
+        count = kept;
+    }
+
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/tmp_repack_%d", FIT_PACK_DIR, (int)getpid());
+
+    int ret = -1;
+    pack_index_result_t result;
+    FILE *f = NULL;
+    if (mkdirp(FIT_PACK_DIR) != 0 || pack_objects(objects, count, tmp_path) < 0 ||
+        !(f = fopen(tmp_path, "rb")) || pack_index_stream(read_pack_file, f, &result) < 0) {
+        fprintf(stderr, "Failed to write pack\n");
+        goto out;
+    }
+
+    int bitmaps = bitmap_write(&result.pack_hash, objects, count, tips.items, tips.count);
+    if (bitmaps < 0) {
+        fprintf(stderr, "Warning: Failed to write reachability bitmaps\n");
+    }
+
+    char hex[HASH_HEX_SIZE + 1];
+    hash_to_hex(&result.pack_hash, hex);
+    int old_packs = remove_old_packs(&packs, hex);
+
+    int loose = 0;
+    for (size_t i = 0; i < count; i++) {
+        char *path = object_path(&objects[i]);
+        if (path && unlink(path) == 0) loose++;
+        free(path);
+    }
+
+    printf("Packed %zu objects into pack-%.12s (%d bitmaps)\n", count, hex, bitmaps < 0 ? 0 : bitmaps);
+    printf("Removed %d loose objects and %d old packs\n", loose, old_packs);
+    ret = 0;
+
+out:
+    if (f) fclose(f);
+    unlink(tmp_path);
+    free(objects);
+    free(tips.items);
+    free(packs.names);
+    return ret;
+}
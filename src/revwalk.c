@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "fit.h"
+
+/*
+ * Object enumeration for transfers: everything reachable from the "want"
+ * commits that is not reachable from the "have" commits.
+ *
+ * The walk runs in three passes:
+ *   1. mark every commit reachable from the haves as uninteresting
+ *   2. walk the wants' history until it runs into uninteresting commits,
+ *      remembering those as the boundary
+ *   3. mark the trees and blobs of the boundary and of the have tips as
+ *      already present, then emit the new commits followed by whatever
+ *      trees and blobs they introduce
+ *
+ * Haves that are not present locally are ignored, and history that is
+ * missing (e.g. beyond a shallow boundary) simply ends the walk.
+ *
+ * For a shallow client, pass 1 stops at the client's shallow commits (it
+ * has them but not their parents) and pass 2 sends the commits within
+ * `depth` of a start. Deepening adds the parents of the shallow commits as
+ * starts. Commits sent whose parents are not become the client's new
+ * shallow commits.
+ */
+
+typedef struct {
+    hash_t *items;
+    size_t count;
+    size_t capacity;
+} hash_list_t;
+
+static int list_push(hash_list_t *list, const hash_t *hash) {
+    if (list->count >= list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 256;
+        hash_t *items = realloc(list->items, capacity * sizeof(hash_t));
+        if (!items) return -1;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = *hash;
+    return 0;
+}
+
+static int mark_commits(const hash_t *start, hash_set_t *commits, const hash_set_t *stop) {
+    hash_t current = *start;
+
+    while (!hash_is_null(&current)) {
+        int added = hash_set_add(commits, &current);
+        if (added < 0) return -1;
+        if (added == 0) break;  /* Rest of this history is already marked */
+        if (stop && hash_set_contains(stop, &current)) break;
+
+        commit_t commit;
+        if (commit_read(&current, &commit) < 0) break;
+        current = commit.parent;
+        commit_free(&commit);
+    }
+    return 0;
+}
+
+/* Mark a tree and everything below it as present */
+static int mark_tree(const hash_t *tree_hash, hash_set_t *present) {
+    int added = hash_set_add(present, tree_hash);
+    if (added <= 0) return added;
+
+    tree_entry_t *entries = tree_read(tree_hash);
+    for (tree_entry_t *e = entries; e; e = e->next) {
+        int ret = S_ISDIR(e->mode) ? mark_tree(&e->hash, present)
+                                   : hash_set_add(present, &e->hash);
+        if (ret < 0) {
+            tree_free(entries);
+            return -1;
+        }
+    }
+    tree_free(entries);
+    return 0;
+}
+
+static int mark_commit_tree(const hash_t *commit_hash, hash_set_t *present) {
+    commit_t commit;
+    if (commit_read(commit_hash, &commit) < 0) return 0;
+    int ret = mark_tree(&commit.tree, present);
+    commit_free(&commit);
+    return ret;
+}
+
+/* Emit a tree and whatever it contains that is not already present */
+static int emit_tree(const hash_t *tree_hash, hash_set_t *present, hash_list_t *out) {
+    int added = hash_set_add(present, tree_hash);
+    if (added <= 0) return added;
+    if (list_push(out, tree_hash) < 0) return -1;
+
+    tree_entry_t *entries = tree_read(tree_hash);
+    for (tree_entry_t *e = entries; e; e = e->next) {
+        int ret;
+        if (S_ISDIR(e->mode)) {
+            ret = emit_tree(&e->hash, present, out);
+        } else {
+            ret = hash_set_add(present, &e->hash);
+            if (ret > 0) ret = list_push(out, &e->hash);
+        }
+        if (ret < 0) {
+            tree_free(entries);
+            return -1;
+        }
+    }
+    tree_free(entries);
+    return 0;
+}
+
+/* Walk back from all starts at once, one generation at a time, so every
+ * commit is reached at its shortest distance from a start and read once.
+ * With a depth, commits that far from every start end the walk; those whose
+ * parents are not sent become the client's shallow commits. */
+static int walk_new_commits(hash_list_t *frontier, int depth, const hash_set_t *uninteresting,
+                            hash_set_t *seen, hash_list_t *commits, hash_list_t *boundary,
+                            hash_list_t *shallow) {
+    hash_list_t cut = {0};
+    int ret = 0;
+
+    for (int level = 1; ret == 0 && frontier->count > 0; level++) {
+        hash_list_t next = {0};
+        for (size_t i = 0; ret == 0 && i < frontier->count; i++) {
+            const hash_t *current = &frontier->items[i];
+            if (hash_is_null(current)) continue;
+
+            int added = hash_set_add(seen, current);
+            if (added <= 0) {
+                ret = added;
+                continue;
+            }
+            if (hash_set_contains(uninteresting, current)) {
+                ret = list_push(boundary, current);
+                continue;
+            }
+
+            commit_t commit;
+            if (commit_read(current, &commit) < 0) continue;
+            hash_t parent = commit.parent;
+            commit_free(&commit);
+
+            ret = list_push(commits, current);
+            if (ret == 0 && !hash_is_null(&parent)) {
+                ret = (depth > 0 && level == depth) ? list_push(&cut, current)
+                                                    : list_push(&next, &parent);
+            }
+        }
+        free(frontier->items);
+        *frontier = next;
+    }
+
+    /* Another start may have reached the parent in fewer steps */
+    for (size_t i = 0; ret == 0 && i < cut.count; i++) {
+        commit_t commit;
+        if (commit_read(&cut.items[i], &commit) < 0) continue;
+        if (!hash_set_contains(seen, &commit.parent)) ret = list_push(shallow, &cut.items[i]);
+        commit_free(&commit);
+    }
+    free(cut.items);
+    return ret;
+}
+
+static int rev_walk(const hash_t *wants, size_t want_count,
+                    const hash_t *haves, size_t have_count, const shallow_spec_t *spec,
+                    hash_t **objects_out, size_t *count_out,
+                    hash_t **shallow_out, size_t *shallow_count_out) {
+    hash_set_t uninteresting, seen, present, stop;
+    hash_set_init(&uninteresting);
+    hash_set_init(&seen);
+    hash_set_init(&present);
+    hash_set_init(&stop);
+    hash_list_t starts = {0}, commits = {0}, boundary = {0}, out = {0}, shallow = {0};
+    int depth = spec ? spec->depth : 0;
+    int ret = 0;
+
+    for (size_t i = 0; spec && ret == 0 && i < spec->count; i++) {
+        if (hash_set_add(&stop, &spec->commits[i]) < 0) ret = -1;
+    }
+
+    /* Pass 1: history the other side already has */
+    for (size_t i = 0; ret == 0 && i < have_count; i++) {
+        ret = mark_commits(&haves[i], &uninteresting, spec ? &stop : NULL);
+    }
+
+    /* Pass 2: new commits, newest first */
+    for (size_t i = 0; ret == 0 && i < want_count; i++) {
+        ret = list_push(&starts, &wants[i]);
+    }
+    for (size_t i = 0; spec && spec->deepen && ret == 0 && i < spec->count; i++) {
+        commit_t commit;
+        if (commit_read(&spec->commits[i], &commit) < 0) continue;
+        ret = list_push(&starts, &commit.parent);
+        commit_free(&commit);
+    }
+    if (ret == 0) {
+        ret = walk_new_commits(&starts, depth, &uninteresting, &seen, &commits, &boundary, &shallow);
+    }
+    free(starts.items);
+
+    /* Pass 3: trees and blobs */
+    for (size_t i = 0; ret == 0 && i < boundary.count; i++) {
+        ret = mark_commit_tree(&boundary.items[i], &present);
+    }
+    for (size_t i = 0; ret == 0 && i < have_count; i++) {
+        if (hash_set_contains(&uninteresting, &haves[i])) {
+            ret = mark_commit_tree(&haves[i], &present);
+        }
+    }
+
+    for (size_t i = 0; ret == 0 && i < commits.count; i++) {
+        ret = list_push(&out, &commits.items[i]);
+    }
+    for (size_t i = 0; ret == 0 && i < commits.count; i++) {
+        commit_t commit;
+        if (commit_read(&commits.items[i], &commit) < 0) continue;
+        ret = emit_tree(&commit.tree, &present, &out);
+        commit_free(&commit);
+    }
+
+    hash_set_free(&uninteresting);
+    hash_set_free(&seen);
+    hash_set_free(&present);
+    hash_set_free(&stop);
+    free(commits.items);
+    free(boundary.items);
+
+    if (ret < 0) {
+        free(out.items);
+        free(shallow.items);
+        return -1;
+    }
+
+    *objects_out = out.items;
+    *count_out = out.count;
+    if (shallow_out) {
+        *shallow_out = shallow.items;
+        *shallow_count_out = shallow.count;
+    } else {
+        free(shallow.items);
+    }
+    return 0;
+}
+
+int rev_list_objects(const hash_t *wants, size_t want_count,
+                     const hash_t *haves, size_t have_count,
+                     hash_t **objects_out, size_t *count_out) {
+    /* Reachability bitmaps answer without walking, when there are any */
+    if (bitmap_objects(wants, want_count, haves, have_count, objects_out, count_out) == 0) {
+        return 0;
+    }
+    return rev_walk(wants, want_count, haves, have_count, NULL, objects_out, count_out, NULL, NULL);
+}
+
+/* Bitmaps subtract everything reachable from the haves, which a shallow
+ * client does not have, so this always walks */
+int rev_list_shallow(const hash_t *wants, size_t want_count,
+                     const hash_t *haves, size_t have_count, const shallow_spec_t *spec,
+                     hash_t **objects_out, size_t *count_out,
+                     hash_t **shallow_out, size_t *shallow_count_out) {
+    return rev_walk(wants, want_count, haves, have_count, spec,
+                    objects_out, count_out, shallow_out, shallow_count_out);
+}
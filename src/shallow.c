@@ -1,12 +1,52 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include "fit.h"
 
 #define FIT_SHALLOW_FILE ".fit/shallow"
 
+/*
+ * .fit/shallow lists the commits that are present without their parents.
+ * The server decides which commits those are when it cuts a fetch short
+ * at the requested depth, and sends them after the pack.
+ *
+ * Lookups go through a hash set loaded on first use, so walking a long
+ * history reads the file once.
+ */
+
+static hash_set_t shallow_set;
+static int shallow_loaded;
+
+static void shallow_invalidate(void) {
+    hash_set_free(&shallow_set);
+    shallow_loaded = 0;
+}
+
+static int shallow_load(void) {
+    if (shallow_loaded) return 0;
+
+    hash_t *commits = NULL;
+    size_t count = 0;
+    if (shallow_read_commits(&commits, &count) < 0) return -1;
+
+    hash_set_init(&shallow_set);
+    for (size_t i = 0; i < count; i++) {
+        if (hash_set_add(&shallow_set, &commits[i]) < 0) {
+            free(commits);
+            hash_set_free(&shallow_set);
+            return -1;
+        }
+    }
+    free(commits);
+    shallow_loaded = 1;
+    return 0;
+}
+
 /* Mark repository as shallow */
 int shallow_mark(const hash_t *shallow_commits, size_t count) {
+    shallow_invalidate();
     FILE *f = fopen(FIT_SHALLOW_FILE, "w");
     if (!f) {
         fprintf(stderr, "Failed to create shallow file\n");
@@ -82,140 +122,68 @@ int shallow_read_commits(hash_t **commits_out, size_t *count_out) {
 
 /* Check if a commit is a shallow boundary */
 int shallow_is_boundary(const hash_t *commit_hash) {
-    hash_t *shallow_commits = NULL;
-    size_t count = 0;
-
-    if (shallow_read_commits(&shallow_commits, &count) < 0) {
-        return 0;
-    }
-
-    for (size_t i = 0; i < count; i++) {
-        if (hash_equal(&shallow_commits[i], commit_hash)) {
-            free(shallow_commits);
-            return 1;
-        }
-    }
-
-    free(shallow_commits);
-    return 0;
+    if (shallow_load() < 0) return 0;
+    return hash_set_contains(&shallow_set, commit_hash);
 }
 
-/* Deepen a shallow repository */
-int shallow_deepen(int depth) {
-    if (!shallow_is_repository_shallow()) {
-        fprintf(stderr, "Repository is not shallow\n");
-        return -1;
-    }
-
-    hash_t *old_shallow = NULL;
-    size_t old_count = 0;
-
-    if (shallow_read_commits(&old_shallow, &old_count) < 0) {
-        return -1;
-    }
-
-    /* Collect new shallow boundary commits */
-    hash_t *new_shallow = malloc(old_count * 10 * sizeof(hash_t));
-    if (!new_shallow) {
-        free(old_shallow);
-        return -1;
-    }
-
-    size_t new_count = 0;
-
-    /* Walk back 'depth' commits from each old shallow commit */
-    for (size_t i = 0; i < old_count; i++) {
-        hash_t current = old_shallow[i];
-
-        for (int d = 0; d < depth; d++) {
-            commit_t commit;
-            if (commit_read(&current, &commit) < 0) break;
-
-            /* Check if it has a parent */
-            int has_parent = 0;
-            for (int j = 0; j < HASH_SIZE; j++) {
-                if (commit.parent.hash[j]) {
-                    has_parent = 1;
-                    break;
-                }
-            }
-
-            if (!has_parent) {
-                commit_free(&commit);
-                break;
-            }
-
-            current = commit.parent;
-            commit_free(&commit);
-        }
-
-        /* Add to new shallow boundary */
-        new_shallow[new_count++] = current;
-    }
-
-    /* Update shallow file */
-    int result = shallow_mark(new_shallow, new_count);
-
-    free(old_shallow);
-    free(new_shallow);
-
-    return result;
+/* Whether a commit is present but its parent is not */
+static int parent_missing(const hash_t *commit_hash) {
+    commit_t commit;
+    if (commit_read(commit_hash, &commit) < 0) return 0;
+    int missing = !hash_is_null(&commit.parent) && !object_exists(&commit.parent);
+    commit_free(&commit);
+    return missing;
 }
 
-/* Collect commits up to a certain depth from HEAD */
-int shallow_collect_commits(const hash_t *start, int depth, hash_t **commits_out, size_t *count_out) {
-    if (depth <= 0) {
-        *commits_out = NULL;
-        *count_out = 0;
+/* Merge the shallow commits a fetch reported into the shallow file, dropping
+ * any whose parents have since arrived */
+int shallow_update(const hash_t *added, size_t added_count) {
+    hash_t *old = NULL;
+    size_t old_count = 0;
+    if (shallow_read_commits(&old, &old_count) < 0) return -1;
+    if (old_count == 0 && added_count == 0) {
+        free(old);
         return 0;
     }
 
-    size_t capacity = depth + 10;
-    hash_t *commits = malloc(capacity * sizeof(hash_t));
+    hash_t *commits = malloc((old_count + added_count) * sizeof(hash_t));
     if (!commits) {
+        free(old);
         return -1;
     }
 
+    hash_set_t seen;
+    hash_set_init(&seen);
     size_t count = 0;
-    hash_t current = *start;
-
-    for (int d = 0; d < depth; d++) {
-        /* Add current commit */
-        if (count >= capacity) {
-            capacity *= 2;
-            hash_t *new_commits = realloc(commits, capacity * sizeof(hash_t));
-            if (!new_commits) {
-                free(commits);
-                return -1;
-            }
-            commits = new_commits;
-        }
-
-        commits[count++] = current;
-
-        /* Read commit to get parent */
-        commit_t commit;
-        if (commit_read(&current, &commit) < 0) break;
-
-        /* Check if it has a parent */
-        int has_parent = 0;
-        for (int i = 0; i < HASH_SIZE; i++) {
-            if (commit.parent.hash[i]) {
-                has_parent = 1;
-                break;
-            }
-        }
-
-        if (!has_parent) {
-            commit_free(&commit);
-            break;
-        }
+    for (size_t i = 0; i < old_count + added_count; i++) {
+        const hash_t *hash = i < old_count ? &old[i] : &added[i - old_count];
+        if (hash_set_add(&seen, hash) > 0 && parent_missing(hash)) commits[count++] = *hash;
+    }
+    hash_set_free(&seen);
+    free(old);
+
+    int ret = 0;
+    if (count > 0) {
+        ret = shallow_mark(commits, count);
+    } else if (unlink(FIT_SHALLOW_FILE) < 0 && errno != ENOENT) {
+        ret = -1;
+    }
+    shallow_invalidate();
+    if (ret == 0 && count == 0) printf("Repository is no longer shallow\n");
+    free(commits);
+    return ret;
+}
 
-        current = commit.parent;
-        commit_free(&commit);
+/* Deepen a shallow repository: fetch the next depth commits behind each
+ * shallow commit */
+int shallow_deepen(const char *host, int port, int depth) {
+    if (!shallow_is_repository_shallow()) {
+        fprintf(stderr, "Repository is not shallow\n");
+        return -1;
     }
 
-    *commits_out = commits;
-    *count_out = count;
-    return 0;
+    net_set_fetch_depth(depth, 1);
+    int ret = net_fetch(host, port, NULL, 0);
+    net_set_fetch_depth(0, 0);
+    return ret;
 }
@@ -0,0 +1,139 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "fit.h"
+
+/*
+ * Sparse checkout in cone mode: .fit/info/sparse-checkout lists directories,
+ * one per line. A path is in the cone when it is
+ *
+ *   - a file at the top level,
+ *   - anywhere under a listed directory, or
+ *   - a file directly inside a parent of a listed directory
+ *
+ * so deciding costs a few binary searches over the sorted list, never a
+ * pattern match per line.
+ */
+
+#define FIT_INFO_DIR ".fit/info"
+#define FIT_SPARSE_FILE ".fit/info/sparse-checkout"
+
+static int compare_dirs(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Strip slashes and a trailing '*', so "/src/lib/" and "src/lib/*" both read as "src/lib"
+static char *normalize_dir(char *line) {
+    line[strcspn(line, "\r\n")] = '\0';
+    while (*line == '/') line++;
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == '/' || line[len - 1] == '*')) line[--len] = '\0';
+    return line;
+}
+
+int sparse_load(sparse_t *sparse) {
+    memset(sparse, 0, sizeof(*sparse));
+
+    FILE *f = fopen(FIT_SPARSE_FILE, "r");
+    if (!f) return 0;
+    sparse->enabled = 1;
+
+    size_t capacity = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || line[0] == '!') continue;  // Comments, git's parent-exclusion lines
+        char *dir = normalize_dir(line);
+        if (!dir[0] || !is_safe_path(dir)) continue;
+
+        if (sparse->count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            char **dirs = realloc(sparse->dirs, capacity * sizeof(char *));
+            if (!dirs) goto fail;
+            sparse->dirs = dirs;
+        }
+        if (!(sparse->dirs[sparse->count] = strdup(dir))) goto fail;
+        sparse->count++;
+    }
+    fclose(f);
+
+    qsort(sparse->dirs, sparse->count, sizeof(char *), compare_dirs);
+    return 0;
+
+fail:
+    fclose(f);
+    sparse_free(sparse);
+    fprintf(stderr, "Failed to load sparse-checkout patterns\n");
+    return -1;
+}
+
+/* Index of the first directory not less than key */
+static size_t lower_bound(const sparse_t *sparse, const char *key, size_t len) {
+    size_t lo = 0, hi = sparse->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(sparse->dirs[mid], key, len) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static int has_dir(const sparse_t *sparse, const char *dir, size_t len) {
+    size_t i = lower_bound(sparse, dir, len);
+    return i < sparse->count && strncmp(sparse->dirs[i], dir, len) == 0 && sparse->dirs[i][len] == '\0';
+}
+
+int sparse_includes(const sparse_t *sparse, const char *path) {
+    if (!sparse->enabled) return 1;
+
+    const char *slash = strrchr(path, '/');
+    if (!slash) return 1;
+
+    /* Under a listed directory: one of the path's own prefixes is listed */
+    for (const char *p = strchr(path, '/'); p; p = strchr(p + 1, '/')) {
+        if (has_dir(sparse, path, p - path)) return 1;
+    }
+
+    /* Directly inside a parent of a listed directory: "parent/" prefixes an entry */
+    size_t len = slash - path + 1;
+    size_t i = lower_bound(sparse, path, len);
+    return i < sparse->count && strncmp(sparse->dirs[i], path, len) == 0;
+}
+
+void sparse_free(sparse_t *sparse) {
+    for (size_t i = 0; i < sparse->count; i++) free(sparse->dirs[i]);
+    free(sparse->dirs);
+    memset(sparse, 0, sizeof(*sparse));
+}
+
+int sparse_set(char **dirs, int count) {
+    if (mkdirp(FIT_INFO_DIR) != 0) {
+        fprintf(stderr, "Failed to create %s\n", FIT_INFO_DIR);
+        return -1;
+    }
+
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", FIT_SPARSE_FILE);
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) {
+        fprintf(stderr, "Failed to write sparse-checkout file\n");
+        return -1;
+    }
+    for (int i = 0; i < count; i++) fprintf(f, "/%s/\n", dirs[i]);
+    if (fclose(f) != 0 || rename(tmp_path, FIT_SPARSE_FILE) < 0) {
+        unlink(tmp_path);
+        fprintf(stderr, "Failed to write sparse-checkout file\n");
+        return -1;
+    }
+    return 0;
+}
+
+int sparse_disable(void) {
+    if (unlink(FIT_SPARSE_FILE) < 0 && errno != ENOENT) {
+        fprintf(stderr, "Failed to remove sparse-checkout file\n");
+        return -1;
+    }
+    return 0;
+}
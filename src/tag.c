@@ -20,8 +20,11 @@ int tag_create(const char *name, const hash_t *commit_hash, const char *message)
     /* Create tags directory if it doesn't exist */
     mkdirp(FIT_TAGS_DIR);
 
-    /* Check if tag already exists */
-    if (file_exists(tag_path)) {
+    /* Check if tag already exists, loose or packed */
+    char ref_name[512];
+    hash_t existing;
+    snprintf(ref_name, sizeof(ref_name), "tags/%s", name);
+    if (ref_read(ref_name, &existing) == 0) {
         fprintf(stderr, "Tag '%s' already exists\n", name);
         return -1;
     }
@@ -52,15 +55,16 @@ int tag_delete(const char *name) {
         return -1;
     }
 
-    char tag_path[512];
-    snprintf(tag_path, sizeof(tag_path), "%s/%s", FIT_TAGS_DIR, name);
+    char ref_name[512];
+    hash_t hash;
+    snprintf(ref_name, sizeof(ref_name), "tags/%s", name);
 
-    if (!file_exists(tag_path)) {
+    if (ref_read(ref_name, &hash) < 0) {
         fprintf(stderr, "Tag '%s' not found\n", name);
         return -1;
     }
 
-    if (remove(tag_path) < 0) {
+    if (ref_delete(ref_name) < 0) {
         fprintf(stderr, "Failed to delete tag '%s'\n", name);
         return -1;
     }
@@ -68,48 +72,37 @@ int tag_delete(const char *name) {
     return 0;
 }
 
-int tag_list(void) {
-    DIR *d = opendir(FIT_TAGS_DIR);
-    if (!d) {
-        return 0;  /* No tags directory means no tags */
-    }
-
-    struct dirent *entry;
-    int count = 0;
-
-    while ((entry = readdir(d))) {
-        if (entry->d_name[0] == '.') continue;
-
-        /* Read tag info */
-        char tag_path[512];
-        snprintf(tag_path, sizeof(tag_path), "%s/%s", FIT_TAGS_DIR, entry->d_name);
-
-        FILE *f = fopen(tag_path, "r");
-        if (!f) continue;
-
-        char hash_hex[HASH_HEX_SIZE + 1];
-        char message[256] = {0};
+static int print_tag(const char *ref_name, const hash_t *hash, void *data) {
+    int *count = data;
+    const char *name = ref_name + strlen("tags/");
 
-        if (fgets(hash_hex, sizeof(hash_hex), f)) {
-            /* Remove newline */
-            hash_hex[strcspn(hash_hex, "\n")] = 0;
-
-            /* Try to read message */
-            if (fgets(message, sizeof(message), f)) {
-                message[strcspn(message, "\n")] = 0;
-            }
+    /* An annotated tag keeps its message in the loose file */
+    char tag_path[512];
+    char message[256] = {0};
+    snprintf(tag_path, sizeof(tag_path), "%s/%s", FIT_TAGS_DIR, name);
+    FILE *f = fopen(tag_path, "r");
+    if (f) {
+        char line[HASH_HEX_SIZE + 2];
+        if (fgets(line, sizeof(line), f) && fgets(message, sizeof(message), f)) {
+            message[strcspn(message, "\n")] = 0;
         }
         fclose(f);
+    }
 
-        if (message[0]) {
-            printf("%-20s %.8s  %s\n", entry->d_name, hash_hex, message);
-        } else {
-            printf("%-20s %.8s\n", entry->d_name, hash_hex);
-        }
-        count++;
+    char hash_hex[HASH_HEX_SIZE + 1];
+    hash_to_hex(hash, hash_hex);
+    if (message[0]) {
+        printf("%-20s %.8s  %s\n", name, hash_hex, message);
+    } else {
+        printf("%-20s %.8s\n", name, hash_hex);
     }
+    (*count)++;
+    return 0;
+}
 
-    closedir(d);
+int tag_list(void) {
+    int count = 0;
+    ref_for_each("tags", print_tag, &count);
     return count;
 }
 
@@ -119,26 +112,7 @@ int tag_resolve(const char *name, hash_t *out) {
         return -1;
     }
 
-    char tag_path[512];
-    snprintf(tag_path, sizeof(tag_path), "%s/%s", FIT_TAGS_DIR, name);
-
-    if (!file_exists(tag_path)) {
-        return -1;
-    }
-
-    FILE *f = fopen(tag_path, "r");
-    if (!f) return -1;
-
-    char hash_hex[HASH_HEX_SIZE + 1];
-    if (!fgets(hash_hex, sizeof(hash_hex), f)) {
-        fclose(f);
-        return -1;
-    }
-
-    fclose(f);
-
-    /* Remove newline */
-    hash_hex[strcspn(hash_hex, "\n")] = 0;
-
-    return hex_to_hash(hash_hex, out);
+    char ref_name[512];
+    snprintf(ref_name, sizeof(ref_name), "tags/%s", name);
+    return ref_read(ref_name, out);
 }
@@ -151,3 +151,46 @@ int is_valid_ref_name(const char *name) {
 
     return 1;  // Name is valid
 }
+
+/* Fill buf from a stream; -1 on a short read or error */
+int read_full(pack_read_fn read_fn, void *ctx, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read_fn(ctx, (char*)buf + got, len - got);
+        if (n <= 0) return -1;
+        got += n;
+    }
+    return 0;
+}
+
+/* Big-endian integers of any width up to 8 bytes, as stored on disk and
+ * sent on the wire */
+uint64_t get_be(const unsigned char *p, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++) v = v << 8 | p[i];
+    return v;
+}
+
+void put_be(unsigned char *p, uint64_t v, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        p[i] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+uint32_t get_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+void put_be32(unsigned char *p, uint32_t v) {
+    put_be(p, v, 4);
+}
+
+uint64_t get_be64(const unsigned char *p) {
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+void put_be64(unsigned char *p, uint64_t v) {
+    put_be(p, v, 8);
+}
@@ -0,0 +1,459 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <zlib.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "fit.h"
+
+/*
+ * Session transport. Both directions are buffered: writes are collected and
+ * go out in as few system calls as possible when the writer flushes (or
+ * before it waits for a reply), and reads are served from a buffer refilled
+ * one large read at a time. With framing, bytes are collected into frames:
+ *
+ *   [HEADER:4][PAYLOAD]   header = flags << 24 | payload length
+ *
+ * A frame with no payload and no flags is a flush marker, sent whenever the
+ * writer finishes a message. Readers skip flush markers, except that
+ * wire_expect_flush() requires one, which is how a truncated pack is told
+ * apart from a complete one. With compression, non-pack frames carry one
+ * continuous deflate stream, cut at frame boundaries with Z_SYNC_FLUSH.
+ *
+ * Bits 4-5 of the flags select a channel. Data (0) is what wire_read()
+ * returns; progress (1) and error (2) frames are printed to stderr as they
+ * arrive, so a peer can report on a long pack build while it streams.
+ */
+
+#define WIRE_FRAME_MAX 65536
+#define WIRE_FRAME_SLACK 1024       /* Deflate overhead on incompressible data */
+#define WIRE_FLAG_DEFLATE 0x01
+#define WIRE_CHANNEL_SHIFT 4
+#define WIRE_CHANNEL_MASK 0x30
+#define WIRE_DRAIN_MAX (256 * 1024)   /* Input discarded on close before giving up */
+#define WIRE_DRAIN_MS 5000
+
+struct wire {
+    int fd;
+    int framed;
+    int compress;                   /* Negotiated */
+    int deflating;                  /* Compress outgoing frames right now */
+    int sideband;                   /* Progress/error channels negotiated */
+
+    unsigned char out[WIRE_FRAME_MAX];
+    size_t out_len;
+    unsigned char raw[WIRE_FRAME_MAX];  /* Bytes read from the socket, not yet consumed */
+    size_t raw_pos, raw_len;
+    unsigned char *zout;
+    z_stream zw;
+    int zw_ready;
+
+    unsigned char *in;              /* Decoded payload of the current frame */
+    size_t in_pos, in_len;
+    unsigned char *zin;
+    z_stream zr;
+    int zr_ready;
+};
+
+static int fd_write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int fd_writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        // Skip what was written, possibly stopping inside a vector
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static ssize_t fd_read(int fd, void *buf, size_t len) {
+    for (;;) {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        return n;
+    }
+}
+
+static int wire_emit(wire_t *w, int marker);
+
+// Read from the socket through the input buffer. Whatever is waiting to be
+// written goes out first, since the peer may need it before it answers.
+static ssize_t conn_read(wire_t *w, void *buf, size_t len) {
+    if (w->raw_pos == w->raw_len) {
+        if (w->out_len > 0 && wire_emit(w, 0) < 0) return -1;
+        // Large reads gain nothing from the extra copy
+        if (len >= sizeof(w->raw)) return fd_read(w->fd, buf, len);
+
+        ssize_t n = fd_read(w->fd, w->raw, sizeof(w->raw));
+        if (n <= 0) return n;
+        w->raw_pos = 0;
+        w->raw_len = n;
+    }
+    size_t n = w->raw_len - w->raw_pos;
+    if (n > len) n = len;
+    memcpy(buf, w->raw + w->raw_pos, n);
+    w->raw_pos += n;
+    return n;
+}
+
+static int conn_read_all(wire_t *w, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = conn_read(w, (char *)buf + got, len - got);
+        if (n <= 0) return -1;
+        got += n;
+    }
+    return 0;
+}
+
+wire_t *wire_new(int fd, int framed, int compress, int sideband) {
+    wire_t *w = calloc(1, sizeof(wire_t));
+    if (!w) return NULL;
+    w->fd = fd;
+    w->framed = framed;
+    w->compress = framed && compress;
+    w->deflating = w->compress;
+    w->sideband = framed && sideband;
+
+    if (framed) {
+        w->in = malloc(WIRE_FRAME_MAX);
+        if (!w->in) {
+            free(w);
+            return NULL;
+        }
+    }
+
+    if (w->compress) {
+        w->zout = malloc(WIRE_FRAME_MAX + WIRE_FRAME_SLACK);
+        w->zin = malloc(WIRE_FRAME_MAX + WIRE_FRAME_SLACK);
+        w->zw_ready = w->zout && deflateInit(&w->zw, Z_DEFAULT_COMPRESSION) == Z_OK;
+        w->zr_ready = w->zin && inflateInit(&w->zr) == Z_OK;
+        if (!w->zw_ready || !w->zr_ready) {
+            wire_free(w);
+            return NULL;
+        }
+    }
+    return w;
+}
+
+void wire_free(wire_t *w) {
+    if (!w) return;
+    if (w->zw_ready) deflateEnd(&w->zw);
+    if (w->zr_ready) inflateEnd(&w->zr);
+    free(w->zout);
+    free(w->zin);
+    free(w->in);
+    free(w);
+}
+
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Closing with unread input (e.g. a trailing flush marker) makes the kernel
+// send a reset, which can destroy data the peer has not read yet. Half-close
+// and drain until the peer closes its side instead, but only so much and for
+// so long: a peer that keeps trickling data must not hold us forever.
+void wire_close(wire_t *w) {
+    if (!w) return;
+    if (w->out_len > 0) wire_emit(w, 0);
+    shutdown(w->fd, SHUT_WR);
+    char buf[4096];
+    long long deadline = monotonic_ms() + WIRE_DRAIN_MS;
+    for (size_t drained = 0; drained < WIRE_DRAIN_MAX;) {
+        long long left = deadline - monotonic_ms();
+        struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+        if (left <= 0 || poll(&pfd, 1, (int)left) <= 0) break;
+        ssize_t n = fd_read(w->fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        drained += n;
+    }
+    close(w->fd);
+    wire_free(w);
+}
+
+// Write one frame, followed by a flush marker if asked, in one system call
+static int send_frame(wire_t *w, uint8_t flags, const void *payload, size_t len, int marker) {
+    uint32_t header = htonl((uint32_t)flags << 24 | (uint32_t)len);
+    uint32_t flush = 0;
+    struct iovec iov[3] = {
+        { &header, 4 },
+        { (void *)payload, len },
+        { &flush, 4 },
+    };
+    return fd_writev_all(w->fd, iov, marker ? 3 : 2);
+}
+
+// Emit buffered bytes: raw when unframed, else as one data frame, with a
+// flush marker behind it when the message is complete
+static int wire_emit(wire_t *w, int marker) {
+    size_t len = w->out_len;
+    w->out_len = 0;
+
+    if (!w->framed) return len ? fd_write_all(w->fd, w->out, len) : 0;
+    if (len == 0) return marker ? send_frame(w, 0, NULL, 0, 0) : 0;  // Header alone is the marker
+    if (!w->deflating) return send_frame(w, 0, w->out, len, marker);
+
+    w->zw.next_in = w->out;
+    w->zw.avail_in = len;
+    w->zw.next_out = w->zout;
+    w->zw.avail_out = WIRE_FRAME_MAX + WIRE_FRAME_SLACK;
+    if (deflate(&w->zw, Z_SYNC_FLUSH) != Z_OK || w->zw.avail_in != 0 || w->zw.avail_out == 0) {
+        fprintf(stderr, "Failed to compress frame\n");
+        return -1;
+    }
+    size_t zlen = WIRE_FRAME_MAX + WIRE_FRAME_SLACK - w->zw.avail_out;
+    return send_frame(w, WIRE_FLAG_DEFLATE, w->zout, zlen, marker);
+}
+
+int wire_write(wire_t *w, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    while (len > 0) {
+        size_t n = WIRE_FRAME_MAX - w->out_len;
+        if (n > len) n = len;
+        memcpy(w->out + w->out_len, p, n);
+        w->out_len += n;
+        p += n;
+        len -= n;
+        if (w->out_len == WIRE_FRAME_MAX && wire_emit(w, 0) < 0) return -1;
+    }
+    return 0;
+}
+
+int wire_flush(wire_t *w) {
+    return wire_emit(w, 1);
+}
+
+// Send what is buffered without ending the message, before waiting for the
+// peer somewhere other than wire_read()
+int wire_push(wire_t *w) {
+    return w->out_len > 0 ? wire_emit(w, 0) : 0;
+}
+
+// Copy len bytes of a file straight from the page cache to the socket
+static int fd_sendfile(int out_fd, int in_fd, off_t offset, size_t len) {
+    while (len > 0) {
+        ssize_t n = sendfile(out_fd, in_fd, &offset, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            // Not supported for this file; copy through a buffer instead
+            char buf[65536];
+            n = pread(in_fd, buf, len < sizeof(buf) ? len : sizeof(buf), offset);
+            if (n <= 0 || fd_write_all(out_fd, buf, n) < 0) return -1;
+            offset += n;
+        } else if (n <= 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+// Send part of a file as raw data frames without copying it through user
+// space. Buffered data goes out first; the payload is never deflated.
+int wire_sendfile(wire_t *w, int fd, off_t offset, size_t len) {
+    if (wire_emit(w, 0) < 0) return -1;
+    if (!w->framed) return fd_sendfile(w->fd, fd, offset, len);
+
+    while (len > 0) {
+        size_t n = len < WIRE_FRAME_MAX ? len : WIRE_FRAME_MAX;
+        uint32_t header = htonl((uint32_t)n);
+        if (fd_write_all(w->fd, &header, 4) < 0 || fd_sendfile(w->fd, fd, offset, n) < 0) {
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void wire_set_compress(wire_t *w, int on) {
+    if (!w->compress || w->deflating == !!on) return;
+    // A frame is either all deflated or all raw
+    wire_emit(w, 0);
+    w->deflating = !!on;
+}
+
+// Hold back partial segments while a pack streams, so frame headers and
+// small writes share packets with the data; releasing it sends the rest
+void wire_set_cork(wire_t *w, int on) {
+    setsockopt(w->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+// Read the next frame header; returns payload length or -1
+static int read_header(wire_t *w, uint8_t *flags) {
+    uint32_t header;
+    if (conn_read_all(w, &header, 4) < 0) return -1;
+    header = ntohl(header);
+    *flags = header >> 24;
+    uint32_t len = header & 0xffffff;
+    int channel = (*flags & WIRE_CHANNEL_MASK) >> WIRE_CHANNEL_SHIFT;
+    if (len > WIRE_FRAME_MAX + WIRE_FRAME_SLACK ||
+        (*flags & ~(WIRE_FLAG_DEFLATE | WIRE_CHANNEL_MASK)) ||
+        (channel != WIRE_CHANNEL_DATA && (!w->sideband || channel > WIRE_CHANNEL_ERROR ||
+                                          (*flags & WIRE_FLAG_DEFLATE))) ||
+        ((*flags & WIRE_FLAG_DEFLATE) && !w->compress) ||
+        (!(*flags & WIRE_FLAG_DEFLATE) && len > WIRE_FRAME_MAX)) {
+        fprintf(stderr, "Invalid frame header 0x%08x\n", header);
+        return -1;
+    }
+    return (int)len;
+}
+
+// Load the payload of a frame whose header has been read
+static int load_frame(wire_t *w, uint8_t flags, size_t len) {
+    w->in_pos = 0;
+    w->in_len = 0;
+    if (!(flags & WIRE_FLAG_DEFLATE)) {
+        if (conn_read_all(w, w->in, len) < 0) return -1;
+        w->in_len = len;
+        return 0;
+    }
+
+    if (conn_read_all(w, w->zin, len) < 0) return -1;
+    w->zr.next_in = w->zin;
+    w->zr.avail_in = len;
+    w->zr.next_out = w->in;
+    w->zr.avail_out = WIRE_FRAME_MAX;
+    int ret = inflate(&w->zr, Z_SYNC_FLUSH);
+    if ((ret != Z_OK && ret != Z_BUF_ERROR) || w->zr.avail_in != 0) {
+        fprintf(stderr, "Failed to decompress frame\n");
+        return -1;
+    }
+    w->in_len = WIRE_FRAME_MAX - w->zr.avail_out;
+    return 0;
+}
+
+// Show a progress or error frame from the peer
+static int read_sideband(wire_t *w, uint8_t flags, size_t len) {
+    char msg[WIRE_FRAME_MAX];
+    if (conn_read_all(w, msg, len) < 0) return -1;
+
+    int channel = (flags & WIRE_CHANNEL_MASK) >> WIRE_CHANNEL_SHIFT;
+    if (channel == WIRE_CHANNEL_ERROR) {
+        fprintf(stderr, "remote: error: %.*s\n", (int)len, msg);
+    } else {
+        // Progress lines carry their own \r or \n
+        fprintf(stderr, "remote: %.*s", (int)len, msg);
+    }
+    return 0;
+}
+
+ssize_t wire_read(wire_t *w, void *buf, size_t len) {
+    if (!w->framed) return conn_read(w, buf, len);
+
+    while (w->in_pos == w->in_len) {
+        uint8_t flags;
+        int frame_len = read_header(w, &flags);
+        if (frame_len < 0) return -1;
+        if (frame_len == 0 && flags == 0) continue;  // Flush marker
+        if (flags & WIRE_CHANNEL_MASK) {
+            if (read_sideband(w, flags, frame_len) < 0) return -1;
+            continue;
+        }
+        if (load_frame(w, flags, frame_len) < 0) return -1;
+    }
+
+    size_t n = w->in_len - w->in_pos;
+    if (n > len) n = len;
+    memcpy(buf, w->in + w->in_pos, n);
+    w->in_pos += n;
+    return n;
+}
+
+int wire_read_full(wire_t *w, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = wire_read(w, (char *)buf + got, len - got);
+        if (n <= 0) return -1;
+        got += n;
+    }
+    return 0;
+}
+
+int wire_expect_flush(wire_t *w) {
+    if (!w->framed) return 0;
+
+    while (w->in_pos == w->in_len) {
+        uint8_t flags;
+        int len = read_header(w, &flags);
+        if (len < 0) break;
+        if (len == 0 && flags == 0) return 0;
+        if (!(flags & WIRE_CHANNEL_MASK)) break;
+        if (read_sideband(w, flags, len) < 0) return -1;
+    }
+
+    fprintf(stderr, "Transfer did not end at a message boundary\n");
+    return -1;
+}
+
+// Whether an idle connection has been closed by the peer. Only meaningful
+// between messages, when the peer has nothing left to send.
+int wire_peer_closed(wire_t *w) {
+    static const unsigned char marker[4];
+    // Replies end in a flush marker their reader may have left behind
+    while (w->framed && w->in_pos == w->in_len && w->raw_len - w->raw_pos >= 4 &&
+           memcmp(w->raw + w->raw_pos, marker, 4) == 0) {
+        w->raw_pos += 4;
+    }
+    if (w->raw_pos < w->raw_len) return 0;
+    struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+    if (poll(&pfd, 1, 0) <= 0) return 0;
+    char c;
+    return recv(w->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) <= 0;
+}
+
+// Whether input the peer sent is already buffered, so a reader would not
+// need the socket. Flush markers left behind by the last reply don't count.
+int wire_pending(wire_t *w) {
+    static const unsigned char marker[4];
+    while (w->framed && w->in_pos == w->in_len && w->raw_len - w->raw_pos >= 4 &&
+           memcmp(w->raw + w->raw_pos, marker, 4) == 0) {
+        w->raw_pos += 4;
+    }
+    return w->in_pos < w->in_len || w->raw_pos < w->raw_len;
+}
+
+int wire_has_sideband(const wire_t *w) {
+    return w->sideband;
+}
+
+// Send a message on the progress or error channel; a no-op without sideband
+int wire_sideband(wire_t *w, int channel, const char *msg) {
+    if (!w->sideband) return 0;
+    size_t len = strlen(msg);
+    if (len == 0) return 0;
+    if (len > WIRE_FRAME_MAX) len = WIRE_FRAME_MAX;
+    return send_frame(w, (uint8_t)(channel << WIRE_CHANNEL_SHIFT), msg, len, 0);
+}
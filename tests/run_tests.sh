@@ -7,6 +7,9 @@ FIT="$SCRIPT_DIR/../bin/fit"
 TEST_DIR=/tmp/fit_test_$$
 
 cleanup() {
+    if [ -n "$DAEMON_PID" ]; then
+        kill $DAEMON_PID 2>/dev/null || true
+    fi
     rm -rf $TEST_DIR
 }
 
@@ -146,5 +149,157 @@ OLDER_HASH=$($FIT log | grep "^commit " | tail -1 | awk '{print $2}')
 $FIT diff "$OLDER_HASH" 2>&1 | grep -q "Comparing commits" || { echo "FAIL: single-arg diff not working"; exit 1; }
 echo "PASS"
 
+# Test 20: Repack into a single pack with bitmaps
+echo "Test 20: Repack"
+$FIT repack | grep -q "Packed" || { echo "FAIL: repack did not pack objects"; exit 1; }
+ls .fit/objects/pack/*.bitmap >/dev/null 2>&1 || { echo "FAIL: repack wrote no bitmap"; exit 1; }
+$FIT show main | grep -q "Tree contents:" || { echo "FAIL: objects unreadable after repack"; exit 1; }
+$FIT verify | grep -q "passed" || { echo "FAIL: verify failed after repack"; exit 1; }
+echo "PASS"
+
+# Test 21: Switching branches removes files and updates the index
+echo "Test 21: Checkout removes files"
+$FIT checkout feature
+[ -f file2.txt ] || { echo "FAIL: file2.txt not checked out"; exit 1; }
+grep -q file2.txt .fit/index || { echo "FAIL: file2.txt not in index"; exit 1; }
+$FIT checkout main
+[ ! -e file2.txt ] || { echo "FAIL: file2.txt left behind"; exit 1; }
+grep -q file2.txt .fit/index && { echo "FAIL: file2.txt still in index"; exit 1; }
+echo "PASS"
+
+# Test 22: Sparse checkout keeps out-of-cone files in the index only
+echo "Test 22: Sparse checkout"
+mkdir -p docs/api src/lib
+echo "api" > docs/api/ref.txt
+echo "lib" > src/lib/code.txt
+$FIT add docs/api/ref.txt src/lib/code.txt
+$FIT commit -m "Add subdirectories"
+$FIT sparse-checkout set src/lib
+[ ! -e docs/api/ref.txt ] || { echo "FAIL: out-of-cone file still checked out"; exit 1; }
+[ -f src/lib/code.txt ] || { echo "FAIL: in-cone file removed"; exit 1; }
+grep -q docs/api/ref.txt .fit/index || { echo "FAIL: out-of-cone file dropped from index"; exit 1; }
+$FIT add docs/api/ref.txt 2>&1 | grep -q "outside the sparse-checkout cone" || { echo "FAIL: add accepted out-of-cone path"; exit 1; }
+$FIT sparse-checkout disable
+[ -f docs/api/ref.txt ] || { echo "FAIL: file not restored after disable"; exit 1; }
+echo "PASS"
+
+# Test 23: Packed refs are read, listed and deleted like loose ones
+echo "Test 23: Pack refs"
+$FIT branch packed-branch
+$FIT pack-refs
+[ ! -e .fit/refs/heads/packed-branch ] || { echo "FAIL: loose ref left after pack-refs"; exit 1; }
+grep -q "heads/packed-branch" .fit/packed-refs || { echo "FAIL: ref not in packed-refs"; exit 1; }
+$FIT branch | grep -q packed-branch || { echo "FAIL: packed branch not listed"; exit 1; }
+$FIT show packed-branch | grep -q "commit" || { echo "FAIL: packed branch not resolved"; exit 1; }
+$FIT branch -d packed-branch
+$FIT branch | grep -q packed-branch && { echo "FAIL: packed branch not deleted"; exit 1; }
+ls .fit/refs/heads/*.lock 2>/dev/null && { echo "FAIL: lock file left behind"; exit 1; }
+echo "PASS"
+
+# Test 24: Converting to reftable keeps every ref and logs later updates
+echo "Test 24: Reftable"
+$FIT branch table-branch
+$FIT pack-refs --reftable
+[ -e .fit/reftable/tables.list ] || { echo "FAIL: no reftable stack"; exit 1; }
+[ ! -e .fit/packed-refs ] || { echo "FAIL: packed-refs left after conversion"; exit 1; }
+[ ! -e .fit/refs/heads/table-branch ] || { echo "FAIL: loose ref left after conversion"; exit 1; }
+$FIT branch | grep -q table-branch || { echo "FAIL: reftable branch not listed"; exit 1; }
+$FIT show table-branch | grep -q "commit" || { echo "FAIL: reftable branch not resolved"; exit 1; }
+$FIT branch -d table-branch
+$FIT branch | grep -q table-branch && { echo "FAIL: reftable branch not deleted"; exit 1; }
+$FIT reflog heads/table-branch | grep -q "deleted" || { echo "FAIL: deletion not logged"; exit 1; }
+ls .fit/reftable/*.lock 2>/dev/null && { echo "FAIL: lock file left behind"; exit 1; }
+echo "PASS"
+
+# The network tests talk to a daemon on the loopback; clients use port 9418
+REMOTE=$TEST_DIR/remote
+mkdir -p $REMOTE
+cd $REMOTE
+$FIT init > /dev/null
+echo "one" > a.txt
+$FIT add a.txt > /dev/null
+$FIT commit -m "First remote" > /dev/null
+FIRST_REMOTE=$($FIT log | head -1 | cut -d" " -f2)
+echo "two" > b.txt
+$FIT add b.txt > /dev/null
+$FIT commit -m "Second remote" > /dev/null
+echo "three" > a.txt
+$FIT add a.txt > /dev/null
+$FIT commit -m "Third remote" > /dev/null
+$FIT daemon --port 9418 > $TEST_DIR/daemon.log 2>&1 &
+DAEMON_PID=$!
+for i in $(seq 50); do
+    (exec 3<> /dev/tcp/127.0.0.1/9418) 2> /dev/null && break
+    sleep 0.1
+done
+
+# Test 25: Clone from a daemon
+echo "Test 25: Clone"
+kill -0 $DAEMON_PID 2> /dev/null || { echo "FAIL: daemon did not start on port 9418"; exit 1; }
+mkdir -p $TEST_DIR/clone1 $TEST_DIR/clone2
+cd $TEST_DIR/clone2
+$FIT clone localhost main > /dev/null 2>&1
+cd $TEST_DIR/clone1
+$FIT clone localhost main > /dev/null 2>&1
+[ "$(cat a.txt)" = "three" ] || { echo "FAIL: cloned file has wrong content"; exit 1; }
+[ -f b.txt ] || { echo "FAIL: cloned file missing"; exit 1; }
+grep -q "refs/heads/main" .fit/HEAD || { echo "FAIL: clone did not check out main"; exit 1; }
+[ "$($FIT log | grep -c '^commit')" = "3" ] || { echo "FAIL: cloned history incomplete"; exit 1; }
+echo "PASS"
+
+# Test 26: Pull fast-forwards to a pushed commit and refuses diverged history
+echo "Test 26: Push and pull"
+echo "four" > c.txt
+$FIT add c.txt > /dev/null
+$FIT commit -m "Fourth local" > /dev/null
+$FIT push localhost main 2>&1 | grep -q "main: updated" || { echo "FAIL: push not applied"; exit 1; }
+cd $TEST_DIR/clone2
+$FIT pull localhost main > /dev/null 2>&1
+[ "$(cat c.txt)" = "four" ] || { echo "FAIL: pull did not update the working tree"; exit 1; }
+$FIT log | grep -q "Fourth local" || { echo "FAIL: pull did not move the branch"; exit 1; }
+echo "diverged" > d.txt
+$FIT add d.txt > /dev/null
+$FIT commit -m "Diverged" > /dev/null
+cd $TEST_DIR/clone1
+echo "five" > c.txt
+$FIT add c.txt > /dev/null
+$FIT commit -m "Fifth local" > /dev/null
+$FIT push localhost main > /dev/null 2>&1
+cd $TEST_DIR/clone2
+$FIT pull localhost main 2>&1 | grep -q "not a fast-forward" || { echo "FAIL: diverged pull not rejected"; exit 1; }
+$FIT log | head -5 | grep -q "Diverged" || { echo "FAIL: rejected pull moved the branch"; exit 1; }
+[ "$(cat c.txt)" = "four" ] || { echo "FAIL: rejected pull changed the working tree"; exit 1; }
+echo "PASS"
+
+# Test 27: The daemon refuses a push that would drop the remote's commits
+echo "Test 27: Non-fast-forward push"
+$FIT push localhost main 2>&1 | grep -q "non-fast-forward" || { echo "FAIL: diverged push not rejected"; exit 1; }
+cd $TEST_DIR/clone1
+$FIT pull localhost main 2>&1 | grep -q "Already up to date" || { echo "FAIL: rejected push moved the remote branch"; exit 1; }
+echo "PASS"
+
+# Test 28: Shallow clone, then deepen it by one commit
+echo "Test 28: Shallow clone and deepen"
+mkdir -p $TEST_DIR/shallow
+cd $TEST_DIR/shallow
+$FIT clone localhost main --depth 1 > /dev/null 2>&1
+[ "$($FIT log | grep -c '^commit')" = "1" ] || { echo "FAIL: depth 1 clone has more history"; exit 1; }
+[ -s .fit/shallow ] || { echo "FAIL: shallow boundary not recorded"; exit 1; }
+$FIT fetch localhost --deepen 1 > /dev/null 2>&1
+[ "$($FIT log | grep -c '^commit')" = "2" ] || { echo "FAIL: deepen did not fetch the parent"; exit 1; }
+echo "PASS"
+
+# Test 29: Partial clone fetches missing blobs on checkout
+echo "Test 29: Partial clone"
+mkdir -p $TEST_DIR/partial
+cd $TEST_DIR/partial
+$FIT clone localhost main --filter=blob:none > /dev/null 2>&1
+[ -f .fit/promisor ] || { echo "FAIL: partial clone not marked"; exit 1; }
+[ "$(cat c.txt)" = "five" ] || { echo "FAIL: partial clone checkout missing blobs"; exit 1; }
+$FIT checkout $FIRST_REMOTE > /dev/null 2>&1
+[ "$(cat a.txt)" = "one" ] || { echo "FAIL: old blob not fetched on checkout"; exit 1; }
+[ ! -e b.txt ] || { echo "FAIL: checkout kept a file from the newer tree"; exit 1; }
+echo "PASS"
+
 echo ""
 echo "=== All tests passed ==="